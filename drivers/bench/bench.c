@@ -0,0 +1,91 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+
+#include "nmictrl.h"
+#include "tracering.h"
+#include "bench_lockup.h"
+#include "bench_c2c.h"
+#include "bench_fhook.h"
+#include "bench_bcast.h"
+#include "bench_dispatch.h"
+#include "bench_unload.h"
+
+static unsigned int bench_duration_ms = 5000;
+module_param(bench_duration_ms, uint, 0444);
+MODULE_PARM_DESC(bench_duration_ms, "Measuring window of each benchmark (millisec)");
+
+static unsigned int bench_lockup_period_ms = 10;
+module_param(bench_lockup_period_ms, uint, 0444);
+MODULE_PARM_DESC(bench_lockup_period_ms, "Check period of the lockup detector benchmark (millisec)");
+
+static unsigned int bench_c2c_round_trips = BENCH_C2C_DEFAULT_ROUND_TRIPS;
+module_param(bench_c2c_round_trips, uint, 0444);
+MODULE_PARM_DESC(bench_c2c_round_trips, "Round trips per CPU pair of the core-to-core latency benchmark (0 to skip)");
+
+static unsigned int bench_fhook_calls = BENCH_FHOOK_DEFAULT_CALLS;
+module_param(bench_fhook_calls, uint, 0444);
+MODULE_PARM_DESC(bench_fhook_calls, "Calls per loop of the fhook probe benchmark (0 to skip)");
+
+static unsigned int bench_bcast_rounds = BENCH_BCAST_DEFAULT_ROUNDS;
+module_param(bench_bcast_rounds, uint, 0444);
+MODULE_PARM_DESC(bench_bcast_rounds, "Broadcasts per mode of the flat versus NUMA tree broadcast benchmark (0 to skip)");
+
+static unsigned int bench_dispatch_rounds = BENCH_DISPATCH_DEFAULT_ROUNDS;
+module_param(bench_dispatch_rounds, uint, 0444);
+MODULE_PARM_DESC(bench_dispatch_rounds, "Self-NMIs per kind of handler of the builtin versus registered dispatch benchmark (0 to skip)");
+
+static unsigned int bench_unload_rounds = BENCH_UNLOAD_DEFAULT_ROUNDS;
+module_param(bench_unload_rounds, uint, 0444);
+MODULE_PARM_DESC(bench_unload_rounds, "Shutdowns of the nmictrl system under load (0 to skip)");
+
+static struct dentry *bench_debugfs_dir = NULL;
+
+static int __init bench_nmdbg_init(void)
+{
+	if (!!nmictrl_startup())
+		goto err;
+	if (!!tracering_startup(TRACERING_DEFAULT_SIZE, NULL))
+		goto err_nmictrl;
+
+	bench_debugfs_dir = debugfs_create_dir("nmdbg-bench", NULL);
+	if (IS_ERR(bench_debugfs_dir))
+		bench_debugfs_dir = NULL;
+
+	(void) bench_lockup_run(bench_lockup_period_ms, bench_duration_ms);
+	if (!!bench_c2c_round_trips)
+		(void) bench_c2c_run(bench_c2c_round_trips, bench_debugfs_dir);
+	if (!!bench_fhook_calls)
+		(void) bench_fhook_run(bench_fhook_calls);
+	if (!!bench_bcast_rounds)
+		(void) bench_bcast_run(bench_bcast_rounds, bench_debugfs_dir);
+	if (!!bench_dispatch_rounds)
+		(void) bench_dispatch_run(bench_dispatch_rounds);
+	/* Last, it restarts the nmictrl system */
+	if (!!bench_unload_rounds)
+		(void) bench_unload_run(bench_unload_rounds);
+	return 0;
+
+err_nmictrl:
+	nmictrl_shutdown_sync();
+err:
+	return -1;
+}
+
+static void __exit bench_nmdbg_exit(void)
+{
+	bench_bcast_cleanup();
+	bench_c2c_cleanup();
+	debugfs_remove_recursive(bench_debugfs_dir);
+	nmictrl_shutdown_sync();
+	tracering_shutdown();
+	return;
+}
+
+module_init(bench_nmdbg_init);
+module_exit(bench_nmdbg_exit);
+
+MODULE_VERSION("bench_" NMDBG_MODULE_VER);
+MODULE_LICENSE(NMDBG_MODULE_LICENSE);
+MODULE_AUTHOR(NMDBG_MODULE_AUTHOR);
+MODULE_DESCRIPTION("Benchmarks for " NMDBG_MODULE_DESC);
\ No newline at end of file
@@ -0,0 +1,18 @@
+#ifndef _NMIDBG_BENCH_H
+#define _NMIDBG_BENCH_H
+
+#include <linux/types.h>
+#include <linux/math64.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+/**
+ * @brief Convert TSC cycles into nanoseconds.
+ */
+static inline u64 bench_cycles_to_ns(u64 cycles)
+{
+	return !!tsc_khz ? div_u64(cycles * 1000000ULL, tsc_khz) : cycles;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include "bench_bcast.h"
+
+#include <linux/kernel.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+
+#include "nmictrl.h"
+#include "tscsync.h"
+
+#define BENCH_BCAST_HANDLER_NAME "bench_bcast"
+
+/* Maximum time to wait for all CPUs of a round (microsec) */
+#define BENCH_BCAST_ROUND_TIMEOUT 1000000
+
+#define BENCH_BCAST_NR_MODES 2
+
+/**
+ * @brief Internal sums of a node over all rounds of a mode (cycles).
+ */
+typedef struct {
+	/** Latency until the last CPU of the node arrived */
+	u64 last;
+	/** Spread of the arrivals within the node */
+	u64 spread;
+} bench_bcast_node_t;
+
+/**
+ * @brief Internal result of a mode.
+ */
+typedef struct {
+	/** Spread of the arrivals over all CPUs, summed over the rounds (cycles) */
+	u64 skew;
+	/** Latency until the last CPU arrived, summed over the rounds (cycles) */
+	u64 last;
+	/** Rounds completed */
+	unsigned int nr_rounds;
+	/** Per-node sums, indexed by node id */
+	bench_bcast_node_t *nodes;
+} bench_bcast_result_t;
+
+static const char * const bench_bcast_mode_names[BENCH_BCAST_NR_MODES] = {
+	[NMICTRL_BCAST_FLAT] = "flat",
+	[NMICTRL_BCAST_TREE] = "tree",
+};
+
+static DEFINE_PER_CPU(u64, bench_bcast_arrival);
+static atomic_t bench_bcast_nr_done = ATOMIC_INIT(0);
+
+static char *bench_bcast_text = NULL;
+static size_t bench_bcast_text_len = 0;
+static struct dentry *bench_bcast_file = NULL;
+
+/**
+ * @brief Internal NMI function to stamp the arrival of the broadcast.
+ */
+static nmictrl_ret_t bench_bcast_nmifn(struct pt_regs *regs)
+{
+	this_cpu_write(bench_bcast_arrival, rdtsc_ordered());
+	smp_mb__before_atomic();
+	atomic_inc(&bench_bcast_nr_done);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to run a single broadcast and add its timing to @p result.
+ *
+ * @return
+ * 	0 if all online CPUs arrived.
+ */
+static int bench_bcast_round(bench_bcast_result_t *result, u64 *node_min, u64 *node_max)
+{
+	unsigned long timeout = BENCH_BCAST_ROUND_TIMEOUT;
+	unsigned int cpu, nr_expected = num_online_cpus();
+	u64 send, lat, min_lat = U64_MAX, max_lat = 0;
+	int node;
+
+	for_each_online_node(node) {
+		node_min[node] = U64_MAX;
+		node_max[node] = 0;
+	}
+
+	atomic_set(&bench_bcast_nr_done, 0);
+	for_each_online_cpu(cpu)
+		nmictrl_prepare_handler(BENCH_BCAST_HANDLER_NAME, cpu);
+	send = tscsync_correct(get_cpu(), rdtsc_ordered());
+	nmictrl_trigger_all();
+	put_cpu();
+
+	while (atomic_read(&bench_bcast_nr_done) != nr_expected) {
+		if (!timeout--)
+			return -1;
+		udelay(1);
+	}
+	smp_rmb();
+
+	for_each_online_cpu(cpu) {
+		/* Arrivals are read on other sockets; bring them into the timebase of the reference CPU */
+		u64 arrival = tscsync_correct(cpu, per_cpu(bench_bcast_arrival, cpu));
+
+		node = cpu_to_node(cpu);
+		lat = (arrival > send) ? arrival - send : 0;
+		min_lat = min(min_lat, lat);
+		max_lat = max(max_lat, lat);
+		node_min[node] = min(node_min[node], lat);
+		node_max[node] = max(node_max[node], lat);
+	}
+
+	result->skew += max_lat - min_lat;
+	result->last += max_lat;
+	for_each_online_node(node) {
+		if (node_min[node] == U64_MAX)
+			continue;
+		result->nodes[node].last += node_max[node];
+		result->nodes[node].spread += node_max[node] - node_min[node];
+	}
+	result->nr_rounds++;
+	return 0;
+}
+
+/**
+ * @brief Internal function to convert a sum of cycles over the rounds into nanosec per round.
+ */
+static __always_inline u64 bench_bcast_avg_ns(u64 cycles, const bench_bcast_result_t *result)
+{
+	return !!result->nr_rounds ? div_u64(bench_cycles_to_ns(cycles), result->nr_rounds) : 0;
+}
+
+/**
+ * @brief Internal function to render the per-node table as text (nanosec per round).
+ */
+static int bench_bcast_render(const bench_bcast_result_t *results)
+{
+	size_t size = (size_t)(nr_node_ids + 8) * 96;
+	size_t len = 0;
+	char *text = vmalloc(size);
+	unsigned int mode;
+	int node;
+
+	if (text == NULL)
+		return -1;
+
+	len += scnprintf(text + len, size - len, "%6s %8s %8s %8s\n", "mode", "rounds", "skew", "last");
+	for (mode = 0; mode < BENCH_BCAST_NR_MODES; mode++)
+		len += scnprintf(text + len, size - len, "%6s %8u %8llu %8llu\n",
+			bench_bcast_mode_names[mode], results[mode].nr_rounds,
+			bench_bcast_avg_ns(results[mode].skew, &results[mode]),
+			bench_bcast_avg_ns(results[mode].last, &results[mode]));
+
+	len += scnprintf(text + len, size - len, "\n%6s %6s %12s %12s %12s %12s\n",
+		"node", "cpus", "flat_last", "flat_spread", "tree_last", "tree_spread");
+	for_each_online_node(node) {
+		const bench_bcast_node_t *flat = &results[NMICTRL_BCAST_FLAT].nodes[node];
+		const bench_bcast_node_t *tree = &results[NMICTRL_BCAST_TREE].nodes[node];
+
+		len += scnprintf(text + len, size - len, "%6d %6u %12llu %12llu %12llu %12llu\n",
+			node, cpumask_weight(cpumask_of_node(node)),
+			bench_bcast_avg_ns(flat->last, &results[NMICTRL_BCAST_FLAT]),
+			bench_bcast_avg_ns(flat->spread, &results[NMICTRL_BCAST_FLAT]),
+			bench_bcast_avg_ns(tree->last, &results[NMICTRL_BCAST_TREE]),
+			bench_bcast_avg_ns(tree->spread, &results[NMICTRL_BCAST_TREE]));
+	}
+
+	bench_bcast_text = text;
+	bench_bcast_text_len = len;
+	return 0;
+}
+
+static ssize_t bench_bcast_read(struct file *filp, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	return simple_read_from_buffer(ubuf, count, ppos, bench_bcast_text, bench_bcast_text_len);
+}
+
+static const struct file_operations bench_bcast_fops = {
+	.owner = THIS_MODULE,
+	.read = bench_bcast_read,
+	.llseek = default_llseek,
+};
+
+int bench_bcast_run(unsigned int rounds, struct dentry *debugfs_dir)
+{
+	bench_bcast_result_t results[BENCH_BCAST_NR_MODES];
+	nmictrl_bcast_t saved_mode = nmictrl_get_bcast();
+	u64 *node_min = NULL, *node_max = NULL;
+	unsigned int mode, round;
+	int corrected, tree_skipped = 0, ret = -1;
+
+	if (rounds == 0 || bench_bcast_text != NULL)
+		return -1;
+
+	if (!!tscsync_startup(NULL)) {
+		pr_info("bench_bcast: failed to start the tscsync subsystem\n");
+		return -1;
+	}
+
+	memset(results, 0, sizeof(results));
+	get_online_cpus();
+
+	corrected = !tscsync_measure(TSCSYNC_MODE_PAIR, TSCSYNC_DEFAULT_ROUNDS);
+	if (!corrected)
+		pr_info("bench_bcast: failed to measure the TSC skew; the numbers are uncorrected\n");
+
+	node_min = kcalloc(nr_node_ids, sizeof(*node_min), GFP_KERNEL);
+	node_max = kcalloc(nr_node_ids, sizeof(*node_max), GFP_KERNEL);
+	if (node_min == NULL || node_max == NULL)
+		goto out_unlock;
+	for (mode = 0; mode < BENCH_BCAST_NR_MODES; mode++) {
+		results[mode].nodes = kcalloc(nr_node_ids, sizeof(*results[mode].nodes), GFP_KERNEL);
+		if (results[mode].nodes == NULL)
+			goto out_unlock;
+	}
+
+	if (!!nmictrl_add_handler(BENCH_BCAST_HANDLER_NAME, &bench_bcast_nmifn))
+		goto out_unlock;
+
+	for (mode = 0; mode < BENCH_BCAST_NR_MODES; mode++) {
+		nmictrl_set_bcast((nmictrl_bcast_t)mode);
+		if (nmictrl_get_bcast() != (nmictrl_bcast_t)mode) {
+			pr_info("bench_bcast: %s mode is not available; skipped\n", bench_bcast_mode_names[mode]);
+			tree_skipped = 1;
+			continue;
+		}
+		for (round = 0; round < rounds; round++) {
+			if (!!bench_bcast_round(&results[mode], node_min, node_max)) {
+				pr_info("bench_bcast: %s round %u timed out\n", bench_bcast_mode_names[mode], round);
+				break;
+			}
+		}
+	}
+	nmictrl_set_bcast(saved_mode);
+
+	/* This waits for CPUs of a timed-out round still in the NMI */
+	nmictrl_del_handler(BENCH_BCAST_HANDLER_NAME);
+
+	pr_info("bench_bcast: %u cpus on %u nodes, %u rounds per mode, TSC skew %s\n",
+		num_online_cpus(), num_online_nodes(), rounds, !!corrected ? "corrected" : "uncorrected");
+	for (mode = 0; mode < BENCH_BCAST_NR_MODES; mode++)
+		pr_info("bench_bcast: %s skew %llu ns, last arrival %llu ns (%u rounds)\n",
+			bench_bcast_mode_names[mode],
+			bench_bcast_avg_ns(results[mode].skew, &results[mode]),
+			bench_bcast_avg_ns(results[mode].last, &results[mode]),
+			results[mode].nr_rounds);
+
+	if (!!bench_bcast_render(results))
+		goto out_unlock;
+
+	if (debugfs_dir != NULL) {
+		bench_bcast_file = debugfs_create_file(BENCH_BCAST_FILE_NAME, 0400, debugfs_dir, NULL, &bench_bcast_fops);
+		if (IS_ERR_OR_NULL(bench_bcast_file))
+			bench_bcast_file = NULL;
+	}
+	ret = (results[NMICTRL_BCAST_FLAT].nr_rounds == rounds &&
+		(results[NMICTRL_BCAST_TREE].nr_rounds == rounds || !!tree_skipped)) ? 0 : -1;
+
+out_unlock:
+	put_online_cpus();
+	tscsync_shutdown();
+	for (mode = 0; mode < BENCH_BCAST_NR_MODES; mode++)
+		kfree(results[mode].nodes);
+	kfree(node_max);
+	kfree(node_min);
+	return ret;
+}
+
+void bench_bcast_cleanup(void)
+{
+	debugfs_remove(bench_bcast_file);
+	bench_bcast_file = NULL;
+	vfree(bench_bcast_text);
+	bench_bcast_text = NULL;
+	bench_bcast_text_len = 0;
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef _NMIDBG_BENCH_BCAST_H
+#define _NMIDBG_BENCH_BCAST_H
+
+#include <linux/dcache.h>
+
+#include "bench.h"
+
+#define BENCH_BCAST_DEFAULT_ROUNDS 1000
+#define BENCH_BCAST_FILE_NAME "bcast"
+
+/**
+ * @brief Compare the NMI delivery timing of the flat and the NUMA tree broadcasts.
+ *
+ * Every round triggers all online CPUs, and each CPU stamps the TSC when its handler starts.
+ * Per NUMA node, the latency until the last CPU of the node arrived and the spread of arrivals within the node
+ * are averaged over the rounds; the machine-wide skew is the spread over all CPUs.
+ * Arrivals are corrected with the TSC skew measured by the tscsync subsys, which is started and shut down here;
+ * if the measurement fails, the numbers are reported as uncorrected.
+ *
+ * The per-node table is exported through @p debugfs_dir.
+ * The nmictrl coresys must be started before.
+ *
+ * @param rounds
+ * 	number of broadcasts per mode
+ * @param debugfs_dir
+ * 	debugfs directory to create the table file in (NULL to only log a summary)
+ * @return
+ * 	0 if every round of both modes completed.
+ */
+int bench_bcast_run(unsigned int rounds, struct dentry *debugfs_dir);
+
+/**
+ * @brief Remove the table file and release the table.
+ */
+void bench_bcast_cleanup(void);
+
+#endif
\ No newline at end of file
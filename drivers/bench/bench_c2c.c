@@ -0,0 +1,335 @@
+#include "bench_c2c.h"
+
+#include <linux/kernel.h>
+#include <linux/cache.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+
+#include "nmictrl.h"
+
+#define BENCH_C2C_HANDLER_NAME "bench_c2c"
+
+/* Maximum time a CPU waits for its partner inside the NMI (millisec) */
+#define BENCH_C2C_NMI_TIMEOUT_MS 100
+/* Maximum time to wait for all pairs of a round (microsec) */
+#define BENCH_C2C_ROUND_TIMEOUT 1000000
+
+/* A matrix cell of a pair which could not be measured */
+#define BENCH_C2C_FAILED ((u64)-1)
+
+/**
+ * @brief Internal ping-pong line shared by the two CPUs of a pair.
+ *
+ * Spread over two cache lines, so the adjacent-line prefetcher never couples two pairs.
+ */
+typedef struct {
+	u64 seq;
+} __aligned(2 * SMP_CACHE_BYTES) bench_c2c_line_t;
+
+/**
+ * @brief Internal per-cpu role in the current round.
+ */
+typedef struct {
+	/** Line shared with the partner */
+	bench_c2c_line_t *line;
+	/** Starts every round trip or not */
+	int ping;
+	/** Cycles taken by all round trips (written by the ping side, 0 on timeout) */
+	u64 cycles;
+} bench_c2c_role_t;
+
+static DEFINE_PER_CPU(bench_c2c_role_t, bench_c2c_roles);
+
+static atomic_t bench_c2c_nr_done = ATOMIC_INIT(0);
+static unsigned int bench_c2c_round_trips = BENCH_C2C_DEFAULT_ROUND_TRIPS;
+static u64 bench_c2c_timeout_cycles = 0;
+
+static char *bench_c2c_text = NULL;
+static size_t bench_c2c_text_len = 0;
+static struct dentry *bench_c2c_file = NULL;
+
+/**
+ * @brief Internal function to spin until the line holds @p val.
+ *
+ * No 'pause' in the loop; it would add its own latency to every round trip.
+ */
+static __always_inline int bench_c2c_wait(u64 *seq, u64 val, u64 deadline)
+{
+	unsigned int spins = 0;
+
+	while (READ_ONCE(*seq) != val) {
+		if (unlikely(!(++spins & 0xffff)) && rdtsc() > deadline)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal NMI function to ping-pong the line of a pair.
+ *
+ * The ping side writes odd values and the pong side answers with the next even value.
+ * The first exchange is a rendezvous which proves both CPUs are in the NMI; it is not timed.
+ */
+static nmictrl_ret_t bench_c2c_nmifn(struct pt_regs *regs)
+{
+	bench_c2c_role_t *role = this_cpu_ptr(&bench_c2c_roles);
+	u64 *seq = &role->line->seq;
+	u64 last = 2 * ((u64)bench_c2c_round_trips + 1);
+	u64 deadline = rdtsc() + bench_c2c_timeout_cycles;
+	u64 begin, val;
+
+	if (!!role->ping) {
+		role->cycles = 0;
+		WRITE_ONCE(*seq, 1);
+		if (!!bench_c2c_wait(seq, 2, deadline))
+			goto out;
+
+		begin = rdtsc();
+		for (val = 3; val < last; val += 2) {
+			WRITE_ONCE(*seq, val);
+			if (!!bench_c2c_wait(seq, val + 1, deadline))
+				goto out;
+		}
+		role->cycles = rdtsc() - begin;
+	} else {
+		for (val = 1; val < last; val += 2) {
+			if (!!bench_c2c_wait(seq, val, deadline))
+				goto out;
+			WRITE_ONCE(*seq, val + 1);
+		}
+	}
+
+out:
+	smp_mb__before_atomic();
+	atomic_inc(&bench_c2c_nr_done);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to get the CPU index at a position of a tournament round.
+ *
+ * Position 0 is fixed and the others rotate by one every round (circle method).
+ */
+static __always_inline unsigned int bench_c2c_position(unsigned int pos, unsigned int round, unsigned int nr_slots)
+{
+	return (pos == 0) ? 0 : 1 + (pos - 1 + round) % (nr_slots - 1);
+}
+
+/**
+ * @brief Internal function to run a single round of disjoint pairs.
+ *
+ * @return
+ * 	0 if all CPUs of the round left the NMI.
+ */
+static int bench_c2c_round(const unsigned int *cpus, unsigned int nr_cpus, unsigned int nr_slots,
+	unsigned int round, bench_c2c_line_t *lines, u64 *matrix)
+{
+	cpumask_t round_mask;
+	unsigned int pos, cpu, nr_expected = 0;
+	unsigned long timeout = BENCH_C2C_ROUND_TIMEOUT;
+
+	cpumask_clear(&round_mask);
+	atomic_set(&bench_c2c_nr_done, 0);
+
+	for (pos = 0; pos < nr_slots / 2; pos++) {
+		unsigned int a = bench_c2c_position(pos, round, nr_slots);
+		unsigned int b = bench_c2c_position(nr_slots - 1 - pos, round, nr_slots);
+
+		/* The dummy slot of an odd CPU count sits out */
+		if (a >= nr_cpus || b >= nr_cpus)
+			continue;
+
+		lines[pos].seq = 0;
+		per_cpu(bench_c2c_roles, cpus[a]).line = &lines[pos];
+		per_cpu(bench_c2c_roles, cpus[a]).ping = 1;
+		per_cpu(bench_c2c_roles, cpus[b]).line = &lines[pos];
+		per_cpu(bench_c2c_roles, cpus[b]).ping = 0;
+		cpumask_set_cpu(cpus[a], &round_mask);
+		cpumask_set_cpu(cpus[b], &round_mask);
+		nr_expected += 2;
+	}
+	smp_wmb();
+
+	for_each_cpu(cpu, &round_mask)
+		nmictrl_prepare_handler(BENCH_C2C_HANDLER_NAME, cpu);
+	nmictrl_trigger_mask(&round_mask);
+
+	while (atomic_read(&bench_c2c_nr_done) != nr_expected) {
+		if (!timeout--)
+			return -1;
+		udelay(1);
+	}
+	smp_rmb();
+
+	for (pos = 0; pos < nr_slots / 2; pos++) {
+		unsigned int a = bench_c2c_position(pos, round, nr_slots);
+		unsigned int b = bench_c2c_position(nr_slots - 1 - pos, round, nr_slots);
+		u64 cycles;
+
+		if (a >= nr_cpus || b >= nr_cpus)
+			continue;
+
+		cycles = per_cpu(bench_c2c_roles, cpus[a]).cycles;
+		if (cycles == 0)
+			cycles = BENCH_C2C_FAILED;
+		matrix[a * nr_cpus + b] = cycles;
+		matrix[b * nr_cpus + a] = cycles;
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal function to render the matrix as text (one-way latency in nanosec).
+ */
+static int bench_c2c_render(const unsigned int *cpus, unsigned int nr_cpus, const u64 *matrix)
+{
+	/* "%6u" per cell, a row label and a newline per row */
+	size_t size = (size_t)(nr_cpus + 1) * (nr_cpus + 1) * 7 + 64;
+	unsigned int row, col;
+	size_t len = 0;
+	char *text = vmalloc(size);
+
+	if (text == NULL)
+		return -1;
+
+	len += scnprintf(text + len, size - len, "%6s", "cpu");
+	for (col = 0; col < nr_cpus; col++)
+		len += scnprintf(text + len, size - len, " %6u", cpus[col]);
+	len += scnprintf(text + len, size - len, "\n");
+
+	for (row = 0; row < nr_cpus; row++) {
+		len += scnprintf(text + len, size - len, "%6u", cpus[row]);
+		for (col = 0; col < nr_cpus; col++) {
+			u64 cycles = matrix[row * nr_cpus + col];
+
+			if (row == col)
+				len += scnprintf(text + len, size - len, " %6s", "-");
+			else if (cycles == BENCH_C2C_FAILED)
+				len += scnprintf(text + len, size - len, " %6s", "?");
+			else
+				len += scnprintf(text + len, size - len, " %6llu",
+					div_u64(bench_cycles_to_ns(cycles), 2 * bench_c2c_round_trips));
+		}
+		len += scnprintf(text + len, size - len, "\n");
+	}
+
+	bench_c2c_text = text;
+	bench_c2c_text_len = len;
+	return 0;
+}
+
+static ssize_t bench_c2c_read(struct file *filp, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	return simple_read_from_buffer(ubuf, count, ppos, bench_c2c_text, bench_c2c_text_len);
+}
+
+static const struct file_operations bench_c2c_fops = {
+	.owner = THIS_MODULE,
+	.read = bench_c2c_read,
+	.llseek = default_llseek,
+};
+
+int bench_c2c_run(unsigned int round_trips, struct dentry *debugfs_dir)
+{
+	unsigned int *cpus = NULL;
+	bench_c2c_line_t *lines = NULL;
+	u64 *matrix = NULL;
+	unsigned int cpu, idx, nr_cpus = 0, nr_slots, round, nr_failed = 0;
+	u64 min_cycles = BENCH_C2C_FAILED, max_cycles = 0, sum_cycles = 0, nr_pairs = 0;
+	int ret = -1;
+
+	if (round_trips == 0 || bench_c2c_text != NULL)
+		return -1;
+	bench_c2c_round_trips = round_trips;
+	bench_c2c_timeout_cycles = (u64)tsc_khz * BENCH_C2C_NMI_TIMEOUT_MS;
+
+	get_online_cpus();
+
+	cpus = kcalloc(num_online_cpus(), sizeof(*cpus), GFP_KERNEL);
+	if (cpus == NULL)
+		goto out_unlock;
+	for_each_online_cpu(cpu)
+		cpus[nr_cpus++] = cpu;
+	if (nr_cpus < 2) {
+		pr_info("bench_c2c: needs at least 2 online cpus\n");
+		goto out_unlock;
+	}
+	nr_slots = nr_cpus + (nr_cpus & 1);
+
+	lines = kcalloc(nr_slots / 2, sizeof(*lines), GFP_KERNEL);
+	matrix = vzalloc(sizeof(*matrix) * nr_cpus * nr_cpus);
+	if (lines == NULL || matrix == NULL)
+		goto out_unlock;
+
+	if (!!nmictrl_add_handler(BENCH_C2C_HANDLER_NAME, &bench_c2c_nmifn))
+		goto out_unlock;
+
+	for (round = 0; round < nr_slots - 1; round++) {
+		if (!!bench_c2c_round(cpus, nr_cpus, nr_slots, round, lines, matrix)) {
+			pr_info("bench_c2c: round %u timed out\n", round);
+			break;
+		}
+	}
+
+	/* This waits for CPUs of a timed-out round still touching the lines */
+	nmictrl_del_handler(BENCH_C2C_HANDLER_NAME);
+	if (round != nr_slots - 1)
+		goto out_unlock;
+
+	for (idx = 0; idx < nr_cpus * nr_cpus; idx++) {
+		u64 cycles = matrix[idx];
+
+		/* Count every pair once */
+		if (idx / nr_cpus >= idx % nr_cpus)
+			continue;
+		if (cycles == BENCH_C2C_FAILED) {
+			nr_failed++;
+			continue;
+		}
+		min_cycles = min(min_cycles, cycles);
+		max_cycles = max(max_cycles, cycles);
+		sum_cycles += cycles;
+		nr_pairs++;
+	}
+
+	pr_info("bench_c2c: %u cpus, %u rounds, %u round trips per pair, %u pairs failed\n",
+		nr_cpus, nr_slots - 1, round_trips, nr_failed);
+	if (!!nr_pairs)
+		pr_info("bench_c2c: one-way latency min %llu ns, avg %llu ns, max %llu ns\n",
+			div_u64(bench_cycles_to_ns(min_cycles), 2 * round_trips),
+			div64_u64(bench_cycles_to_ns(sum_cycles), 2 * round_trips * nr_pairs),
+			div_u64(bench_cycles_to_ns(max_cycles), 2 * round_trips));
+
+	if (!!bench_c2c_render(cpus, nr_cpus, matrix))
+		goto out_unlock;
+
+	if (debugfs_dir != NULL) {
+		bench_c2c_file = debugfs_create_file(BENCH_C2C_FILE_NAME, 0400, debugfs_dir, NULL, &bench_c2c_fops);
+		if (IS_ERR_OR_NULL(bench_c2c_file))
+			bench_c2c_file = NULL;
+	}
+	ret = !!nr_failed ? -1 : 0;
+
+out_unlock:
+	put_online_cpus();
+	vfree(matrix);
+	kfree(lines);
+	kfree(cpus);
+	return ret;
+}
+
+void bench_c2c_cleanup(void)
+{
+	debugfs_remove(bench_c2c_file);
+	bench_c2c_file = NULL;
+	vfree(bench_c2c_text);
+	bench_c2c_text = NULL;
+	bench_c2c_text_len = 0;
+}
\ No newline at end of file
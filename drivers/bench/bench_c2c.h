@@ -0,0 +1,35 @@
+#ifndef _NMIDBG_BENCH_C2C_H
+#define _NMIDBG_BENCH_C2C_H
+
+#include <linux/dcache.h>
+
+#include "bench.h"
+
+#define BENCH_C2C_DEFAULT_ROUND_TRIPS 1000
+#define BENCH_C2C_FILE_NAME "c2c"
+
+/**
+ * @brief Measure the core-to-core cache line latency of every pair of online CPUs.
+ *
+ * Both CPUs of a pair ping-pong a cache line inside an NMI, so nothing can preempt or interrupt them.
+ * Pairs are scheduled as a round-robin tournament: every round runs a set of disjoint pairs in parallel,
+ * and N - 1 rounds (N rounded up to even) cover all N * (N - 1) / 2 pairs.
+ *
+ * The resulting N x N matrix of one-way latencies (nanosec) is exported through @p debugfs_dir.
+ * The nmictrl coresys must be started before.
+ *
+ * @param round_trips
+ * 	number of round trips per pair
+ * @param debugfs_dir
+ * 	debugfs directory to create the matrix file in (NULL to only log a summary)
+ * @return
+ * 	0 if every pair was measured.
+ */
+int bench_c2c_run(unsigned int round_trips, struct dentry *debugfs_dir);
+
+/**
+ * @brief Remove the matrix file and release the matrix.
+ */
+void bench_c2c_cleanup(void);
+
+#endif
\ No newline at end of file
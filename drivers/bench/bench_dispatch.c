@@ -0,0 +1,183 @@
+#include "bench_dispatch.h"
+
+#include <linux/kernel.h>
+#include <linux/smp.h>
+#include <linux/irqflags.h>
+#include <linux/percpu.h>
+#include <asm/cpufeature.h>
+
+#include "nmictrl.h"
+
+#define BENCH_DISPATCH_HANDLER_NAME "bench_dispatch"
+#define BENCH_DISPATCH_DECOY_NAME "bench_dispatch_decoy%u"
+
+/* Handlers walked before the measured one, as other subsystems would be */
+#define BENCH_DISPATCH_NR_DECOYS 7
+
+/* Maximum time to wait for a single NMI (millisec) */
+#define BENCH_DISPATCH_ROUND_TIMEOUT_MS 1000
+
+/**
+ * @brief Internal result of a kind of handler (cycles).
+ */
+typedef struct {
+	u64 sum;
+	u64 min;
+	unsigned int nr_rounds;
+} bench_dispatch_result_t;
+
+static DEFINE_PER_CPU(unsigned long, bench_dispatch_hits);
+
+static nmictrl_ret_t bench_dispatch_nmifn(struct pt_regs *regs)
+{
+	this_cpu_inc(bench_dispatch_hits);
+	return NMICTRL_HANDLED;
+}
+
+static nmictrl_ret_t bench_dispatch_decoy_nmifn(struct pt_regs *regs)
+{
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to read the hits of a kind of handler on the current CPU.
+ */
+static __always_inline unsigned long bench_dispatch_read_hits(int builtin, unsigned int cpu)
+{
+	return !!builtin ? nmictrl_get_probe_hits(cpu) : READ_ONCE(per_cpu(bench_dispatch_hits, cpu));
+}
+
+/**
+ * @brief Internal function to time the dispatch of a single self-NMI.
+ *
+ * Only the dispatch is counted, as stamped by the generic handler;
+ * the APIC send and the NMI entry and exit would bury the difference of a direct call.
+ * The NMI is taken on the current CPU, so it has returned once the hit is seen.
+ *
+ * @return
+ * 	0 if the handler ran in time.
+ */
+static int bench_dispatch_round(int builtin, bench_dispatch_result_t *result)
+{
+	u64 timeout = (u64)tsc_khz * BENCH_DISPATCH_ROUND_TIMEOUT_MS;
+	unsigned long flags, hits;
+	unsigned int cpu;
+	u64 begin, cycles = 0;
+	int ret = 0;
+
+	cpu = get_cpu();
+	local_irq_save(flags);
+	hits = bench_dispatch_read_hits(builtin, cpu);
+	if (!!builtin)
+		nmictrl_prepare_builtin(NMICTRL_BUILTIN_PROBE, cpu);
+	else
+		nmictrl_prepare_handler(BENCH_DISPATCH_HANDLER_NAME, cpu);
+
+	begin = rdtsc_ordered();
+	nmictrl_trigger_self();
+	while (bench_dispatch_read_hits(builtin, cpu) == hits) {
+		if (rdtsc_ordered() - begin > timeout) {
+			ret = -1;
+			break;
+		}
+		cpu_relax();
+	}
+	if (!ret)
+		cycles = nmictrl_get_dispatch_cycles(cpu);
+	local_irq_restore(flags);
+	put_cpu();
+
+	if (!!ret)
+		return -1;
+	result->sum += cycles;
+	result->min = min(result->min, cycles);
+	result->nr_rounds++;
+	return 0;
+}
+
+/**
+ * @brief Internal function to run all rounds of a kind of handler.
+ */
+static void bench_dispatch_loop(int builtin, unsigned int rounds, bench_dispatch_result_t *result)
+{
+	unsigned int round;
+
+	result->sum = 0;
+	result->min = U64_MAX;
+	result->nr_rounds = 0;
+	for (round = 0; round < rounds; round++) {
+		if (!!bench_dispatch_round(builtin, result)) {
+			pr_info("bench_dispatch: %s round %u timed out\n", !!builtin ? "builtin" : "registered", round);
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Internal function to report the mitigations the indirect call pays for.
+ */
+static void bench_dispatch_report_mitigations(void)
+{
+	int retpoline = 0, ibrs = 0;
+
+#ifdef X86_FEATURE_RETPOLINE
+	retpoline = boot_cpu_has(X86_FEATURE_RETPOLINE);
+#endif
+#ifdef X86_FEATURE_KERNEL_IBRS
+	ibrs = boot_cpu_has(X86_FEATURE_KERNEL_IBRS);
+#endif
+	pr_info("bench_dispatch: retpoline %s, kernel IBRS %s\n",
+		!!retpoline ? "on" : "off", !!ibrs ? "on" : "off");
+}
+
+int bench_dispatch_run(unsigned int rounds)
+{
+	bench_dispatch_result_t builtin, registered;
+	char decoy_name[NMICTRL_HANDLER_NAMESZ];
+	unsigned int decoy;
+	int ret = -1;
+
+	if (rounds == 0)
+		return -1;
+
+	/* Registered first, so the decoys are walked before it */
+	if (!!nmictrl_add_handler(BENCH_DISPATCH_HANDLER_NAME, &bench_dispatch_nmifn))
+		return -1;
+	for (decoy = 0; decoy < BENCH_DISPATCH_NR_DECOYS; decoy++) {
+		snprintf(decoy_name, sizeof(decoy_name), BENCH_DISPATCH_DECOY_NAME, decoy);
+		if (!!nmictrl_add_handler(decoy_name, &bench_dispatch_decoy_nmifn))
+			goto out_del;
+	}
+
+	nmictrl_set_dispatch_stamp(1);
+	/* Warm up the caches and the branch predictors first */
+	bench_dispatch_loop(1, rounds, &builtin);
+	bench_dispatch_loop(0, rounds, &registered);
+
+	bench_dispatch_loop(1, rounds, &builtin);
+	bench_dispatch_loop(0, rounds, &registered);
+	nmictrl_set_dispatch_stamp(0);
+	if (builtin.nr_rounds != rounds || registered.nr_rounds != rounds)
+		goto out_del;
+
+	bench_dispatch_report_mitigations();
+	pr_info("bench_dispatch: %u self-NMIs per kind, %u handlers ahead of the registered one\n",
+		rounds, BENCH_DISPATCH_NR_DECOYS);
+	pr_info("bench_dispatch: builtin dispatch avg %llu cycles, min %llu cycles\n",
+		div_u64(builtin.sum, rounds), builtin.min);
+	pr_info("bench_dispatch: registered dispatch avg %llu cycles, min %llu cycles\n",
+		div_u64(registered.sum, rounds), registered.min);
+	/* Both include the same two stamps, so they cancel out here */
+	pr_info("bench_dispatch: direct dispatch saves %lld cycles (avg), %lld cycles (min)\n",
+		(s64)div_u64(registered.sum, rounds) - (s64)div_u64(builtin.sum, rounds),
+		(s64)(registered.min - builtin.min));
+	ret = 0;
+
+out_del:
+	while (decoy-- > 0) {
+		snprintf(decoy_name, sizeof(decoy_name), BENCH_DISPATCH_DECOY_NAME, decoy);
+		nmictrl_del_handler(decoy_name);
+	}
+	nmictrl_del_handler(BENCH_DISPATCH_HANDLER_NAME);
+	return ret;
+}
\ No newline at end of file
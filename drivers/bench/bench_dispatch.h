@@ -0,0 +1,24 @@
+#ifndef _NMIDBG_BENCH_DISPATCH_H
+#define _NMIDBG_BENCH_DISPATCH_H
+
+#include "bench.h"
+
+#define BENCH_DISPATCH_DEFAULT_ROUNDS 10000
+
+/**
+ * @brief Measure the per-dispatch cost of builtin versus user-registered handlers.
+ *
+ * The generic handler stamps the dispatch of self-NMIs, once for the builtin probe
+ * and once for a registered handler behind a few others; the difference is what the direct call saves.
+ * The APIC send and the NMI entry and exit are left out, as they cost far more than the dispatch.
+ * Run it on a kernel with the retpoline/IBRS mitigations of the fleet; their state is reported.
+ * The nmictrl coresys must be started before.
+ *
+ * @param rounds
+ * 	number of NMIs per kind of handler
+ * @return
+ * 	0 if the benchmark ran.
+ */
+int bench_dispatch_run(unsigned int rounds);
+
+#endif
\ No newline at end of file
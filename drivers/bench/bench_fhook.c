@@ -0,0 +1,79 @@
+#include "bench_fhook.h"
+
+#include <linux/kernel.h>
+#include <linux/smp.h>
+
+#include "fhook.h"
+
+/* Exported, traceable, side-effect free, and hardly called by anyone else */
+#define BENCH_FHOOK_TARGET "kstrtobool"
+
+static const char bench_fhook_input[] = "1";
+
+/**
+ * @brief Internal function to time a loop of calls to the target.
+ */
+static u64 bench_fhook_loop(unsigned int calls)
+{
+	unsigned int i;
+	u64 begin, end;
+	bool res;
+
+	get_cpu();
+	begin = rdtsc_ordered();
+	for (i = 0; i < calls; i++)
+		(void) kstrtobool(bench_fhook_input, &res);
+	end = rdtsc_ordered();
+	put_cpu();
+	return end - begin;
+}
+
+/**
+ * @brief Internal function to convert the extra cycles of a loop into picoseconds per call.
+ */
+static u64 bench_fhook_cost_ps(u64 cycles, u64 base_cycles, unsigned int calls)
+{
+	if (cycles <= base_cycles)
+		return 0;
+	return div_u64(bench_cycles_to_ns((cycles - base_cycles) * 1000ULL), calls);
+}
+
+int bench_fhook_run(unsigned int calls)
+{
+	u64 base_cycles, count_cycles, sample_cycles, count_ps, sample_ps;
+	fhook_stat_t stat;
+	int id;
+
+	if (!!fhook_startup(NULL)) {
+		pr_info("bench_fhook: failed to start the fhook subsystem\n");
+		return -1;
+	}
+
+	/* Warm up the caches and the branch predictors first */
+	(void) bench_fhook_loop(calls);
+	base_cycles = bench_fhook_loop(calls);
+
+	id = fhook_add(BENCH_FHOOK_TARGET, 0);
+	if (id < 0) {
+		pr_info("bench_fhook: failed to probe %s\n", BENCH_FHOOK_TARGET);
+		fhook_shutdown();
+		return -1;
+	}
+	count_cycles = bench_fhook_loop(calls);
+	(void) fhook_set_sample(id, 1);
+	sample_cycles = bench_fhook_loop(calls);
+	(void) fhook_get_stat(id, &stat);
+	(void) fhook_del(id);
+	fhook_shutdown();
+
+	count_ps = bench_fhook_cost_ps(count_cycles, base_cycles, calls);
+	sample_ps = bench_fhook_cost_ps(sample_cycles, base_cycles, calls);
+
+	pr_info("bench_fhook: %u calls of %s per loop, %llu ns/call without probe\n",
+		calls, BENCH_FHOOK_TARGET, div_u64(bench_cycles_to_ns(base_cycles), calls));
+	pr_info("bench_fhook: per-hit cost %llu.%03llu ns counting, %llu.%03llu ns sampling\n",
+		count_ps / 1000, count_ps % 1000, sample_ps / 1000, sample_ps % 1000);
+	pr_info("bench_fhook: %llu hits counted for %u calls%s\n",
+		stat.nr_hits, 2 * calls, (stat.nr_hits < 2ULL * calls) ? " (LOST HITS)" : "");
+	return (stat.nr_hits < 2ULL * calls) ? -1 : 0;
+}
\ No newline at end of file
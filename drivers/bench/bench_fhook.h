@@ -0,0 +1,22 @@
+#ifndef _NMIDBG_BENCH_FHOOK_H
+#define _NMIDBG_BENCH_FHOOK_H
+
+#include "bench.h"
+
+#define BENCH_FHOOK_DEFAULT_CALLS 1000000
+
+/**
+ * @brief Measure the per-hit cost of a fhook probe.
+ *
+ * A cheap, rarely used kernel function is called in a tight loop without a probe,
+ * with a counting probe and with a sampling probe; the differences are the per-hit costs.
+ * The fhook subsys is started and shut down here. The nmictrl coresys and the tracering subsys must be started before.
+ *
+ * @param calls
+ * 	number of calls per loop
+ * @return
+ * 	0 if the benchmark ran.
+ */
+int bench_fhook_run(unsigned int calls);
+
+#endif
\ No newline at end of file
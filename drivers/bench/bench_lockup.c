@@ -0,0 +1,46 @@
+#include "bench_lockup.h"
+
+#include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/cpumask.h>
+
+#include "lockup.h"
+
+int bench_lockup_run(unsigned int period_ms, unsigned int duration_ms)
+{
+	lockup_stat_t stat;
+	u64 beat_ns, check_ns, busy_ns, window_ns, default_ppm;
+
+	if (!!lockup_startup(period_ms, LOCKUP_DEFAULT_THRESH)) {
+		pr_info("bench_lockup: failed to start the lockup detector\n");
+		return -1;
+	}
+	msleep(duration_ms);
+	lockup_shutdown();
+	lockup_get_stat(&stat);
+
+	if (stat.nr_beats == 0) {
+		pr_info("bench_lockup: no heartbeat observed\n");
+		return -1;
+	}
+
+	beat_ns = bench_cycles_to_ns(stat.beat_cycles - stat.check_cycles) / stat.nr_beats;
+	check_ns = !!stat.nr_checks ? bench_cycles_to_ns(stat.check_cycles) / stat.nr_checks : 0;
+	busy_ns = bench_cycles_to_ns(stat.beat_cycles);
+	window_ns = (u64)duration_ms * NSEC_PER_MSEC * num_online_cpus();
+
+	/*
+	 * Every CPU beats twice per period and one check runs per period on the whole machine.
+	 */
+	default_ppm = div_u64((2 * beat_ns + div_u64(check_ns, num_online_cpus())) * 1000000ULL,
+		(u64)LOCKUP_DEFAULT_PERIOD_MS * NSEC_PER_MSEC);
+
+	pr_info("bench_lockup: period %u ms, window %u ms, %u cpus\n",
+		period_ms, duration_ms, num_online_cpus());
+	pr_info("bench_lockup: %llu beats (%llu ns/beat), %llu checks (%llu ns/check), %llu stalls\n",
+		stat.nr_beats, beat_ns, stat.nr_checks, check_ns, stat.nr_stalls);
+	pr_info("bench_lockup: measured overhead %llu ppm, projected overhead at %u ms period %llu ppm\n",
+		!!window_ns ? div64_u64(busy_ns * 1000000ULL, window_ns) : 0,
+		LOCKUP_DEFAULT_PERIOD_MS, default_ppm);
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#ifndef _NMIDBG_BENCH_LOCKUP_H
+#define _NMIDBG_BENCH_LOCKUP_H
+
+#include "bench.h"
+
+/**
+ * @brief Measure the steady-state overhead of the lockup detector.
+ *
+ * @param period_ms
+ * 	check period to run the detector with
+ * @param duration_ms
+ * 	measuring window
+ * @return
+ * 	0 if the benchmark ran.
+ */
+int bench_lockup_run(unsigned int period_ms, unsigned int duration_ms);
+
+#endif
\ No newline at end of file
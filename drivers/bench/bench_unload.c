@@ -0,0 +1,149 @@
+#include "bench_unload.h"
+
+#include <linux/kernel.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "nmictrl.h"
+
+#define BENCH_UNLOAD_HANDLER_NAME "bench_unload"
+
+/* Time for the load to build up a backlog of RCU callbacks (millisec) */
+#define BENCH_UNLOAD_WARMUP_MS 200
+
+/**
+ * @brief Internal object freed through RCU by the load.
+ */
+typedef struct {
+	struct rcu_head rcu;
+	u8 payload[48];
+} bench_unload_obj_t;
+
+/**
+ * @brief Internal kthread function to flood RCU with callbacks until stopped.
+ */
+static int bench_unload_load_fn(void *unused)
+{
+	unsigned long nr_objs = 0;
+
+	while (!kthread_should_stop()) {
+		bench_unload_obj_t *obj = kmalloc(sizeof(*obj), GFP_KERNEL);
+
+		if (obj != NULL)
+			kfree_rcu(obj, rcu);
+		if (!(++nr_objs & 0xff))
+			cond_resched();
+	}
+	return 0;
+}
+
+static nmictrl_ret_t bench_unload_nmifn(struct pt_regs *regs)
+{
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to stop and release the load kthreads.
+ */
+static void bench_unload_stop_load(struct task_struct **loads)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (loads[cpu] != NULL)
+			kthread_stop(loads[cpu]);
+	kfree(loads);
+}
+
+/**
+ * @brief Internal function to start a load kthread on every online CPU.
+ */
+static struct task_struct **bench_unload_start_load(void)
+{
+	struct task_struct **loads = kcalloc(nr_cpu_ids, sizeof(*loads), GFP_KERNEL);
+	unsigned int cpu;
+
+	if (loads == NULL)
+		return NULL;
+
+	for_each_online_cpu(cpu) {
+		struct task_struct *load = kthread_create_on_node(bench_unload_load_fn, NULL,
+			cpu_to_node(cpu), "nmdbg-load/%u", cpu);
+
+		if (IS_ERR(load)) {
+			bench_unload_stop_load(loads);
+			return NULL;
+		}
+		kthread_bind(load, cpu);
+		wake_up_process(load);
+		loads[cpu] = load;
+	}
+	return loads;
+}
+
+int bench_unload_run(unsigned int rounds)
+{
+	struct task_struct **loads;
+	u64 begin, ns, sum_ns = 0, max_ns = 0, sum_barrier_ns = 0, max_barrier_ns = 0;
+	unsigned int cpu, round;
+	int ret = 0;
+
+	if (rounds == 0)
+		return -1;
+
+	get_online_cpus();
+	loads = bench_unload_start_load();
+	if (loads == NULL) {
+		put_online_cpus();
+		pr_info("bench_unload: failed to start the load\n");
+		return -1;
+	}
+	msleep(BENCH_UNLOAD_WARMUP_MS);
+
+	for (round = 0; round < rounds; round++) {
+		if (!!nmictrl_add_handler(BENCH_UNLOAD_HANDLER_NAME, &bench_unload_nmifn)) {
+			ret = -1;
+			break;
+		}
+		for_each_online_cpu(cpu)
+			nmictrl_prepare_handler(BENCH_UNLOAD_HANDLER_NAME, cpu);
+		nmictrl_trigger_all();
+
+		begin = ktime_get_ns();
+		nmictrl_shutdown_sync();
+		ns = ktime_get_ns() - begin;
+		sum_ns += ns;
+		max_ns = max(max_ns, ns);
+
+		if (!!nmictrl_startup()) {
+			pr_info("bench_unload: failed to restart the nmictrl system\n");
+			ret = -1;
+			break;
+		}
+
+		/* What the shutdown used to wait for on top */
+		begin = ktime_get_ns();
+		rcu_barrier();
+		ns = ktime_get_ns() - begin;
+		sum_barrier_ns += ns;
+		max_barrier_ns = max(max_barrier_ns, ns);
+	}
+
+	bench_unload_stop_load(loads);
+	put_online_cpus();
+
+	if (round == 0)
+		return -1;
+	pr_info("bench_unload: %u rounds under RCU load on %u cpus\n", round, num_online_cpus());
+	pr_info("bench_unload: nmictrl shutdown avg %llu ns, max %llu ns\n",
+		div_u64(sum_ns, round), max_ns);
+	pr_info("bench_unload: rcu_barrier avg %llu ns, max %llu ns\n",
+		div_u64(sum_barrier_ns, round), max_barrier_ns);
+	return ret;
+}
\ No newline at end of file
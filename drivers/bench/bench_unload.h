@@ -0,0 +1,24 @@
+#ifndef _NMIDBG_BENCH_UNLOAD_H
+#define _NMIDBG_BENCH_UNLOAD_H
+
+#include "bench.h"
+
+#define BENCH_UNLOAD_DEFAULT_ROUNDS 20
+
+/**
+ * @brief Measure the shutdown time of the nmictrl coresys under load.
+ *
+ * A kthread per online CPU floods RCU with callbacks, like a busy host does.
+ * Every round registers a handler, triggers it on all online CPUs and shuts the coresys down right away,
+ * so the shutdown has NMIs in flight to wait for; the coresys is started again afterwards.
+ * The time of a global rcu_barrier() under the same load is reported for comparison.
+ * The nmictrl coresys must be started before and no handler must be registered.
+ *
+ * @param rounds
+ * 	number of shutdowns
+ * @return
+ * 	0 if the benchmark ran and the coresys is running again.
+ */
+int bench_unload_run(unsigned int rounds);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,402 @@
+/**
+ * @file cmdring.c
+ * @brief The cmdring subsystem.
+ *
+ * This is implementations of 'cmdring subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "cmdring.h"
+
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/capability.h>
+#include <linux/percpu.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+#define CMDRING_ACK_HANDLER_NAME "cmdring_ack"
+#define CMDRING_SNAPSHOT_HANDLER_NAME "cmdring_snapshot"
+
+/* Maximum time to wait for the NMIs of a batch (microsec) */
+#define CMDRING_ACK_TIMEOUT 10000
+
+/**
+ * @brief Internal per-cpu acknowledgement of a batched NMI.
+ */
+typedef struct {
+	/** Incremented on every acknowledged NMI */
+	u64 ack_seq;
+	/** TSC value at the last acknowledged NMI */
+	u64 ack_tsc;
+} cmdring_ack_t;
+
+/**
+ * @brief Internal structure for a command waiting for its NMIs.
+ */
+typedef struct {
+	u64 user_data;
+	u32 cpu;
+} cmdring_pending_t;
+
+static DEFINE_PER_CPU(cmdring_ack_t, cmdring_acks);
+
+static DEFINE_MUTEX(cmdring_submit_lock);
+
+static void *cmdring_region = NULL;
+static size_t cmdring_region_size = 0;
+static cmdring_hdr_t *cmdring_hdr = NULL;
+static cmdring_sqe_t *cmdring_sq = NULL;
+static cmdring_cqe_t *cmdring_cq = NULL;
+static nmdbg_fmt_regs_rec_t *cmdring_snap = NULL;
+
+/* Kernel-owned ring indexes; the copies in 'cmdring_hdr' are never trusted. */
+static u32 cmdring_sq_head = 0;
+static u32 cmdring_cq_tail = 0;
+
+/* Batch state, protected by 'cmdring_submit_lock' */
+static cpumask_t cmdring_batch_mask;
+static cpumask_t cmdring_snap_mask;
+static cmdring_pending_t cmdring_pending[CMDRING_SQ_ENTRIES];
+static unsigned int cmdring_nr_pending = 0;
+static u64 *cmdring_seq_before = NULL;
+
+/**
+ * @brief Internal NMI function to acknowledge a batched NMI.
+ *
+ * It is registered before the snapshot handler, so it always runs after the snapshot was captured.
+ */
+static nmictrl_ret_t cmdring_ack_nmifn(struct pt_regs *regs)
+{
+	cmdring_ack_t *ack_ptr = this_cpu_ptr(&cmdring_acks);
+
+	ack_ptr->ack_tsc = rdtsc();
+	smp_wmb();
+	WRITE_ONCE(ack_ptr->ack_seq, ack_ptr->ack_seq + 1);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal NMI function to capture registers into the snapshot slot of the current CPU.
+ */
+static nmictrl_ret_t cmdring_snapshot_nmifn(struct pt_regs *regs)
+{
+	tracering_fill_regs(&cmdring_snap[raw_smp_processor_id()], NMDBG_FMT_REGS_SNAPSHOT, regs);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to post a completion.
+ */
+static void cmdring_post(u64 user_data, s32 result, u32 cpu, u64 latency_ns)
+{
+	cmdring_cqe_t *cqe_ptr;
+
+	if (cmdring_cq_tail - READ_ONCE(cmdring_hdr->cq_head) >= CMDRING_CQ_ENTRIES) {
+		cmdring_hdr->cq_overflow++;
+		return;
+	}
+
+	cqe_ptr = &cmdring_cq[cmdring_cq_tail & (CMDRING_CQ_ENTRIES - 1)];
+	cqe_ptr->user_data = user_data;
+	cqe_ptr->result = result;
+	cqe_ptr->cpu = cpu;
+	cqe_ptr->latency_ns = latency_ns;
+
+	cmdring_cq_tail++;
+	smp_store_release(&cmdring_hdr->cq_tail, cmdring_cq_tail);
+}
+
+/**
+ * @brief Internal function to validate the target CPU of a command.
+ */
+static __always_inline int cmdring_test_cpu(u32 cpu)
+{
+	return cpu == CMDRING_CPU_ALL || (cpu < nr_cpu_ids && cpu_online(cpu));
+}
+
+/**
+ * @brief Internal function to get the CPUs targeted by a command.
+ */
+static __always_inline const struct cpumask *cmdring_cpu_mask(u32 cpu)
+{
+	return (cpu == CMDRING_CPU_ALL) ? cpu_online_mask : cpumask_of(cpu);
+}
+
+/**
+ * @brief Internal function to execute a command, or queue it to the current batch.
+ */
+static void cmdring_execute(const cmdring_sqe_t *sqe)
+{
+	unsigned int cpu;
+
+	if (sqe->opcode != CMDRING_OP_NOP && !cmdring_test_cpu(sqe->cpu)) {
+		cmdring_post(sqe->user_data, -EINVAL, sqe->cpu, 0);
+		return;
+	}
+
+	switch (sqe->opcode) {
+	case CMDRING_OP_NOP:
+		cmdring_post(sqe->user_data, 0, sqe->cpu, 0);
+		break;
+	case CMDRING_OP_PREPARE:
+		if (sqe->handler_name[0] == '\0') {
+			cmdring_post(sqe->user_data, -EINVAL, sqe->cpu, 0);
+			break;
+		}
+		for_each_cpu(cpu, cmdring_cpu_mask(sqe->cpu)) {
+			int found = !nmictrl_prepare_handler(sqe->handler_name, cpu);
+
+			cmdring_post(sqe->user_data, found ? 0 : -ENOENT, cpu, 0);
+		}
+		break;
+	case CMDRING_OP_SNAPSHOT:
+		for_each_cpu(cpu, cmdring_cpu_mask(sqe->cpu))
+			nmictrl_prepare_handler(CMDRING_SNAPSHOT_HANDLER_NAME, cpu);
+		cpumask_or(&cmdring_snap_mask, &cmdring_snap_mask, cmdring_cpu_mask(sqe->cpu));
+		/* fall through */
+	case CMDRING_OP_TRIGGER:
+		/*
+		 * Triggers are not raised here.
+		 * They are merged into 'cmdring_batch_mask' and raised once for the whole batch.
+		 */
+		cpumask_or(&cmdring_batch_mask, &cmdring_batch_mask, cmdring_cpu_mask(sqe->cpu));
+		cmdring_pending[cmdring_nr_pending].user_data = sqe->user_data;
+		cmdring_pending[cmdring_nr_pending].cpu = sqe->cpu;
+		cmdring_nr_pending++;
+		break;
+	default:
+		cmdring_post(sqe->user_data, -EOPNOTSUPP, sqe->cpu, 0);
+		break;
+	}
+}
+
+/**
+ * @brief Internal function to raise the batched NMIs and complete pending commands.
+ */
+static void cmdring_flush_batch(void)
+{
+	unsigned long timeout = CMDRING_ACK_TIMEOUT;
+	unsigned int cpu, idx, send_cpu;
+	u64 send_tsc;
+
+	if (cpumask_empty(&cmdring_batch_mask))
+		goto out;
+
+	for_each_cpu(cpu, &cmdring_batch_mask) {
+		cmdring_seq_before[cpu] = READ_ONCE(per_cpu(cmdring_acks, cpu).ack_seq);
+		nmictrl_prepare_handler(CMDRING_ACK_HANDLER_NAME, cpu);
+	}
+
+	send_cpu = get_cpu();
+	send_tsc = tracering_correct_tsc(send_cpu, rdtsc_ordered());
+	put_cpu();
+	nmictrl_trigger_mask(&cmdring_batch_mask);
+
+	/*
+	 * Wait until every targeted CPU acknowledges.
+	 * Acknowledged CPUs are removed from the batch mask, so the remaining bits are the late ones.
+	 */
+	while (!!(timeout--)) {
+		for_each_cpu(cpu, &cmdring_batch_mask)
+			if (READ_ONCE(per_cpu(cmdring_acks, cpu).ack_seq) != cmdring_seq_before[cpu])
+				cpumask_clear_cpu(cpu, &cmdring_batch_mask);
+		if (cpumask_empty(&cmdring_batch_mask))
+			break;
+		udelay(1);
+	}
+	smp_rmb();
+
+	/* Snapshots are published in the timebase of the trace rings */
+	cpumask_andnot(&cmdring_snap_mask, &cmdring_snap_mask, &cmdring_batch_mask);
+	for_each_cpu(cpu, &cmdring_snap_mask)
+		cmdring_snap[cpu].rec.tsc = tracering_correct_tsc(cpu, cmdring_snap[cpu].rec.tsc);
+
+	for (idx = 0; idx < cmdring_nr_pending; idx++) {
+		for_each_cpu(cpu, cmdring_cpu_mask(cmdring_pending[idx].cpu)) {
+			u64 latency_ns = 0;
+			s32 result = 0;
+
+			if (cpumask_test_cpu(cpu, &cmdring_batch_mask))
+				result = -ETIMEDOUT;
+			else if (!!tsc_khz) {
+				/* A skew estimate is not exact; never report a negative latency */
+				s64 delta = (s64)(tracering_correct_tsc(cpu, per_cpu(cmdring_acks, cpu).ack_tsc) - send_tsc);
+
+				latency_ns = (delta > 0) ? div_u64((u64)delta * 1000000ULL, tsc_khz) : 0;
+			}
+			cmdring_post(cmdring_pending[idx].user_data, result, cpu, latency_ns);
+		}
+	}
+
+out:
+	cpumask_clear(&cmdring_batch_mask);
+	cpumask_clear(&cmdring_snap_mask);
+	cmdring_nr_pending = 0;
+}
+
+/**
+ * @brief Internal function to consume all submitted SQEs.
+ *
+ * @return
+ * 	the number of consumed SQEs, or a negative errno.
+ */
+static long cmdring_submit(void)
+{
+	u32 sq_tail, nr_sqes, idx;
+
+	sq_tail = smp_load_acquire(&cmdring_hdr->sq_tail);
+	nr_sqes = sq_tail - cmdring_sq_head;
+	if (nr_sqes > CMDRING_SQ_ENTRIES)
+		return -EINVAL;
+
+	for (idx = 0; idx < nr_sqes; idx++) {
+		cmdring_sqe_t sqe;
+
+		/*
+		 * Copy the SQE first; userspace could modify the shared entry at any time.
+		 */
+		memcpy(&sqe, &cmdring_sq[(cmdring_sq_head + idx) & (CMDRING_SQ_ENTRIES - 1)], sizeof(sqe));
+		sqe.handler_name[CMDRING_HANDLER_NAMESZ - 1] = '\0';
+		cmdring_execute(&sqe);
+	}
+	cmdring_flush_batch();
+
+	cmdring_sq_head = sq_tail;
+	smp_store_release(&cmdring_hdr->sq_head, cmdring_sq_head);
+	return nr_sqes;
+}
+
+static int cmdring_open(struct inode *inode, struct file *filp)
+{
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	return 0;
+}
+
+static long cmdring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	long ret;
+
+	switch (cmd) {
+	case CMDRING_IOC_GET_SIZE: {
+		u64 size = cmdring_region_size;
+
+		return copy_to_user((void __user *)arg, &size, sizeof(size)) ? -EFAULT : 0;
+	}
+	case CMDRING_IOC_SUBMIT:
+		mutex_lock(&cmdring_submit_lock);
+		ret = cmdring_submit();
+		mutex_unlock(&cmdring_submit_lock);
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int cmdring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > cmdring_region_size)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, cmdring_region, 0);
+}
+
+static const struct file_operations cmdring_fops = {
+	.owner = THIS_MODULE,
+	.open = cmdring_open,
+	.unlocked_ioctl = cmdring_ioctl,
+	.mmap = cmdring_mmap,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice cmdring_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = CMDRING_DEV_NAME,
+	.fops = &cmdring_fops,
+	.mode = 0600,
+};
+
+int cmdring_startup(void)
+{
+	size_t sq_offset = PAGE_ALIGN(sizeof(cmdring_hdr_t));
+	size_t cq_offset = sq_offset + PAGE_ALIGN(CMDRING_SQ_ENTRIES * sizeof(cmdring_sqe_t));
+	size_t snap_offset = cq_offset + PAGE_ALIGN(CMDRING_CQ_ENTRIES * sizeof(cmdring_cqe_t));
+
+	cmdring_region_size = snap_offset + PAGE_ALIGN(nr_cpu_ids * sizeof(nmdbg_fmt_regs_rec_t));
+	cmdring_region = vmalloc_user(cmdring_region_size);
+	if (cmdring_region == NULL)
+		goto err;
+
+	cmdring_seq_before = kcalloc(nr_cpu_ids, sizeof(*cmdring_seq_before), GFP_KERNEL);
+	if (cmdring_seq_before == NULL)
+		goto err_free_region;
+
+	cmdring_hdr = cmdring_region;
+	cmdring_sq = (cmdring_sqe_t *)((u8 *)cmdring_region + sq_offset);
+	cmdring_cq = (cmdring_cqe_t *)((u8 *)cmdring_region + cq_offset);
+	cmdring_snap = (nmdbg_fmt_regs_rec_t *)((u8 *)cmdring_region + snap_offset);
+	cmdring_sq_head = 0;
+	cmdring_cq_tail = 0;
+
+	cmdring_hdr->sq_entries = CMDRING_SQ_ENTRIES;
+	cmdring_hdr->cq_entries = CMDRING_CQ_ENTRIES;
+	cmdring_hdr->nr_cpus = nr_cpu_ids;
+	cmdring_hdr->sq_offset = sq_offset;
+	cmdring_hdr->cq_offset = cq_offset;
+	cmdring_hdr->snap_offset = snap_offset;
+	cmdring_hdr->tsc_khz = tsc_khz;
+
+	/*
+	 * Handlers run from the most recently added one.
+	 * Adding the ack handler first makes it run after the snapshot handler.
+	 */
+	if (!!nmictrl_add_handler(CMDRING_ACK_HANDLER_NAME, &cmdring_ack_nmifn))
+		goto err_free_seq;
+	if (!!nmictrl_add_handler(CMDRING_SNAPSHOT_HANDLER_NAME, &cmdring_snapshot_nmifn))
+		goto err_del_ack;
+
+	if (!!misc_register(&cmdring_miscdev))
+		goto err_del_snapshot;
+
+	pr_info("Attached the cmdring subsystem successfully (/dev/%s, %zu bytes)\n",
+		CMDRING_DEV_NAME, cmdring_region_size);
+	return 0;
+
+err_del_snapshot:
+	nmictrl_del_handler(CMDRING_SNAPSHOT_HANDLER_NAME);
+err_del_ack:
+	nmictrl_del_handler(CMDRING_ACK_HANDLER_NAME);
+err_free_seq:
+	kfree(cmdring_seq_before);
+	cmdring_seq_before = NULL;
+err_free_region:
+	vfree(cmdring_region);
+	cmdring_region = NULL;
+err:
+	return -1;
+}
+
+void cmdring_shutdown(void)
+{
+	if (cmdring_region == NULL)
+		return;
+
+	misc_deregister(&cmdring_miscdev);
+	/* These wait for a late NMI still running the snapshot handler before the slots are released */
+	nmictrl_del_handler(CMDRING_SNAPSHOT_HANDLER_NAME);
+	nmictrl_del_handler(CMDRING_ACK_HANDLER_NAME);
+	kfree(cmdring_seq_before);
+	cmdring_seq_before = NULL;
+	vfree(cmdring_region);
+	cmdring_region = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+/**
+ * @file cmdring.h
+ * @brief Prototypes for 'cmdring subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'cmdring subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_CMDRING_H
+#define _NMDBG_CMDRING_H
+
+#include "nmictrl.h"
+#include "tracering.h"
+#include "format.h"
+#include "cmdring_uapi.h"
+
+/**
+ * @brief Activate the cmdring subsys.
+ *
+ * This function creates the '/dev/nmdbg' character device and registers its handlers to the nmictrl coresys.
+ * The nmictrl coresys must be started before.
+ *
+ * @return
+ * 	0 if activation success.
+ */
+int cmdring_startup(void);
+
+/**
+ * @brief Deactivate the cmdring subsys.
+ *
+ * This function must be called before the nmictrl coresys shuts down.
+ */
+void cmdring_shutdown(void);
+
+#endif
\ No newline at end of file
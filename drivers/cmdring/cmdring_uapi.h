@@ -0,0 +1,119 @@
+/**
+ * @file cmdring_uapi.h
+ * @brief Userspace ABI of 'cmdring subsystem'.
+ *
+ * This contains the macros and structures shared between
+ * the cmdring character device and its userspace clients.
+ *
+ * The device exposes a single mmap'd region laid out as
+ * cmdring_hdr_t, the submission queue, the completion queue and
+ * one register snapshot slot per CPU, at the offsets published in cmdring_hdr_t.
+ *
+ * Userspace fills SQEs, publishes them by advancing 'sq_tail' (store-release),
+ * then calls CMDRING_IOC_SUBMIT. The kernel consumes SQEs up to 'sq_tail',
+ * coalesces every trigger of the batch into a single IPI and posts CQEs.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_CMDRING_UAPI_H
+#define _NMDBG_CMDRING_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CMDRING_DEV_NAME "nmdbg"
+
+#define CMDRING_SQ_ENTRIES 256
+#define CMDRING_CQ_ENTRIES 4096
+#define CMDRING_HANDLER_NAMESZ 32
+
+/* Target every online CPU */
+#define CMDRING_CPU_ALL 0xffffffffU
+
+#define CMDRING_IOC_MAGIC 'N'
+/* Get the size of the region to mmap (__u64) */
+#define CMDRING_IOC_GET_SIZE _IOR(CMDRING_IOC_MAGIC, 1, __u64)
+/* Consume submitted SQEs; returns the number of consumed SQEs */
+#define CMDRING_IOC_SUBMIT _IO(CMDRING_IOC_MAGIC, 2)
+
+/**
+ * @brief Command opcodes.
+ */
+typedef enum {
+	/** Complete immediately */
+	CMDRING_OP_NOP = 0,
+	/** Prepare 'handler_name' on 'cpu' (nmictrl_prepare_handler); -ENOENT if it is not registered */
+	CMDRING_OP_PREPARE,
+	/** Raise an NMI on 'cpu' */
+	CMDRING_OP_TRIGGER,
+	/** Raise an NMI on 'cpu' and capture its registers into the snapshot slot */
+	CMDRING_OP_SNAPSHOT,
+} cmdring_op_t;
+
+/**
+ * @brief Shared ring header.
+ */
+typedef struct {
+	/** Next SQE to be consumed (written by the kernel) */
+	__u32 sq_head;
+	/** Next SQE to be filled (written by userspace) */
+	__u32 sq_tail;
+	/** Next CQE to be consumed (written by userspace) */
+	__u32 cq_head;
+	/** Next CQE to be filled (written by the kernel) */
+	__u32 cq_tail;
+	/** Number of CQEs dropped because the completion queue was full */
+	__u32 cq_overflow;
+	/** Number of SQEs (power of 2) */
+	__u32 sq_entries;
+	/** Number of CQEs (power of 2) */
+	__u32 cq_entries;
+	/** Number of snapshot slots (nr_cpu_ids) */
+	__u32 nr_cpus;
+	/** Offset of the submission queue */
+	__u64 sq_offset;
+	/** Offset of the completion queue */
+	__u64 cq_offset;
+	/** Offset of the snapshot slots (nmdbg_fmt_regs_rec_t per CPU) */
+	__u64 snap_offset;
+	/** TSC frequency (kHz) */
+	__u64 tsc_khz;
+} cmdring_hdr_t;
+
+/**
+ * @brief Submission queue entry.
+ */
+typedef struct {
+	/** One of cmdring_op_t */
+	__u8 opcode;
+	/** Reserved (zero) */
+	__u8 flags;
+	/** Reserved (zero) */
+	__u16 reserved;
+	/** Target CPU or CMDRING_CPU_ALL */
+	__u32 cpu;
+	/** Copied to every CQE of this command */
+	__u64 user_data;
+	/** Handler name (CMDRING_OP_PREPARE) */
+	char handler_name[CMDRING_HANDLER_NAMESZ];
+} cmdring_sqe_t;
+
+/**
+ * @brief Completion queue entry.
+ *
+ * Commands targeting several CPUs post one CQE per CPU.
+ */
+typedef struct {
+	/** 'user_data' of the command */
+	__u64 user_data;
+	/** 0 or a negative errno */
+	__s32 result;
+	/** CPU this completion belongs to */
+	__u32 cpu;
+	/** Delay between the batched IPI and the NMI entry on 'cpu' (ns) */
+	__u64 latency_ns;
+} cmdring_cqe_t;
+
+#endif
\ No newline at end of file
@@ -1,20 +1,202 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/atomic.h>
+#include <asm/tsc.h>
 
 #include "nmictrl.h"
 #include "panichook.h"
+#include "memdump.h"
+#include "cmdring.h"
+#include "tracering.h"
+#include "lockup.h"
+#include "watch.h"
+#include "tscsync.h"
+#include "textscan.h"
+#include "fhook.h"
 
 #include "define.h"
 
 #define NMDBG_SUBSYSTEM_SYNC_TIMEOUT \
 	USEC_PER_SEC
 
+/**
+ * @brief Internal structure for a subsystem attached from an NMI.
+ */
+typedef struct {
+	/** Subsystem name */
+	const char *name;
+	/** Attach function; returns NMICTRL_HANDLED if attached, and leaves nothing behind if not */
+	nmictrl_fn_t attach_fn;
+	/** Detach function; undoes a successful attach */
+	nmictrl_fn_t detach_fn;
+} nmdbg_subsys_t;
+
+/*
+ * Subsystems attached from an NMI, in attaching order.
+ * They are all attached in a single NMI round, so adding one costs no additional round.
+ */
+static const nmdbg_subsys_t nmdbg_subsystems[] = {
+	{ "panichook", &panichook_attach_nmifn, &panichook_detach_nmifn },
+};
+
+#define NMDBG_NR_SUBSYSTEMS ((int)ARRAY_SIZE(nmdbg_subsystems))
+
 static const char nmdbg_driver_name[] = NMDBG_MODULE_NAME;
 static const char nmdbg_driver_ver[] = NMDBG_MODULE_VER "_" NMDBG_MODULE_MVER;
 static const char nmdbg_driver_desc[] = NMDBG_MODULE_DESC;
 static const char nmdbg_driver_copyright[] = "Copyright (c) " NMDBG_MODULE_DATE " " NMDBG_MODULE_AUTHOR " " NMDBG_MODULE_AUTHINFO;
 
+static unsigned int nmictrl_bcast = NMICTRL_BCAST_FLAT;
+module_param(nmictrl_bcast, uint, 0444);
+MODULE_PARM_DESC(nmictrl_bcast, "Broadcast mode of the NMI triggers (0: flat, 1: one leader per NUMA node)");
+
+static unsigned long memdump_base = 0;
+module_param(memdump_base, ulong, 0444);
+MODULE_PARM_DESC(memdump_base, "Physical base address of the reserved memdump region");
+
+static unsigned long memdump_size = 0;
+module_param(memdump_size, ulong, 0444);
+MODULE_PARM_DESC(memdump_size, "Size of the reserved memdump region (0 to compute statistics only)");
+
+static unsigned long tracering_size = TRACERING_DEFAULT_SIZE;
+module_param(tracering_size, ulong, 0444);
+MODULE_PARM_DESC(tracering_size, "Size of a per-cpu trace ring (bytes, power of 2)");
+
+static unsigned int lockup_period_ms = LOCKUP_DEFAULT_PERIOD_MS;
+module_param(lockup_period_ms, uint, 0444);
+MODULE_PARM_DESC(lockup_period_ms, "Check period of the lockup detector (0 to disable)");
+
+static unsigned int lockup_thresh = LOCKUP_DEFAULT_THRESH;
+module_param(lockup_thresh, uint, 0444);
+MODULE_PARM_DESC(lockup_thresh, "Missed checks before a CPU is considered locked up");
+
+static unsigned int tscsync_rounds = TSCSYNC_DEFAULT_ROUNDS;
+module_param(tscsync_rounds, uint, 0444);
+MODULE_PARM_DESC(tscsync_rounds, "TSC exchanges per CPU to estimate the skew at load (0 to skip)");
+
+static unsigned long panichook_window_ms = PANICHOOK_DEFAULT_WINDOW_US / USEC_PER_MSEC;
+module_param(panichook_window_ms, ulong, 0444);
+MODULE_PARM_DESC(panichook_window_ms, "Time all panic callbacks may take; keep it below the hardware watchdog timeout (millisec)");
+
+/* Scan first, so its report lands in the log which the memory dump keeps */
+#define NMDBG_PANIC_TEXTSCAN_PRIORITY 200
+#define NMDBG_PANIC_TEXTSCAN_BUDGET_US (2 * USEC_PER_SEC)
+#define NMDBG_PANIC_MEMDUMP_PRIORITY 100
+#define NMDBG_PANIC_MEMDUMP_BUDGET_US (20 * USEC_PER_SEC)
+
+static struct dentry *nmdbg_debugfs_dir = NULL;
+
+/* Number of attached subsystems; -1 while an attach or detach round is in flight */
+static atomic_t nmdbg_subsys_nr_attached = ATOMIC_INIT(0);
+/* Index of the subsystem which failed to attach (-1 if none) */
+static int nmdbg_subsys_failed = -1;
+
+/**
+ * @brief Builtin NMI function to attach all subsystems.
+ *
+ * If one fails, the ones already attached are detached in reverse order within the same NMI.
+ */
+nmictrl_ret_t nmictrl_builtin_subsys_attach(struct pt_regs *regs)
+{
+	int idx;
+
+	for (idx = 0; idx < NMDBG_NR_SUBSYSTEMS; idx++)
+		if (nmdbg_subsystems[idx].attach_fn(regs) != NMICTRL_HANDLED)
+			break;
+
+	if (idx != NMDBG_NR_SUBSYSTEMS) {
+		nmdbg_subsys_failed = idx;
+		while (idx-- > 0)
+			(void) nmdbg_subsystems[idx].detach_fn(regs);
+		idx = 0;
+	}
+	smp_wmb();
+	atomic_set(&nmdbg_subsys_nr_attached, idx);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Builtin NMI function to detach all attached subsystems in reverse order.
+ */
+nmictrl_ret_t nmictrl_builtin_subsys_detach(struct pt_regs *regs)
+{
+	int idx = NMDBG_NR_SUBSYSTEMS;
+
+	while (idx-- > 0)
+		(void) nmdbg_subsystems[idx].detach_fn(regs);
+	smp_wmb();
+	atomic_set(&nmdbg_subsys_nr_attached, 0);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to run an attach or detach round on the current CPU and wait for it.
+ *
+ * @return
+ * 	0 if the round finished in time.
+ */
+static int nmdbg_subsys_round(nmictrl_builtin_t builtin_id, unsigned long timeout)
+{
+	atomic_set(&nmdbg_subsys_nr_attached, -1);
+	smp_wmb();
+	nmictrl_prepare_builtin(builtin_id, get_cpu());
+	nmictrl_trigger_self();
+	put_cpu();
+
+	while (atomic_read(&nmdbg_subsys_nr_attached) < 0) {
+		if (!timeout--)
+			return -1;
+		udelay(1);
+	}
+	smp_rmb();
+	return 0;
+}
+
+/**
+ * @brief Internal function to attach all subsystems of the registry.
+ *
+ * @return
+ * 	0 if every subsystem was attached; none stays attached otherwise.
+ */
+static int nmdbg_subsys_attach(void)
+{
+	u64 begin = rdtsc();
+
+	if (!!nmdbg_subsys_round(NMICTRL_BUILTIN_SUBSYS_ATTACH, NMDBG_SUBSYSTEM_SYNC_TIMEOUT)) {
+		pr_info("Failed to sync the subsystem attach due to timeout");
+		return -1;
+	}
+	if (atomic_read(&nmdbg_subsys_nr_attached) != NMDBG_NR_SUBSYSTEMS) {
+		pr_info("Failed to attach the %s subsystem; rolled back the others",
+			nmdbg_subsystems[nmdbg_subsys_failed].name);
+		return -1;
+	}
+
+	pr_info("Attached %d subsystems in one NMI round (%llu cycles)\n",
+		NMDBG_NR_SUBSYSTEMS, rdtsc() - begin);
+	return 0;
+}
+
+/**
+ * @brief Internal function to detach all subsystems of the registry.
+ */
+static void nmdbg_subsys_detach(void)
+{
+	/*
+	 * An attach round which timed out (-1) may still land later; builtins run in the order of their ids,
+	 * so the detach round then runs right after it within the same NMI.
+	 */
+	if (atomic_read(&nmdbg_subsys_nr_attached) == 0)
+		return;
+
+	if (!!nmdbg_subsys_round(NMICTRL_BUILTIN_SUBSYS_DETACH, NMDBG_SUBSYSTEM_SYNC_TIMEOUT))
+		pr_info("Failed to sync the subsystem detach due to timeout");
+	else
+		pr_info("Detached %d subsystems in one NMI round\n", NMDBG_NR_SUBSYSTEMS);
+}
+
 static int __init nmdbg_init(void)
 {
 	pr_info("%s - v%s\n", nmdbg_driver_name, nmdbg_driver_ver );
@@ -25,38 +207,122 @@ static int __init nmdbg_init(void)
 		pr_info("Failed to start the nmictrl system");
 		goto err;
 	}
+	nmictrl_set_bcast(nmictrl_bcast == NMICTRL_BCAST_TREE ? NMICTRL_BCAST_TREE : NMICTRL_BCAST_FLAT);
+
+	nmdbg_debugfs_dir = debugfs_create_dir(NMDBG_MODULE_NAME, NULL);
+	if (IS_ERR(nmdbg_debugfs_dir))
+		nmdbg_debugfs_dir = NULL;
+
+	if (!!tracering_startup(tracering_size, nmdbg_debugfs_dir)) {
+		pr_info("Failed to start the tracering subsystem");
+		goto err_nmictrl;
+	}
 
 	panichook_member_init();
+	panichook_set_window(panichook_window_ms * USEC_PER_MSEC);
 
-	if (!!nmictrl_add_handler("panichook_attach", &panichook_attach_nmifn)) {
-		pr_info("Failed to add the panichook_attach handler");
-		goto err;
+	if (!!memdump_member_init()) {
+		pr_info("Failed to initialize the memdump subsystem");
+		goto err_nmictrl;
 	}
-	if (!!nmictrl_add_handler("panichook_detach", &panichook_detach_nmifn)) {
-		pr_info("Failed to add the panichook_detach handler");
-		goto err;
+	if (!!memdump_size &&
+		!!memdump_attach_region((phys_addr_t)memdump_base, (size_t)memdump_size)) {
+		pr_info("Failed to attach the memdump region");
+		goto err_nmictrl;
+	}
+	if (!!panichook_add_callback("memdump", &memdump_panic_dump,
+		NMDBG_PANIC_MEMDUMP_PRIORITY, NMDBG_PANIC_MEMDUMP_BUDGET_US)) {
+		pr_info("Failed to register the memdump panic callback");
+		goto err_nmictrl;
 	}
 
-	nmictrl_prepare_handler("panichook_attach", smp_processor_id());
-	nmictrl_trigger_self();
+	if (!!nmdbg_subsys_attach())
+		goto err_subsys;
 
-	if (!!panichook_sync_attach(NMDBG_SUBSYSTEM_SYNC_TIMEOUT)) {
-		pr_info("Failed to sync panichook_attach due to timeout");
-		goto err;
+	if (!!cmdring_startup()) {
+		pr_info("Failed to start the cmdring subsystem");
+		goto err_subsys;
+	}
+
+	if (!!lockup_period_ms &&
+		!!lockup_startup(lockup_period_ms, lockup_thresh)) {
+		pr_info("Failed to start the lockup detector");
+		goto err_cmdring;
+	}
+
+	if (!!watch_startup(nmdbg_debugfs_dir)) {
+		pr_info("Failed to start the watch subsystem");
+		goto err_lockup;
+	}
+
+	if (!!tscsync_startup(nmdbg_debugfs_dir)) {
+		pr_info("Failed to start the tscsync subsystem");
+		goto err_watch;
+	}
+	if (!!tscsync_rounds &&
+		!!tscsync_measure(TSCSYNC_MODE_PAIR, tscsync_rounds))
+		pr_info("Failed to measure the TSC skew of some cpus");
+	tracering_set_tsc_fn(&tscsync_correct);
+
+	if (!!textscan_startup(nmdbg_debugfs_dir)) {
+		pr_info("Failed to start the textscan subsystem");
+		goto err_tscsync;
+	}
+	if (!!panichook_add_callback("textscan", &textscan_panic_scan,
+		NMDBG_PANIC_TEXTSCAN_PRIORITY, NMDBG_PANIC_TEXTSCAN_BUDGET_US)) {
+		pr_info("Failed to register the textscan panic callback");
+		goto err_textscan;
+	}
+
+	if (!!fhook_startup(nmdbg_debugfs_dir)) {
+		pr_info("Failed to start the fhook subsystem");
+		goto err_textscan_callback;
 	}
 
 	return 0;
 
+err_textscan_callback:
+	panichook_del_callback("textscan");
+err_textscan:
+	textscan_shutdown();
+err_tscsync:
+	tracering_set_tsc_fn(NULL);
+	tscsync_shutdown();
+err_watch:
+	watch_shutdown();
+err_lockup:
+	lockup_shutdown();
+err_cmdring:
+	cmdring_shutdown();
+err_subsys:
+	nmdbg_subsys_detach();
+err_nmictrl:
+	nmictrl_shutdown_sync();
+	panichook_clear_callback();
+	memdump_member_exit();
+	tracering_shutdown();
+	debugfs_remove_recursive(nmdbg_debugfs_dir);
+	nmdbg_debugfs_dir = NULL;
 err:
 	return -1;
 }
 
 static void __exit nmdbg_exit(void)
 {
-	nmictrl_prepare_handler("panichook_detach", smp_processor_id());
-	nmictrl_trigger_self();
-	(void) panichook_sync_detach(NMDBG_SUBSYSTEM_SYNC_TIMEOUT);
+	fhook_shutdown();
+	panichook_del_callback("textscan");
+	textscan_shutdown();
+	tracering_set_tsc_fn(NULL);
+	tscsync_shutdown();
+	watch_shutdown();
+	lockup_shutdown();
+	cmdring_shutdown();
+	nmdbg_subsys_detach();
 	nmictrl_shutdown_sync();
+	panichook_clear_callback();
+	memdump_member_exit();
+	tracering_shutdown();
+	debugfs_remove_recursive(nmdbg_debugfs_dir);
 	return;
 }
 
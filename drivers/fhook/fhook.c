@@ -0,0 +1,561 @@
+/**
+ * @file fhook.c
+ * @brief The fhook subsystem.
+ *
+ * This is implementations of 'fhook subsystem'
+ *
+ * Every probe owns a fixed trampoline, generated at build time, in the text of this module.
+ * A hit costs the call, a per-cpu 'incq' and a flag test; registers are saved only when the hit is sampled.
+ * Counters are never shared between CPUs, so hot paths probed on many CPUs do not bounce cache lines,
+ * and they are summed only when read.
+ *
+ * Sites ftrace knows about are probed through an ftrace_ops filtered on the site,
+ * so ftrace keeps owning them and other tracers can share them.
+ * Only a site ftrace does not know about is redirected to a trampoline;
+ * it is rewritten with text_poke_bp() under 'text_mutex', the int3 protocol the kernel patches its own text with,
+ * so a CPU running the site while it is rewritten never executes a half-written instruction.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "fhook.h"
+
+#include <linux/cpu.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/frame.h>
+#include <linux/fs.h>
+#include <linux/ftrace.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/preempt.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/stringify.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "tracering.h"
+
+#include "define.h"
+
+/* Attempts to remove a probe at shutdown before giving up on it */
+#define FHOOK_RESTORE_RETRIES 8
+#define FHOOK_RESTORE_RETRY_MS 100
+
+/* Size of the __fentry__ site; 'call rel32' */
+#define FHOOK_INSN_SIZE 5
+#define FHOOK_CALL_REL32_OPCODE 0xe8
+
+/* Size of a trampoline; checked by the assembler */
+#define FHOOK_TRAMP_SIZE 32
+
+/**
+ * @brief Internal structure for a probe.
+ */
+typedef struct {
+	/** Probed function (NULL if the slot is free) */
+	void *kfn;
+	/** Original bytes of the __fentry__ site */
+	u8 orig[FHOOK_INSN_SIZE];
+	char sym[KSYM_NAME_LEN];
+	/** Non-zero if the site is owned by ftrace and probed through 'ops' */
+	int ftrace;
+	struct ftrace_ops ops;
+	/** Non-zero if removing the probe failed; the probe still calls into this module */
+	int stale;
+} fhook_probe_t;
+
+/*
+ * Referred by the trampolines by their names, so they must not be static.
+ */
+DEFINE_PER_CPU(u64, fhook_hits[FHOOK_MAX_PROBES]);
+u8 fhook_sample_flags[FHOOK_MAX_PROBES];
+__visible void notrace fhook_sample(unsigned long id, unsigned long ip, unsigned long parent_ip);
+
+void fhook_tramps(void);
+void fhook_tramp_slow(void);
+
+/*
+ * Trampoline #n is at 'fhook_tramps + n * FHOOK_TRAMP_SIZE'.
+ *
+ * On entry, the stack holds the return address into the probed function and,
+ * above it, the return address into its caller.
+ * Flags are not live at a function entry, so only the slow path has to preserve anything:
+ * the argument registers of the probed function and the other caller-saved registers.
+ * The stack is 16-byte aligned at the 'call' of the slow path (2 return addresses, the id and 9 registers).
+ */
+asm(
+"	.pushsection .text, \"ax\"\n"
+"	.type fhook_tramp_slow, @function\n"
+"fhook_tramp_slow:\n"
+"	pushq %rdi\n"
+"	pushq %rsi\n"
+"	pushq %rdx\n"
+"	pushq %rcx\n"
+"	pushq %rax\n"
+"	pushq %r8\n"
+"	pushq %r9\n"
+"	pushq %r10\n"
+"	pushq %r11\n"
+"	movq 72(%rsp), %rdi\n"
+"	movq 80(%rsp), %rsi\n"
+"	subq $" __stringify(FHOOK_INSN_SIZE) ", %rsi\n"
+"	movq 88(%rsp), %rdx\n"
+"	call fhook_sample\n"
+"	popq %r11\n"
+"	popq %r10\n"
+"	popq %r9\n"
+"	popq %r8\n"
+"	popq %rax\n"
+"	popq %rcx\n"
+"	popq %rdx\n"
+"	popq %rsi\n"
+"	popq %rdi\n"
+"	addq $8, %rsp\n"
+"	ret\n"
+"	.size fhook_tramp_slow, . - fhook_tramp_slow\n"
+"	.balign " __stringify(FHOOK_TRAMP_SIZE) ", 0xcc\n"
+"	.type fhook_tramps, @function\n"
+"fhook_tramps:\n"
+"	.set fhook_id, 0\n"
+"	.rept " __stringify(FHOOK_MAX_PROBES) "\n"
+"	incq %gs:fhook_hits + 8 * fhook_id\n"
+"	testb $1, fhook_sample_flags + fhook_id(%rip)\n"
+"	jnz 1f\n"
+"	ret\n"
+"1:	pushq $fhook_id\n"
+"	jmp fhook_tramp_slow\n"
+"	.org fhook_tramps + " __stringify(FHOOK_TRAMP_SIZE) " * (fhook_id + 1), 0xcc\n"
+"	.set fhook_id, fhook_id + 1\n"
+"	.endr\n"
+"	.size fhook_tramps, . - fhook_tramps\n"
+"	.popsection\n"
+);
+STACK_FRAME_NON_STANDARD(fhook_tramp_slow);
+STACK_FRAME_NON_STANDARD(fhook_tramps);
+
+/* text_poke_bp() resumes a CPU hitting the int3 at 'handler' before v5.3, and emulates 'emulate' since */
+typedef void (*fhook_text_poke_bp_t)(void *addr, const void *opcode, size_t len, void *handler);
+typedef unsigned long (*fhook_ftrace_location_t)(unsigned long ip);
+
+static void *fhook_fentry_kfn = NULL;
+static unsigned long fhook_stext = 0;
+static unsigned long fhook_etext = 0;
+static fhook_text_poke_bp_t fhook_text_poke_bp = NULL;
+static struct mutex *fhook_text_mutex = NULL;
+static fhook_ftrace_location_t fhook_ftrace_location = NULL;
+
+static fhook_probe_t fhook_probes[FHOOK_MAX_PROBES];
+
+/* Serializes the control paths, which may sleep */
+static DEFINE_MUTEX(fhook_lock);
+
+static struct dentry *fhook_file = NULL;
+static int fhook_active = 0;
+
+__visible void notrace fhook_sample(unsigned long id, unsigned long ip, unsigned long parent_ip)
+{
+	preempt_disable_notrace();
+	tracering_write_sample((u32)id, ip, parent_ip);
+	preempt_enable_notrace();
+}
+
+/**
+ * @brief Internal function to get the address of a trampoline.
+ */
+static __always_inline unsigned long fhook_tramp_addr(int id)
+{
+	return (unsigned long)&fhook_tramps + (unsigned long)id * FHOOK_TRAMP_SIZE;
+}
+
+/**
+ * @brief Internal function to test if a __fentry__ site can be redirected to a trampoline.
+ *
+ * Only an untouched 'call __fentry__', which ftrace does not rewrite without CONFIG_DYNAMIC_FTRACE, is accepted;
+ * sites ftrace owns must be probed through ftrace, and sites patched by kprobes or the panichook are refused.
+ *
+ * @param kfn
+ * 	address to test
+ * @return
+ * 	0 if the site can be probed.
+ */
+static int fhook_test_site(void *kfn)
+{
+	u8 insn[FHOOK_INSN_SIZE];
+	s32 call_operand;
+
+	if (!!probe_kernel_read(insn, kfn, FHOOK_INSN_SIZE))
+		return -1;
+
+	call_operand = (s32)((unsigned long)fhook_fentry_kfn - (unsigned long)kfn) - FHOOK_INSN_SIZE;
+	if (insn[0] == FHOOK_CALL_REL32_OPCODE &&
+		*(s32 *)&insn[1] == call_operand)
+		return 0;
+	return -1;
+}
+
+/**
+ * @brief Internal ftrace callback of a probe on a site ftrace owns.
+ *
+ * It does what the trampolines do; ftrace already protects it against recursion.
+ */
+static void notrace fhook_ftrace_fn(unsigned long ip, unsigned long parent_ip,
+	struct ftrace_ops *op, struct pt_regs *regs)
+{
+	fhook_probe_t *probe = container_of(op, fhook_probe_t, ops);
+	unsigned long id = probe - fhook_probes;
+
+	this_cpu_inc(fhook_hits[id]);
+	if (!!READ_ONCE(fhook_sample_flags[id]))
+		fhook_sample(id, ip, parent_ip);
+}
+
+/**
+ * @brief Internal function to rewrite a site with the int3 protocol.
+ *
+ * A CPU running the site meanwhile traps on the int3 and either skips the site (before v5.3)
+ * or emulates the new instruction, so it never fetches a half-written one.
+ * 'fhook_lock' must be held.
+ */
+static void fhook_patch_locked(void *addr, const u8 *insn)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 3, 0)
+	void *handler = (u8 *)addr + FHOOK_INSN_SIZE;
+#else
+	void *handler = NULL;
+#endif
+
+	get_online_cpus();
+	mutex_lock(fhook_text_mutex);
+	fhook_text_poke_bp(addr, insn, FHOOK_INSN_SIZE, handler);
+	mutex_unlock(fhook_text_mutex);
+	put_online_cpus();
+}
+
+/**
+ * @brief Internal function to remove a probe and free its slot.
+ *
+ * 'fhook_lock' must be held.
+ * A task preempted inside the trampoline may still return through it,
+ * so the caller must wait for such tasks before the slot is reused or the module goes away.
+ * Rewriting a site cannot fail, but ftrace may refuse to unregister a probe;
+ * then the slot is kept and marked stale.
+ *
+ * @param retries
+ * 	attempts to retry a failed ftrace unregistration, as the module is about to go away
+ */
+static int fhook_remove_locked(int id, int retries)
+{
+	fhook_probe_t *probe = &fhook_probes[id];
+	int retry = 0;
+
+	WRITE_ONCE(fhook_sample_flags[id], 0);
+	if (!probe->ftrace) {
+		fhook_patch_locked(probe->kfn, probe->orig);
+	} else {
+		while (!!unregister_ftrace_function(&probe->ops)) {
+			if (retry++ >= retries) {
+				probe->stale = 1;
+				pr_warn("The probe of %s is stale; ftrace still calls into the module (id: %d)\n",
+					probe->sym, id);
+				return -1;
+			}
+			msleep(FHOOK_RESTORE_RETRY_MS);
+		}
+		(void) ftrace_set_filter_ip(&probe->ops, (unsigned long)probe->kfn, 1, 0);
+	}
+
+	pr_info("Removed the probe of %s (id: %d)\n", probe->sym, id);
+	probe->kfn = NULL;
+	probe->sym[0] = '\0';
+	probe->ftrace = 0;
+	probe->stale = 0;
+	return 0;
+}
+
+static int fhook_find_locked(const char *sym)
+{
+	int id;
+
+	for (id = 0; id < FHOOK_MAX_PROBES; id++)
+		if (fhook_probes[id].kfn != NULL && strcmp(fhook_probes[id].sym, sym) == 0)
+			return id;
+	return -1;
+}
+
+/**
+ * @brief Internal function to probe a site ftrace owns through an ftrace_ops.
+ *
+ * 'fhook_lock' must be held.
+ */
+static int fhook_add_ftrace_locked(int id, unsigned long kfn)
+{
+	struct ftrace_ops *ops = &fhook_probes[id].ops;
+
+	/* The filter is reset here rather than freed on removal; the ops are reused by the slot */
+	ops->func = fhook_ftrace_fn;
+	if (!!ftrace_set_filter_ip(ops, kfn, 0, 1))
+		return -1;
+	if (!!register_ftrace_function(ops)) {
+		(void) ftrace_set_filter_ip(ops, kfn, 1, 0);
+		return -1;
+	}
+	return 0;
+}
+
+int fhook_add(const char *sym, int sample)
+{
+	unsigned long kfn;
+	u8 insn[FHOOK_INSN_SIZE];
+	s32 call_operand;
+	unsigned int cpu;
+	int id, ftrace, ret = -1;
+
+	mutex_lock(&fhook_lock);
+	if (!fhook_active || fhook_find_locked(sym) >= 0)
+		goto out_unlock;
+
+	/* Module text could go away under the probe */
+	kfn = kallsyms_lookup_name(sym);
+	if (kfn < fhook_stext || kfn >= fhook_etext)
+		goto out_unlock;
+
+	for (id = 0; id < FHOOK_MAX_PROBES; id++)
+		if (fhook_probes[id].kfn == NULL)
+			break;
+	if (id == FHOOK_MAX_PROBES)
+		goto out_unlock;
+
+	/* ftrace would find a trampoline call where it expects its own bytes, and turn itself off */
+	ftrace = fhook_ftrace_location != NULL && fhook_ftrace_location(kfn) == kfn;
+	if (!ftrace &&
+		(!!fhook_test_site((void *)kfn) ||
+		!!probe_kernel_read(fhook_probes[id].orig, (void *)kfn, FHOOK_INSN_SIZE)))
+		goto out_unlock;
+
+	for_each_possible_cpu(cpu)
+		per_cpu(fhook_hits[id], cpu) = 0;
+	WRITE_ONCE(fhook_sample_flags[id], !!sample);
+
+	if (!!ftrace) {
+		if (!!fhook_add_ftrace_locked(id, kfn))
+			goto out_unlock;
+	} else {
+		call_operand = (s32)(fhook_tramp_addr(id) - kfn) - FHOOK_INSN_SIZE;
+		insn[0] = FHOOK_CALL_REL32_OPCODE;
+		memcpy(&insn[1], &call_operand, sizeof(call_operand));
+		fhook_patch_locked((void *)kfn, insn);
+	}
+
+	fhook_probes[id].kfn = (void *)kfn;
+	fhook_probes[id].ftrace = ftrace;
+	strlcpy(fhook_probes[id].sym, sym, sizeof(fhook_probes[id].sym));
+	pr_info("Added the probe of %s (id: %d, addr: %p, sample: %d, ftrace: %d)\n",
+		sym, id, (void *)kfn, !!sample, ftrace);
+	ret = id;
+
+out_unlock:
+	mutex_unlock(&fhook_lock);
+	return ret;
+}
+
+int fhook_del(int id)
+{
+	int ret = -1;
+
+	if (id < 0 || id >= FHOOK_MAX_PROBES)
+		return -1;
+
+	mutex_lock(&fhook_lock);
+	if (fhook_probes[id].kfn == NULL)
+		goto out_unlock;
+
+	ret = fhook_remove_locked(id, 0);
+	if (!ret)
+		synchronize_rcu_tasks();
+
+out_unlock:
+	mutex_unlock(&fhook_lock);
+	return ret;
+}
+
+int fhook_set_sample(int id, int sample)
+{
+	int ret = -1;
+
+	if (id < 0 || id >= FHOOK_MAX_PROBES)
+		return -1;
+
+	mutex_lock(&fhook_lock);
+	if (fhook_probes[id].kfn != NULL) {
+		WRITE_ONCE(fhook_sample_flags[id], !!sample);
+		ret = 0;
+	}
+	mutex_unlock(&fhook_lock);
+	return ret;
+}
+
+int fhook_find(const char *sym)
+{
+	int id;
+
+	mutex_lock(&fhook_lock);
+	id = fhook_find_locked(sym);
+	mutex_unlock(&fhook_lock);
+	return id;
+}
+
+/**
+ * @brief Internal function to fill the snapshot of a probe.
+ *
+ * 'fhook_lock' must be held.
+ */
+static void fhook_fill_stat_locked(int id, fhook_stat_t *stat)
+{
+	unsigned int cpu;
+
+	strlcpy(stat->sym, fhook_probes[id].sym, sizeof(stat->sym));
+	stat->sample = READ_ONCE(fhook_sample_flags[id]);
+	stat->nr_hits = 0;
+	for_each_possible_cpu(cpu)
+		stat->nr_hits += READ_ONCE(per_cpu(fhook_hits[id], cpu));
+}
+
+int fhook_get_stat(int id, fhook_stat_t *stat)
+{
+	int ret = -1;
+
+	if (id < 0 || id >= FHOOK_MAX_PROBES)
+		return -1;
+
+	mutex_lock(&fhook_lock);
+	if (fhook_probes[id].kfn != NULL) {
+		fhook_fill_stat_locked(id, stat);
+		ret = 0;
+	}
+	mutex_unlock(&fhook_lock);
+	return ret;
+}
+
+static int fhook_show(struct seq_file *seq, void *unused)
+{
+	fhook_stat_t stat;
+	int id;
+
+	mutex_lock(&fhook_lock);
+	for (id = 0; id < FHOOK_MAX_PROBES; id++) {
+		if (fhook_probes[id].kfn == NULL)
+			continue;
+		fhook_fill_stat_locked(id, &stat);
+		seq_printf(seq, "%2d %s hits %llu%s%s%s\n", id, stat.sym, stat.nr_hits,
+			!!stat.sample ? " sample" : "", !!fhook_probes[id].ftrace ? " ftrace" : "",
+			!!fhook_probes[id].stale ? " stale" : "");
+	}
+	mutex_unlock(&fhook_lock);
+	return 0;
+}
+
+static int fhook_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, fhook_show, NULL);
+}
+
+/**
+ * @brief Internal function to parse a control command.
+ *
+ * 'add <sym> [sample]' probes a function, 'del <sym>' removes its probe.
+ */
+static ssize_t fhook_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char buf[KSYM_NAME_LEN + 16];
+	char cmd[8], sym[KSYM_NAME_LEN], opt[8];
+	int nr_args;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (!!copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	nr_args = sscanf(buf, "%7s %127s %7s", cmd, sym, opt);
+	if (nr_args < 2)
+		return -EINVAL;
+
+	if (strcmp(cmd, "add") == 0) {
+		if (nr_args == 3 && strcmp(opt, "sample") != 0)
+			return -EINVAL;
+		return (fhook_add(sym, nr_args == 3) >= 0) ? count : -EIO;
+	}
+	if (strcmp(cmd, "del") == 0 && nr_args == 2)
+		return !fhook_del(fhook_find(sym)) ? count : -EIO;
+	return -EINVAL;
+}
+
+static const struct file_operations fhook_fops = {
+	.owner = THIS_MODULE,
+	.open = fhook_open,
+	.read = seq_read,
+	.write = fhook_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int fhook_startup(struct dentry *debugfs_dir)
+{
+	if (!!fhook_active)
+		return -1;
+
+	fhook_fentry_kfn = (void *)kallsyms_lookup_name("__fentry__");
+	fhook_stext = kallsyms_lookup_name("_stext");
+	fhook_etext = kallsyms_lookup_name("_etext");
+	fhook_text_poke_bp = (fhook_text_poke_bp_t)kallsyms_lookup_name("text_poke_bp");
+	fhook_text_mutex = (struct mutex *)kallsyms_lookup_name("text_mutex");
+	/* Missing without CONFIG_DYNAMIC_FTRACE, where ftrace never rewrites a site */
+	fhook_ftrace_location = (fhook_ftrace_location_t)kallsyms_lookup_name("ftrace_location");
+	if (fhook_fentry_kfn == NULL || !fhook_stext || !fhook_etext ||
+		fhook_text_poke_bp == NULL || fhook_text_mutex == NULL)
+		return -1;
+
+	if (debugfs_dir != NULL) {
+		fhook_file = debugfs_create_file(FHOOK_FILE_NAME, 0600, debugfs_dir, NULL, &fhook_fops);
+		if (IS_ERR_OR_NULL(fhook_file)) {
+			fhook_file = NULL;
+			return -1;
+		}
+	}
+
+	mutex_lock(&fhook_lock);
+	fhook_active = 1;
+	mutex_unlock(&fhook_lock);
+
+	pr_info("Attached the fhook subsystem successfully (trampolines: %p, probes: %d)\n",
+		&fhook_tramps, FHOOK_MAX_PROBES);
+	return 0;
+}
+
+void fhook_shutdown(void)
+{
+	int id;
+
+	debugfs_remove(fhook_file);
+	fhook_file = NULL;
+
+	mutex_lock(&fhook_lock);
+	if (!fhook_active) {
+		mutex_unlock(&fhook_lock);
+		return;
+	}
+	fhook_active = 0;
+	/* The trampolines and the ftrace callback go away with the module */
+	for (id = 0; id < FHOOK_MAX_PROBES; id++)
+		if (fhook_probes[id].kfn != NULL &&
+			!!fhook_remove_locked(id, FHOOK_RESTORE_RETRIES))
+			WARN(1, "fhook: unloading with the stale probe of %s\n", fhook_probes[id].sym);
+	mutex_unlock(&fhook_lock);
+
+	/* Tasks preempted inside a trampoline */
+	synchronize_rcu_tasks();
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+/**
+ * @file fhook.h
+ * @brief Prototypes for 'fhook subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'fhook subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_FHOOK_H
+#define _NMDBG_FHOOK_H
+
+#include <linux/types.h>
+#include <linux/dcache.h>
+#include <linux/kallsyms.h>
+
+#define FHOOK_MAX_PROBES 64
+#define FHOOK_FILE_NAME "fhook"
+
+/**
+ * @brief Snapshot of a probe.
+ */
+typedef struct {
+	/** Probed function */
+	char sym[KSYM_NAME_LEN];
+	/** Hits summed over all CPUs */
+	u64 nr_hits;
+	/** Non-zero if every hit is sampled into the trace ring */
+	int sample;
+} fhook_stat_t;
+
+/**
+ * @brief Activate the fhook subsys.
+ *
+ * It resolves the kernel text patching internals through kallsyms.
+ * The tracering subsys must be started before if probes are sampled.
+ *
+ * @param debugfs_dir
+ * 	debugfs directory to create the control file in (NULL to skip)
+ * @return
+ * 	0 if activation success.
+ */
+int fhook_startup(struct dentry *debugfs_dir);
+
+/**
+ * @brief Deactivate the fhook subsys.
+ *
+ * Every probe is removed; restoring a site cannot fail, and a probe ftrace refuses to unregister is retried.
+ */
+void fhook_shutdown(void);
+
+/**
+ * @brief Probe a core kernel function through its __fentry__ site.
+ *
+ * A site ftrace owns is probed through an ftrace_ops, so it can be traced at the same time;
+ * any other site is redirected to a trampoline which bumps a per-cpu counter and returns to the function.
+ *
+ * @param sym
+ * 	name of the function
+ * @param sample
+ * 	non-zero to record every hit into the trace ring as well
+ * @return
+ * 	the probe id, or -1 on failure.
+ */
+int fhook_add(const char *sym, int sample);
+
+/**
+ * @brief Remove a probe and restore the original __fentry__ site.
+ *
+ * It may sleep until no task can be running the trampoline.
+ * If ftrace refuses to unregister the probe, it is kept and marked stale; calling this again retries.
+ *
+ * @param id
+ * 	probe id returned by fhook_add()
+ * @return
+ * 	0 if the probe was removed.
+ */
+int fhook_del(int id);
+
+/**
+ * @brief Turn sampling of a probe on or off.
+ *
+ * @param id
+ * 	probe id returned by fhook_add()
+ * @param sample
+ * 	non-zero to record every hit into the trace ring
+ * @return
+ * 	0 if the probe exists.
+ */
+int fhook_set_sample(int id, int sample);
+
+/**
+ * @brief Look up the probe of a function.
+ *
+ * @param sym
+ * 	name of the function
+ * @return
+ * 	the probe id, or -1 if the function is not probed.
+ */
+int fhook_find(const char *sym);
+
+/**
+ * @brief Get a snapshot of a probe.
+ *
+ * The per-cpu counters are summed here; hits racing with the read may or may not be counted.
+ *
+ * @param id
+ * 	probe id returned by fhook_add()
+ * @param stat
+ * 	snapshot to be filled
+ * @return
+ * 	0 if the probe exists.
+ */
+int fhook_get_stat(int id, fhook_stat_t *stat);
+
+#endif
\ No newline at end of file
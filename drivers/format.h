@@ -0,0 +1,248 @@
+/**
+ * @file format.h
+ * @brief Binary formats shared by nmdbg and its offline tools.
+ *
+ * This contains the on-disk record layouts emitted by nmdbg subsystems.
+ * It must stay usable from both kernel and userspace, so only fixed-width
+ * types from <linux/types.h> are allowed here.
+ *
+ * A dump stream starts with a single nmdbg_fmt_file_t followed by records.
+ * Every record starts with nmdbg_fmt_rec_t and its size is always
+ * a multiple of NMDBG_FMT_ALIGN, so a reader can skip unknown records.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_FORMAT_H
+#define _NMDBG_FORMAT_H
+
+#include <linux/types.h>
+
+/* "NMBG" in little-endian */
+#define NMDBG_FMT_MAGIC 0x47424d4eU
+#define NMDBG_FMT_VERSION 1
+#define NMDBG_FMT_ALIGN 8
+
+#define NMDBG_FMT_ALIGN_SIZE(size) \
+	(((size) + (NMDBG_FMT_ALIGN - 1)) & ~((__u32)NMDBG_FMT_ALIGN - 1))
+
+/* The stream was cut because the destination ran out of space */
+#define NMDBG_FMT_FILE_TRUNCATED 0x0001
+/* Record TSCs were converted into the timebase of a single reference CPU */
+#define NMDBG_FMT_FILE_TSC_CORRECTED 0x0002
+
+/* Maximum number of ranges carried by a single memdump index record */
+#define NMDBG_FMT_MEMDUMP_INDEX_MAX 256
+
+#define NMDBG_FMT_COMM_LEN 16
+#define NMDBG_FMT_CRASH_MSG_LEN 128
+
+/**
+ * @brief Record types.
+ */
+typedef enum {
+	NMDBG_FMT_REC_NONE = 0,
+	NMDBG_FMT_REC_MEMDUMP_HDR,
+	NMDBG_FMT_REC_MEMDUMP_INDEX,
+	NMDBG_FMT_REC_MEMDUMP_PAGE,
+	NMDBG_FMT_REC_REGS,
+	NMDBG_FMT_REC_SAMPLE,
+	NMDBG_FMT_REC_CRASH,
+	NMDBG_FMT_REC_WATCH,
+} nmdbg_fmt_rec_type_t;
+
+/**
+ * @brief Reasons of a register snapshot.
+ */
+typedef enum {
+	NMDBG_FMT_REGS_SNAPSHOT = 0,
+	NMDBG_FMT_REGS_LOCKUP,
+} nmdbg_fmt_regs_reason_t;
+
+/**
+ * @brief Kinds of a crash record.
+ */
+typedef enum {
+	NMDBG_FMT_CRASH_PANIC = 0,
+	NMDBG_FMT_CRASH_OOPS,
+} nmdbg_fmt_crash_kind_t;
+
+/**
+ * @brief Stream header.
+ */
+typedef struct {
+	/** Always NMDBG_FMT_MAGIC */
+	__u32 magic;
+	/** Always NMDBG_FMT_VERSION */
+	__u16 version;
+	/** NMDBG_FMT_FILE_* flags */
+	__u16 flags;
+	/** TSC frequency of the producer (kHz) */
+	__u64 tsc_khz;
+	/** Number of possible CPUs of the producer */
+	__u32 nr_cpus;
+	/** Size of this header */
+	__u32 hdr_size;
+} nmdbg_fmt_file_t;
+
+/**
+ * @brief Common record header.
+ */
+typedef struct {
+	/** One of nmdbg_fmt_rec_type_t */
+	__u16 type;
+	/** CPU which produced the record */
+	__u16 cpu;
+	/** Size of the record including this header (NMDBG_FMT_ALIGN aligned) */
+	__u32 size;
+	/** TSC value when the record was produced */
+	__u64 tsc;
+} nmdbg_fmt_rec_t;
+
+/**
+ * @brief Selective memory dump summary (NMDBG_FMT_REC_MEMDUMP_HDR).
+ *
+ * Exactly one summary precedes the index and page records of a dump.
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** Page size of the producer */
+	__u32 page_size;
+	/** Reserved (zero) */
+	__u32 reserved;
+	/** Highest PFN + 1 of the producer */
+	__u64 max_pfn;
+	/** Number of valid pages walked (size of a full dump in pages) */
+	__u64 nr_total;
+	/** Number of pages emitted */
+	__u64 nr_dumped;
+	/** Number of pages skipped because they were free */
+	__u64 nr_free;
+	/** Number of pages skipped because they were zero-filled */
+	__u64 nr_zero;
+	/** Number of pages skipped because they belonged to userspace */
+	__u64 nr_user;
+	/** Number of index ranges that follow */
+	__u64 nr_ranges;
+} nmdbg_fmt_memdump_hdr_t;
+
+/**
+ * @brief A range of contiguous emitted PFNs.
+ */
+typedef struct {
+	__u64 start_pfn;
+	__u64 nr_pages;
+} nmdbg_fmt_memdump_range_t;
+
+/**
+ * @brief Page index chunk (NMDBG_FMT_REC_MEMDUMP_INDEX).
+ *
+ * The union of all index chunks lists every emitted page in ascending PFN order.
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** Number of valid entries in 'ranges' */
+	__u32 nr_ranges;
+	/** Reserved (zero) */
+	__u32 reserved;
+	nmdbg_fmt_memdump_range_t ranges[];
+} nmdbg_fmt_memdump_index_t;
+
+/**
+ * @brief A single page (NMDBG_FMT_REC_MEMDUMP_PAGE).
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** PFN of the page */
+	__u64 pfn;
+	/** Page contents ('page_size' bytes) */
+	__u8 data[];
+} nmdbg_fmt_memdump_page_t;
+
+/**
+ * @brief x86-64 register set captured in the NMI context.
+ */
+typedef struct {
+	__u64 ip;
+	__u64 sp;
+	__u64 flags;
+	__u64 ax;
+	__u64 bx;
+	__u64 cx;
+	__u64 dx;
+	__u64 si;
+	__u64 di;
+	__u64 bp;
+	__u64 r8;
+	__u64 r9;
+	__u64 r10;
+	__u64 r11;
+	__u64 r12;
+	__u64 r13;
+	__u64 r14;
+	__u64 r15;
+	__u64 cs;
+	__u64 ss;
+} nmdbg_fmt_regs_t;
+
+/**
+ * @brief A register snapshot (NMDBG_FMT_REC_REGS).
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** One of nmdbg_fmt_regs_reason_t */
+	__u32 reason;
+	/** PID of the interrupted task */
+	__u32 pid;
+	/** Command name of the interrupted task */
+	char comm[NMDBG_FMT_COMM_LEN];
+	nmdbg_fmt_regs_t regs;
+} nmdbg_fmt_regs_rec_t;
+
+/**
+ * @brief A lightweight trace sample (NMDBG_FMT_REC_SAMPLE).
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** Producer-defined identifier (e.g. probe id) */
+	__u32 id;
+	/** Reserved (zero) */
+	__u32 reserved;
+	/** Instruction pointer of the sample */
+	__u64 ip;
+	/** Producer-defined argument */
+	__u64 arg;
+} nmdbg_fmt_sample_rec_t;
+
+/**
+ * @brief A crash summary (NMDBG_FMT_REC_CRASH).
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** One of nmdbg_fmt_crash_kind_t */
+	__u32 kind;
+	/** Reserved (zero) */
+	__u32 reserved;
+	/** Address the crash was raised from */
+	__u64 ip;
+	/** NUL-terminated message */
+	char msg[NMDBG_FMT_CRASH_MSG_LEN];
+} nmdbg_fmt_crash_rec_t;
+
+/**
+ * @brief A hardware watchpoint hit (NMDBG_FMT_REC_WATCH).
+ */
+typedef struct {
+	nmdbg_fmt_rec_t rec;
+	/** Debug register slot which hit (0-3) */
+	__u32 slot;
+	/** Reserved (zero) */
+	__u32 reserved;
+	/** Instruction pointer after the access (data breakpoints are traps) */
+	__u64 ip;
+	/** Watched address */
+	__u64 addr;
+} nmdbg_fmt_watch_rec_t;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,242 @@
+/**
+ * @file lockup.c
+ * @brief The lockup subsystem.
+ *
+ * This is implementations of 'lockup subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "lockup.h"
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+#define LOCKUP_CAPTURE_HANDLER_NAME "lockup_capture"
+
+/**
+ * @brief Internal per-cpu state of the lockup detector.
+ */
+typedef struct {
+	/** Heartbeat timer pinned to the CPU */
+	struct hrtimer beat_timer;
+	/** Consecutive checks this CPU missed (written by checkers, cleared by the owner) */
+	unsigned int nr_missed;
+	/** Statistics (written by the owner only) */
+	u64 nr_beats;
+	u64 beat_cycles;
+	u64 nr_checks;
+	u64 check_cycles;
+	u64 nr_stalls;
+	u64 nr_captures;
+} lockup_cpu_t;
+
+static DEFINE_PER_CPU(lockup_cpu_t, lockup_cpus);
+
+/* CPUs running a heartbeat timer */
+static cpumask_t lockup_armed_mask;
+/* CPUs which did not beat since the last check */
+static cpumask_t lockup_pending_mask;
+/* Scratch mask of the current checker */
+static cpumask_t lockup_stalled_mask;
+
+static DEFINE_RAW_SPINLOCK(lockup_check_lock);
+static atomic64_t lockup_next_check = ATOMIC64_INIT(0);
+static atomic_t lockup_checker = ATOMIC_INIT(0);
+
+static ktime_t lockup_beat_period;
+static u64 lockup_check_period = 0;
+static unsigned int lockup_thresh = LOCKUP_DEFAULT_THRESH;
+static int lockup_active = 0;
+
+/**
+ * @brief Internal NMI function to capture the registers of a stalled CPU.
+ */
+static nmictrl_ret_t lockup_capture_nmifn(struct pt_regs *regs)
+{
+	this_cpu_inc(lockup_cpus.nr_captures);
+	(void) tracering_write_regs(NMDBG_FMT_REGS_LOCKUP, regs);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to look for stalled CPUs and send them an NMI.
+ *
+ * The pending mask is handled with word-sized cpumask operations,
+ * and only the CPUs left in it are visited; so the per-cpu work is O(stalled CPUs).
+ *
+ * @param self
+ * 	state of the checker CPU
+ * @param this_cpu
+ * 	checker CPU
+ */
+static void lockup_check(lockup_cpu_t *self, unsigned int this_cpu)
+{
+	unsigned int cpu, next_cpu;
+	u64 begin = rdtsc();
+
+	if (!raw_spin_trylock(&lockup_check_lock))
+		return;
+
+	cpumask_and(&lockup_stalled_mask, &lockup_pending_mask, &lockup_armed_mask);
+	cpumask_and(&lockup_stalled_mask, &lockup_stalled_mask, cpu_online_mask);
+	cpumask_clear_cpu(this_cpu, &lockup_stalled_mask);
+	/*
+	 * Re-arm for the next period.
+	 * A concurrent beat could be overwritten here, but every CPU beats twice per period,
+	 * so it is cleared again before the next check.
+	 */
+	cpumask_copy(&lockup_pending_mask, &lockup_armed_mask);
+
+	for_each_cpu(cpu, &lockup_stalled_mask) {
+		lockup_cpu_t *peer = per_cpu_ptr(&lockup_cpus, cpu);
+		unsigned int nr_missed = READ_ONCE(peer->nr_missed) + 1;
+
+		WRITE_ONCE(peer->nr_missed, nr_missed);
+		/*
+		 * Send an NMI only once per stall; 'nr_missed' is reset by the next heartbeat.
+		 */
+		if (nr_missed != lockup_thresh) {
+			cpumask_clear_cpu(cpu, &lockup_stalled_mask);
+			continue;
+		}
+		nmictrl_prepare_handler(LOCKUP_CAPTURE_HANDLER_NAME, cpu);
+		self->nr_stalls++;
+		pr_warn("Detected a hard lockup on CPU %u (checked by CPU %u)\n", cpu, this_cpu);
+	}
+	nmictrl_trigger_mask(&lockup_stalled_mask);
+
+	next_cpu = cpumask_next(this_cpu, &lockup_armed_mask);
+	if (next_cpu >= nr_cpu_ids)
+		next_cpu = cpumask_first(&lockup_armed_mask);
+	atomic_set(&lockup_checker, next_cpu);
+
+	raw_spin_unlock(&lockup_check_lock);
+
+	self->nr_checks++;
+	self->check_cycles += rdtsc() - begin;
+}
+
+/**
+ * @brief Internal function to beat the heartbeat of the current CPU.
+ *
+ * The designated checker runs the check when it is due.
+ * If the checker itself is stuck, any CPU takes over once the check is two periods late.
+ */
+static enum hrtimer_restart lockup_beat_fn(struct hrtimer *beat_timer)
+{
+	lockup_cpu_t *self = this_cpu_ptr(&lockup_cpus);
+	unsigned int this_cpu = smp_processor_id();
+	u64 begin = rdtsc(), now;
+	s64 next_check;
+
+	self->nr_beats++;
+	if (!!READ_ONCE(self->nr_missed))
+		WRITE_ONCE(self->nr_missed, 0);
+	/* Test first to not bounce the shared cacheline when the bit is already clear */
+	if (cpumask_test_cpu(this_cpu, &lockup_pending_mask))
+		cpumask_clear_cpu(this_cpu, &lockup_pending_mask);
+
+	now = ktime_to_ns(hrtimer_cb_get_time(beat_timer));
+	next_check = atomic64_read(&lockup_next_check);
+	if (now >= next_check &&
+		(atomic_read(&lockup_checker) == this_cpu || now >= next_check + 2 * lockup_check_period) &&
+		atomic64_cmpxchg(&lockup_next_check, next_check, now + lockup_check_period) == next_check)
+		lockup_check(self, this_cpu);
+
+	self->beat_cycles += rdtsc() - begin;
+
+	if (!READ_ONCE(lockup_active))
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(beat_timer, lockup_beat_period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * @brief Internal function to start the heartbeat timer on the current CPU.
+ */
+static void lockup_start_beat(void *unused)
+{
+	lockup_cpu_t *self = this_cpu_ptr(&lockup_cpus);
+
+	cpumask_set_cpu(smp_processor_id(), &lockup_armed_mask);
+	hrtimer_start(&self->beat_timer, lockup_beat_period, HRTIMER_MODE_REL_PINNED);
+}
+
+int lockup_startup(unsigned int period_ms, unsigned int thresh)
+{
+	unsigned int cpu;
+
+	if (period_ms == 0 || thresh == 0 || !!lockup_active)
+		return -1;
+
+	lockup_check_period = (u64)period_ms * NSEC_PER_MSEC;
+	lockup_beat_period = ns_to_ktime(lockup_check_period / 2);
+	lockup_thresh = thresh;
+
+	if (!!nmictrl_add_handler(LOCKUP_CAPTURE_HANDLER_NAME, &lockup_capture_nmifn))
+		return -1;
+
+	for_each_possible_cpu(cpu) {
+		lockup_cpu_t *peer = per_cpu_ptr(&lockup_cpus, cpu);
+
+		memset(peer, 0, sizeof(*peer));
+		hrtimer_init(&peer->beat_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		peer->beat_timer.function = lockup_beat_fn;
+	}
+
+	cpumask_clear(&lockup_armed_mask);
+	cpumask_copy(&lockup_pending_mask, cpu_online_mask);
+	atomic_set(&lockup_checker, cpumask_first(cpu_online_mask));
+	atomic64_set(&lockup_next_check, ktime_get_ns() + lockup_check_period);
+	WRITE_ONCE(lockup_active, 1);
+
+	/*
+	 * CPUs brought online later are not armed, so they are never reported.
+	 */
+	on_each_cpu(lockup_start_beat, NULL, 1);
+
+	pr_info("Attached the lockup detector successfully (period: %u ms, thresh: %u, cpus: %u)\n",
+		period_ms, thresh, cpumask_weight(&lockup_armed_mask));
+	return 0;
+}
+
+void lockup_shutdown(void)
+{
+	unsigned int cpu;
+
+	if (!lockup_active)
+		return;
+
+	WRITE_ONCE(lockup_active, 0);
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu(lockup_cpus, cpu).beat_timer);
+	cpumask_clear(&lockup_armed_mask);
+
+	nmictrl_del_handler(LOCKUP_CAPTURE_HANDLER_NAME);
+}
+
+void lockup_get_stat(lockup_stat_t *stat)
+{
+	unsigned int cpu;
+
+	memset(stat, 0, sizeof(*stat));
+	for_each_possible_cpu(cpu) {
+		lockup_cpu_t *peer = per_cpu_ptr(&lockup_cpus, cpu);
+
+		stat->nr_beats += READ_ONCE(peer->nr_beats);
+		stat->beat_cycles += READ_ONCE(peer->beat_cycles);
+		stat->nr_checks += READ_ONCE(peer->nr_checks);
+		stat->check_cycles += READ_ONCE(peer->check_cycles);
+		stat->nr_stalls += READ_ONCE(peer->nr_stalls);
+		stat->nr_captures += READ_ONCE(peer->nr_captures);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+/**
+ * @file lockup.h
+ * @brief Prototypes for 'lockup subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'lockup subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_LOCKUP_H
+#define _NMDBG_LOCKUP_H
+
+#include "nmictrl.h"
+#include "tracering.h"
+
+#define LOCKUP_DEFAULT_PERIOD_MS 1000
+#define LOCKUP_DEFAULT_THRESH 2
+
+/**
+ * @brief Statistics of the lockup detector (aggregated over all CPUs when read).
+ */
+typedef struct {
+	/** Number of heartbeats */
+	u64 nr_beats;
+	/** Cycles spent in heartbeats, including checks */
+	u64 beat_cycles;
+	/** Number of checks */
+	u64 nr_checks;
+	/** Cycles spent in checks */
+	u64 check_cycles;
+	/** Number of stalled CPUs sent an NMI */
+	u64 nr_stalls;
+	/** Number of register snapshots captured from stalled CPUs */
+	u64 nr_captures;
+} lockup_stat_t;
+
+/**
+ * @brief Activate the lockup detector.
+ *
+ * Every CPU beats twice per @p period_ms from a pinned hrtimer.
+ * Once per @p period_ms, a checker CPU (rotated after every check) collects CPUs
+ * which did not beat and sends them an NMI through the nmictrl coresys.
+ * Their registers are captured into the trace ring.
+ *
+ * The nmictrl coresys and the tracering subsys must be started before.
+ *
+ * @param period_ms
+ * 	check period (millisec)
+ * @param thresh
+ * 	number of missed checks before a CPU is considered locked up
+ * @return
+ * 	0 if activation success.
+ */
+int lockup_startup(unsigned int period_ms, unsigned int thresh);
+
+/**
+ * @brief Deactivate the lockup detector.
+ */
+void lockup_shutdown(void);
+
+/**
+ * @brief Get the statistics of the lockup detector.
+ *
+ * @param stat
+ * 	statistics to be filled
+ */
+void lockup_get_stat(lockup_stat_t *stat);
+
+#endif
\ No newline at end of file
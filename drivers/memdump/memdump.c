@@ -0,0 +1,416 @@
+/**
+ * @file memdump.c
+ * @brief The memdump subsystem.
+ *
+ * This is implementations of 'memdump subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "memdump.h"
+
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/bitmap.h>
+#include <linux/atomic.h>
+#include <linux/io.h>
+#include <linux/smp.h>
+#include <asm/cacheflush.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+/**
+ * @brief Internal page classes decided at dump time.
+ */
+typedef enum {
+	MEMDUMP_PAGE_KEEP,
+	MEMDUMP_PAGE_FREE,
+	MEMDUMP_PAGE_ZERO,
+	MEMDUMP_PAGE_USER,
+	MEMDUMP_PAGE_IGNORE,
+} memdump_class_t;
+
+static unsigned long *memdump_page_bitmap = NULL;
+static unsigned long memdump_max_pfn = 0;
+
+static u8 *memdump_region_vaddr = NULL;
+static phys_addr_t memdump_region_base = 0;
+static size_t memdump_region_size = 0;
+static size_t memdump_region_offset = 0;
+
+static atomic_t memdump_taken = ATOMIC_INIT(0);
+static memdump_stat_t memdump_last_stat;
+
+/* Scratch buffer for the zero-page test; only the first dumper touches it. */
+static u8 memdump_scratch_page[PAGE_SIZE] __aligned(PAGE_SIZE);
+
+/* Deadline test of the running dump (NULL for no deadline) */
+static int (*memdump_time_is_up)(void) = NULL;
+
+/**
+ * @brief Internal function to test if the running dump must stop, and mark it truncated if so.
+ */
+static int memdump_out_of_time(void)
+{
+	if (memdump_time_is_up == NULL || !memdump_time_is_up())
+		return 0;
+
+	memdump_last_stat.truncated = 1;
+	memdump_last_stat.timed_out = 1;
+	return 1;
+}
+
+/**
+ * @brief Internal function to test if a PFN belongs to the dump region itself.
+ */
+static __always_inline int memdump_pfn_in_region(unsigned long pfn)
+{
+	return memdump_region_vaddr != NULL &&
+		pfn >= PHYS_PFN(memdump_region_base) &&
+		pfn < PHYS_PFN(memdump_region_base + memdump_region_size + PAGE_SIZE - 1);
+}
+
+/**
+ * @brief Internal function to reserve space for a record in the dump region.
+ *
+ * @param size
+ * 	record size (must be NMDBG_FMT_ALIGN aligned)
+ * @return
+ * 	address of the reserved space, or NULL if the region is full.
+ */
+static void *memdump_reserve(size_t size)
+{
+	void *rec_ptr;
+
+	if (memdump_region_vaddr == NULL)
+		return NULL;
+
+	if (memdump_region_size - memdump_region_offset < size) {
+		memdump_last_stat.truncated = 1;
+		return NULL;
+	}
+
+	rec_ptr = memdump_region_vaddr + memdump_region_offset;
+	memdump_region_offset += size;
+	return rec_ptr;
+}
+
+/**
+ * @brief Internal function to fill a common record header.
+ */
+static __always_inline void memdump_fill_rec(nmdbg_fmt_rec_t *rec, u16 type, u32 size)
+{
+	rec->type = type;
+	rec->cpu = (u16)raw_smp_processor_id();
+	rec->size = size;
+	rec->tsc = rdtsc();
+}
+
+/**
+ * @brief Internal function to classify a page.
+ *
+ * Pages are read through probe_kernel_read() because some reserved pages could be not mapped.
+ *
+ * @param pfn
+ * 	PFN of the page to classify
+ * @param end_pfn
+ * 	end of the memory section which contains @p pfn
+ * @param nr_pages
+ * 	number of pages covered by this decision
+ * @return
+ * 	class of the page
+ */
+static memdump_class_t memdump_classify_page(unsigned long pfn, unsigned long end_pfn, unsigned long *nr_pages)
+{
+	struct page *page;
+
+	*nr_pages = 1;
+
+	if (!pfn_valid(pfn) || memdump_pfn_in_region(pfn))
+		return MEMDUMP_PAGE_IGNORE;
+
+	page = pfn_to_page(pfn);
+
+	if (PageBuddy(page)) {
+		/*
+		 * The head of a free buddy block keeps its order in page_private().
+		 * Other CPUs could still modify it, so clamp it before trusting.
+		 */
+		unsigned long order = READ_ONCE(page_private(page));
+
+		if (order < MAX_ORDER)
+			*nr_pages = min(1UL << order, end_pfn - pfn);
+		return MEMDUMP_PAGE_FREE;
+	}
+
+	/*
+	 * Pages on the per-cpu free lists are not marked as buddy, but they have no reference.
+	 */
+	if (!PageReserved(page) && page_count(page) == 0)
+		return MEMDUMP_PAGE_FREE;
+
+	if (PageAnon(page) || PageLRU(page))
+		return MEMDUMP_PAGE_USER;
+
+	if (!!probe_kernel_read(memdump_scratch_page, page_address(page), PAGE_SIZE))
+		return MEMDUMP_PAGE_IGNORE;
+
+	if (memchr_inv(memdump_scratch_page, 0, PAGE_SIZE) == NULL)
+		return MEMDUMP_PAGE_ZERO;
+
+	return MEMDUMP_PAGE_KEEP;
+}
+
+/**
+ * @brief Internal function to compute the bitmap of pages to be emitted.
+ *
+ * @param stat
+ * 	statistics to be accumulated
+ */
+static void memdump_compute_bitmap(memdump_stat_t *stat)
+{
+	unsigned long pfn, end_pfn, nr_pages;
+
+	bitmap_zero(memdump_page_bitmap, memdump_max_pfn);
+
+	for (pfn = 0; pfn < memdump_max_pfn; pfn = end_pfn) {
+		end_pfn = min(memdump_max_pfn, SECTION_ALIGN_UP(pfn + 1));
+		/*
+		 * Walk memory sections instead of PFNs.
+		 * A missing section skips PAGES_PER_SECTION pages at once.
+		 */
+		if (!present_section_nr(pfn_to_section_nr(pfn)))
+			continue;
+		/* Pages not walked yet are left out of the bitmap */
+		if (!!memdump_out_of_time())
+			return;
+
+		while (pfn < end_pfn) {
+			switch (memdump_classify_page(pfn, end_pfn, &nr_pages)) {
+			case MEMDUMP_PAGE_KEEP:
+				__set_bit(pfn, memdump_page_bitmap);
+				stat->nr_dumped += nr_pages;
+				break;
+			case MEMDUMP_PAGE_FREE:
+				stat->nr_free += nr_pages;
+				break;
+			case MEMDUMP_PAGE_ZERO:
+				stat->nr_zero += nr_pages;
+				break;
+			case MEMDUMP_PAGE_USER:
+				stat->nr_user += nr_pages;
+				break;
+			case MEMDUMP_PAGE_IGNORE:
+				nr_pages = 1;
+				pfn += nr_pages;
+				continue;
+			}
+			stat->nr_total += nr_pages;
+			pfn += nr_pages;
+		}
+	}
+}
+
+/**
+ * @brief Internal function to iterate contiguous ranges of the page bitmap.
+ *
+ * @param pfn
+ * 	PFN to start searching from
+ * @param start_pfn
+ * 	first PFN of the found range
+ * @param nr_pages
+ * 	number of pages in the found range
+ * @return
+ * 	0 if a range was found.
+ */
+static int memdump_next_range(unsigned long pfn, unsigned long *start_pfn, unsigned long *nr_pages)
+{
+	unsigned long end_pfn;
+
+	pfn = find_next_bit(memdump_page_bitmap, memdump_max_pfn, pfn);
+	if (pfn >= memdump_max_pfn)
+		return -1;
+	end_pfn = find_next_zero_bit(memdump_page_bitmap, memdump_max_pfn, pfn);
+
+	*start_pfn = pfn;
+	*nr_pages = end_pfn - pfn;
+	return 0;
+}
+
+/**
+ * @brief Internal function to emit the dump summary and the page index.
+ *
+ * @param stat
+ * 	statistics computed by memdump_compute_bitmap()
+ */
+static void memdump_emit_index(memdump_stat_t *stat)
+{
+	nmdbg_fmt_memdump_hdr_t *hdr_ptr;
+	nmdbg_fmt_memdump_index_t *index_ptr = NULL;
+	unsigned long pfn = 0, start_pfn, nr_pages;
+	const u32 index_size = NMDBG_FMT_ALIGN_SIZE(sizeof(*index_ptr) +
+		NMDBG_FMT_MEMDUMP_INDEX_MAX * sizeof(nmdbg_fmt_memdump_range_t));
+
+	while (!memdump_next_range(pfn, &start_pfn, &nr_pages)) {
+		stat->nr_ranges++;
+		pfn = start_pfn + nr_pages;
+	}
+
+	hdr_ptr = memdump_reserve(sizeof(*hdr_ptr));
+	if (hdr_ptr == NULL)
+		return;
+	memdump_fill_rec(&hdr_ptr->rec, NMDBG_FMT_REC_MEMDUMP_HDR, sizeof(*hdr_ptr));
+	hdr_ptr->page_size = PAGE_SIZE;
+	hdr_ptr->reserved = 0;
+	hdr_ptr->max_pfn = memdump_max_pfn;
+	hdr_ptr->nr_total = stat->nr_total;
+	hdr_ptr->nr_dumped = stat->nr_dumped;
+	hdr_ptr->nr_free = stat->nr_free;
+	hdr_ptr->nr_zero = stat->nr_zero;
+	hdr_ptr->nr_user = stat->nr_user;
+	hdr_ptr->nr_ranges = stat->nr_ranges;
+
+	pfn = 0;
+	while (!memdump_next_range(pfn, &start_pfn, &nr_pages)) {
+		if (index_ptr == NULL || index_ptr->nr_ranges == NMDBG_FMT_MEMDUMP_INDEX_MAX) {
+			index_ptr = memdump_reserve(index_size);
+			if (index_ptr == NULL)
+				return;
+			memdump_fill_rec(&index_ptr->rec, NMDBG_FMT_REC_MEMDUMP_INDEX, index_size);
+			index_ptr->nr_ranges = 0;
+			index_ptr->reserved = 0;
+		}
+		index_ptr->ranges[index_ptr->nr_ranges].start_pfn = start_pfn;
+		index_ptr->ranges[index_ptr->nr_ranges].nr_pages = nr_pages;
+		index_ptr->nr_ranges++;
+		pfn = start_pfn + nr_pages;
+	}
+}
+
+/**
+ * @brief Internal function to emit all pages marked in the page bitmap.
+ */
+static void memdump_emit_pages(void)
+{
+	nmdbg_fmt_memdump_page_t *page_ptr;
+	unsigned long pfn;
+	const u32 page_size = NMDBG_FMT_ALIGN_SIZE(sizeof(*page_ptr) + PAGE_SIZE);
+
+	for_each_set_bit(pfn, memdump_page_bitmap, memdump_max_pfn) {
+		if (!!memdump_out_of_time())
+			return;
+		page_ptr = memdump_reserve(page_size);
+		if (page_ptr == NULL)
+			return;
+		memdump_fill_rec(&page_ptr->rec, NMDBG_FMT_REC_MEMDUMP_PAGE, page_size);
+		page_ptr->pfn = pfn;
+		if (!!probe_kernel_read(page_ptr->data, page_address(pfn_to_page(pfn)), PAGE_SIZE))
+			memset(page_ptr->data, 0, PAGE_SIZE);
+	}
+}
+
+int memdump_member_init(void)
+{
+	memdump_max_pfn = max_pfn;
+	memdump_page_bitmap = vzalloc(BITS_TO_LONGS(memdump_max_pfn) * sizeof(unsigned long));
+	if (memdump_page_bitmap == NULL)
+		return -1;
+
+	atomic_set(&memdump_taken, 0);
+	memset(&memdump_last_stat, 0, sizeof(memdump_last_stat));
+	return 0;
+}
+
+void memdump_member_exit(void)
+{
+	memdump_detach_region();
+	vfree(memdump_page_bitmap);
+	memdump_page_bitmap = NULL;
+}
+
+int memdump_attach_region(phys_addr_t base, size_t size)
+{
+	if (memdump_region_vaddr != NULL ||
+		size < sizeof(nmdbg_fmt_file_t) + sizeof(nmdbg_fmt_memdump_hdr_t))
+		return -1;
+
+	memdump_region_vaddr = memremap(base, size, MEMREMAP_WB);
+	if (memdump_region_vaddr == NULL)
+		return -1;
+
+	memdump_region_base = base;
+	memdump_region_size = size;
+	memdump_region_offset = 0;
+
+	pr_info("Attached the memdump region (base: %pa, size: %zu)\n", &base, size);
+	return 0;
+}
+
+void memdump_detach_region(void)
+{
+	if (memdump_region_vaddr == NULL)
+		return;
+
+	memunmap(memdump_region_vaddr);
+	memdump_region_vaddr = NULL;
+	memdump_region_base = 0;
+	memdump_region_size = 0;
+	memdump_region_offset = 0;
+}
+
+void memdump_panic_dump(int (*time_is_up)(void))
+{
+	nmdbg_fmt_file_t *file_ptr;
+	memdump_stat_t *stat = &memdump_last_stat;
+	unsigned long full_kb;
+
+	if (memdump_page_bitmap == NULL || atomic_xchg(&memdump_taken, 1) != 0)
+		return;
+
+	memset(stat, 0, sizeof(*stat));
+	memdump_region_offset = 0;
+	memdump_time_is_up = time_is_up;
+
+	file_ptr = memdump_reserve(NMDBG_FMT_ALIGN_SIZE(sizeof(*file_ptr)));
+	if (file_ptr != NULL) {
+		file_ptr->magic = NMDBG_FMT_MAGIC;
+		file_ptr->version = NMDBG_FMT_VERSION;
+		file_ptr->flags = 0;
+		file_ptr->tsc_khz = tsc_khz;
+		file_ptr->nr_cpus = num_possible_cpus();
+		file_ptr->hdr_size = NMDBG_FMT_ALIGN_SIZE(sizeof(*file_ptr));
+	}
+
+	memdump_compute_bitmap(stat);
+	memdump_emit_index(stat);
+	memdump_emit_pages();
+
+	if (file_ptr != NULL && !!stat->truncated)
+		file_ptr->flags |= NMDBG_FMT_FILE_TRUNCATED;
+	stat->dump_bytes = memdump_region_offset;
+	if (memdump_region_vaddr != NULL)
+		clflush_cache_range(memdump_region_vaddr, memdump_region_offset);
+
+	/*
+	 * Report the size reduction versus a full dump of all walked pages.
+	 * The page bitmap decides the reduction, so it is meaningful even without a region.
+	 */
+	full_kb = stat->nr_total << (PAGE_SHIFT - 10);
+	pr_info("memdump: %lu/%lu pages kept in %lu ranges (free: %lu, zero: %lu, user: %lu)\n",
+		stat->nr_dumped, stat->nr_total, stat->nr_ranges,
+		stat->nr_free, stat->nr_zero, stat->nr_user);
+	pr_info("memdump: full %lu KiB -> selective %lu KiB (%lu%%), written %zu bytes%s\n",
+		full_kb, stat->nr_dumped << (PAGE_SHIFT - 10),
+		!!stat->nr_total ? (stat->nr_dumped * 100) / stat->nr_total : 0,
+		stat->dump_bytes, !!stat->timed_out ? " (timed out)" : (!!stat->truncated ? " (truncated)" : ""));
+}
+
+void memdump_get_stat(memdump_stat_t *stat)
+{
+	*stat = memdump_last_stat;
+}
\ No newline at end of file
@@ -0,0 +1,103 @@
+/**
+ * @file memdump.h
+ * @brief Prototypes for 'memdump subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'memdump subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_MEMDUMP_H
+#define _NMDBG_MEMDUMP_H
+
+#include <linux/types.h>
+
+#include "define.h"
+#include "format.h"
+
+/**
+ * @brief Statistics of the last selective dump.
+ */
+typedef struct {
+	/** Number of valid pages walked */
+	unsigned long nr_total;
+	/** Number of pages emitted */
+	unsigned long nr_dumped;
+	/** Number of free pages skipped */
+	unsigned long nr_free;
+	/** Number of zero-filled pages skipped */
+	unsigned long nr_zero;
+	/** Number of user pages skipped */
+	unsigned long nr_user;
+	/** Number of contiguous ranges in the page index */
+	unsigned long nr_ranges;
+	/** Number of bytes written to the dump region */
+	size_t dump_bytes;
+	/** Non-zero if the dump region was too small or the dump ran out of time */
+	int truncated;
+	/** Non-zero if the dump ran out of time */
+	int timed_out;
+} memdump_stat_t;
+
+/**
+ * @brief Initialize memdump's member variables.
+ *
+ * The page bitmap must be allocated before a panic, because nothing can be allocated in the panic path.
+ *
+ * @return
+ * 	0 if initialization success.
+ */
+int memdump_member_init(void);
+
+/**
+ * @brief Release memdump's member variables.
+ */
+void memdump_member_exit(void);
+
+/**
+ * @brief Attach a reserved physical memory region as the dump destination.
+ *
+ * The region must be reserved from the kernel (e.g. 'memmap=' boot parameter),
+ * so it survives a warm reboot and can be read back from the next kernel.
+ *
+ * @param base
+ * 	physical base address of the region
+ * @param size
+ * 	size of the region (bytes)
+ * @return
+ * 	0 if the region was attached.
+ */
+int memdump_attach_region(phys_addr_t base, size_t size);
+
+/**
+ * @brief Detach the dump destination.
+ */
+void memdump_detach_region(void);
+
+/**
+ * @brief Take a selective memory dump.
+ *
+ * Free, zero-filled and user pages are excluded by a bitmap computed here,
+ * and only the remaining kernel pages are emitted together with a page index.
+ * If no region is attached, only the statistics are computed.
+ *
+ * This is designed to be called in the panic path, so it never allocates nor sleeps.
+ * Only the first caller takes a dump; concurrent or later callers return immediately.
+ *
+ * @param time_is_up
+ * 	polled while walking and emitting pages; once it returns non-zero,
+ * 	the dump is cut short and marked NMDBG_FMT_FILE_TRUNCATED (NULL for no deadline)
+ */
+void memdump_panic_dump(int (*time_is_up)(void));
+
+/**
+ * @brief Get the statistics of the last selective dump.
+ *
+ * @param stat
+ * 	statistics to be filled
+ */
+void memdump_get_stat(memdump_stat_t *stat);
+
+#endif
\ No newline at end of file
@@ -18,12 +18,21 @@
 #include <linux/list.h>
 #include <linux/rculist.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+#include <linux/hardirq.h>
 #include <asm/nmi.h>
+#include <asm/msr.h>
 
 #include "define.h"
 
 #define NMICTRL_GENERIC_HANDLER_NAME "nmictrl_generic_handler"
 
+/* Maximum time to wait for triggered NMIs at shutdown (microsec) */
+#define NMICTRL_SYNC_TIMEOUT 1000000
+
 /**
  * @brief Internal structure for user-defined handler.
  */
@@ -36,15 +45,96 @@ typedef struct {
 	nmictrl_fn_t handler_fn;
 	/** Handler list */
 	struct list_head handler_list;
-	/** Handler RCU object */
-	struct rcu_head handler_rcu;
+	/** Link of a handler waiting to be freed */
+	struct list_head handler_reclaim;
 } nmictrl_handler_t;
 
 static cpumask_t nmictrl_processor_mask;
 
+static nmictrl_bcast_t nmictrl_bcast_mode = NMICTRL_BCAST_FLAT;
+/* Non-zero if the CPU must re-target the other CPUs of its node */
+static DEFINE_PER_CPU(atomic_t, nmictrl_fanout);
+/* Odd while the CPU runs the generic handler; written only by the owner CPU */
+static DEFINE_PER_CPU(unsigned long, nmictrl_inflight_seq);
+
+/* Bitmap of the builtins prepared on the CPU */
+static DEFINE_PER_CPU(unsigned long, nmictrl_builtin_pending);
+/* Non-zero if a user-registered handler was prepared on the CPU */
+static DEFINE_PER_CPU(atomic_t, nmictrl_dynamic_pending);
+/* Non-zero while the generic handler is registered; builtins need no handler list to be triggered */
+static int nmictrl_builtin_active = 0;
+static DEFINE_PER_CPU(unsigned long, nmictrl_probe_hits);
+/* Non-zero to time the dispatch of every NMI; only benchmarks turn it on */
+static int nmictrl_dispatch_stamp = 0;
+static DEFINE_PER_CPU(u64, nmictrl_dispatch_cycles);
+
 static DEFINE_SPINLOCK(nmictrl_global_write_lock);
 static LIST_HEAD(nmictrl_handler_list);
 
+nmictrl_ret_t __weak nmictrl_builtin_subsys_attach(struct pt_regs *regs)
+{
+	return NMICTRL_ERROR;
+}
+
+nmictrl_ret_t __weak nmictrl_builtin_subsys_detach(struct pt_regs *regs)
+{
+	return NMICTRL_ERROR;
+}
+
+static nmictrl_ret_t nmictrl_builtin_probe(struct pt_regs *regs)
+{
+	this_cpu_inc(nmictrl_probe_hits);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to run a builtin handler.
+ *
+ * The ids are constants, so every case is a direct call;
+ * this avoids the retpoline thunk an indirect call through 'handler_fn' costs.
+ */
+static __always_inline nmictrl_ret_t nmictrl_dispatch_builtin(unsigned int builtin_id, struct pt_regs *regs)
+{
+	switch (builtin_id) {
+	case NMICTRL_BUILTIN_SUBSYS_ATTACH:
+		return nmictrl_builtin_subsys_attach(regs);
+	case NMICTRL_BUILTIN_SUBSYS_DETACH:
+		return nmictrl_builtin_subsys_detach(regs);
+	case NMICTRL_BUILTIN_PROBE:
+		return nmictrl_builtin_probe(regs);
+	default:
+		return NMICTRL_HANDLED;
+	}
+}
+
+/**
+ * @brief Internal function to tell if a trigger may raise IPI signals.
+ */
+static __always_inline int nmictrl_is_armed(void)
+{
+	return !!READ_ONCE(nmictrl_builtin_active) || !list_empty(&nmictrl_handler_list);
+}
+
+/**
+ * @brief Internal function to re-target the other online CPUs of the current node.
+ *
+ * It is called from an NMI, which local_irq_save() does not hold off, so the send must not share state
+ * with a send the interrupted context may be in the middle of.
+ * The mask variants of 'apic->send_IPI_*' build the target mask in a per-cpu scratch mask in x2APIC cluster mode,
+ * and in xAPIC mode even 'apic->send_IPI' writes ICR2 and ICR separately, so a forward landing in between
+ * would re-target the interrupted IPI. Only 'apic->send_IPI' in x2APIC mode is a single 'wrmsr' of the ICR;
+ * this is why NMICTRL_BCAST_TREE requires x2APIC.
+ */
+static void nmictrl_forward_node(void)
+{
+	unsigned int this_cpu = raw_smp_processor_id();
+	unsigned int cpu;
+
+	for_each_cpu_and(cpu, cpumask_of_node(numa_node_id()), cpu_online_mask)
+		if (cpu != this_cpu)
+			apic->send_IPI(cpu, NMI_VECTOR);
+}
+
 /**
  * @brief Internal function to handle generated IPI signal.
  *
@@ -60,12 +150,45 @@ static LIST_HEAD(nmictrl_handler_list);
 static int nmictrl_generic_handler(unsigned int cmd, struct pt_regs *regs)
 {
 	nmictrl_ret_t handler_ret;
-	nmictrl_handler_t *handler_ptr, *handler_nptr;
+	nmictrl_handler_t *handler_ptr;
+	u64 stamp = 0;
+	int ret = NMI_HANDLED;
+
+	this_cpu_inc(nmictrl_inflight_seq);
+	smp_mb();
+
+	/*
+	 * Forward a tree broadcast before running any handler, so the node does not wait for them.
+	 */
+	if (unlikely(!!atomic_read(this_cpu_ptr(&nmictrl_fanout))) &&
+		!!atomic_xchg(this_cpu_ptr(&nmictrl_fanout), 0))
+		nmictrl_forward_node();
 
 	if (cpumask_test_and_clear_cpu(raw_smp_processor_id(), &nmictrl_processor_mask))
 	{
+		unsigned long builtins;
+
+		if (unlikely(!!READ_ONCE(nmictrl_dispatch_stamp)))
+			stamp = rdtsc_ordered();
+		builtins = xchg(this_cpu_ptr(&nmictrl_builtin_pending), 0);
+
+		/* Fast path; builtins prepared before the processor mask are visible here */
+		while (unlikely(!!builtins)) {
+			unsigned int builtin_id = __ffs(builtins);
+
+			builtins &= builtins - 1;
+			if (nmictrl_dispatch_builtin(builtin_id, regs) == NMICTRL_FORWARD) {
+				ret = NMI_DONE;
+				goto out;
+			}
+		}
+
+		/* Slow path; only if a user-registered handler was prepared */
+		if (!atomic_xchg(this_cpu_ptr(&nmictrl_dynamic_pending), 0))
+			goto out;
+
 		rcu_read_lock();
-		list_for_each_entry_rcu(handler_ptr, handler_nptr, &nmictrl_handler_list, handler_list) {
+		list_for_each_entry_rcu(handler_ptr, &nmictrl_handler_list, handler_list) {
 			if (cpumask_test_and_clear_cpu(raw_smp_processor_id(), &handler_ptr->handler_mask)) {
 				nmictrl_fn_t handler_fn;
 
@@ -74,46 +197,84 @@ static int nmictrl_generic_handler(unsigned int cmd, struct pt_regs *regs)
 					break;
 				}
 				if ((handler_ret = handler_fn(regs)) == NMICTRL_FORWARD) {
-					rcu_read_unlock();
-					return NMI_DONE;
+					ret = NMI_DONE;
+					break;
 				}
 			}
 		}
 		rcu_read_unlock();
 	}
-	return NMI_HANDLED;
+
+out:
+	if (unlikely(!!stamp))
+		this_cpu_write(nmictrl_dispatch_cycles, rdtsc_ordered() - stamp);
+	smp_mb();
+	this_cpu_inc(nmictrl_inflight_seq);
+	return ret;
 }
 
 /**
- * @brief Internal function to reclaim an user-registered handler when rcu grace period expired.
+ * @brief Internal function to wait until every CPU left the generic handler it was running.
  *
- * It always passes to 'call_rcu' kernel function; do not call this function directly.
- * @p handler_rcu will automatically be filled by kernel rcu reclaimer callee.
+ * This is a grace period scoped to the NMI control system:
+ * it waits only for NMIs of nmictrl, not for RCU readers and callbacks of the whole kernel.
+ * CPUs entering the generic handler afterwards cannot see handlers unlinked before.
+ * It must not be called from a handler; it would never see its own CPU leave,
+ * and the caller frees what that CPU may still be walking.
+ */
+static void nmictrl_synchronize(void)
+{
+	unsigned int cpu;
+
+	if (WARN_ON_ONCE(in_nmi()))
+		return;
+
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		unsigned long seq = READ_ONCE(per_cpu(nmictrl_inflight_seq, cpu));
+
+		if (!(seq & 1))
+			continue;
+		while (READ_ONCE(per_cpu(nmictrl_inflight_seq, cpu)) == seq)
+			cpu_relax();
+	}
+	smp_mb();
+}
+
+/**
+ * @brief Internal function to free unlinked handlers once no CPU can be running them.
  *
- * @param handler_rcu
- * 	RCU object to resolve user-defined handler
+ * @param reclaim_list
+ * 	handlers linked through 'handler_reclaim'
  */
-static void nmictrl_reclaim_handler(struct rcu_head *handler_rcu)
+static void nmictrl_reclaim_handlers(struct list_head *reclaim_list)
 {
-	nmictrl_handler_t *handler_ptr =
-		container_of(handler_rcu, nmictrl_handler_t, handler_rcu);
+	nmictrl_handler_t *handler_ptr, *handler_nptr;
 
-	pr_info("Successfully unregistered nmi_handler(%p:%s:%p)\n",
-			handler_ptr, handler_ptr->handler_name, handler_ptr->handler_fn);
-	handler_ptr->handler_fn = NULL;
-	kfree(handler_ptr);
+	if (list_empty(reclaim_list))
+		return;
+
+	nmictrl_synchronize();
+	list_for_each_entry_safe(handler_ptr, handler_nptr, reclaim_list, handler_reclaim) {
+		pr_info("Successfully unregistered nmi_handler(%p:%s:%p)\n",
+				handler_ptr, handler_ptr->handler_name, handler_ptr->handler_fn);
+		kfree(handler_ptr);
+	}
 }
 
 /**
- * @brief internal function to flush-out all user-registered handlers.
+ * @brief internal function to unlink all user-registered handlers.
+ *
+ * @param reclaim_list
+ * 	list to collect the unlinked handlers into; pass it to nmictrl_reclaim_handlers() after unlocking
  */
-static void nmictrl_clear_handler_unlocked(void)
+static void nmictrl_clear_handler_unlocked(struct list_head *reclaim_list)
 {
 	nmictrl_handler_t *handler_ptr, *handler_nptr;
 
 	list_for_each_entry_safe(handler_ptr, handler_nptr, &nmictrl_handler_list, handler_list) {
 		list_del_rcu(&handler_ptr->handler_list);
-		call_rcu(&handler_ptr->handler_rcu, nmictrl_reclaim_handler);
+		list_add_tail(&handler_ptr->handler_reclaim, reclaim_list);
 	}
 }
 
@@ -123,6 +284,8 @@ int nmictrl_startup(void)
 
 	spin_lock(&nmictrl_global_write_lock);
 	ret = register_nmi_handler(NMI_LOCAL, nmictrl_generic_handler, 0, NMICTRL_GENERIC_HANDLER_NAME);
+	if (ret == 0)
+		WRITE_ONCE(nmictrl_builtin_active, 1);
 	wmb();
 	spin_unlock(&nmictrl_global_write_lock);
 	return ret;
@@ -130,62 +293,137 @@ int nmictrl_startup(void)
 
 void nmictrl_shutdown(void)
 {
+	LIST_HEAD(reclaim_list);
+	unsigned int cpu;
+
 	spin_lock(&nmictrl_global_write_lock);
-	nmictrl_clear_handler_unlocked();
+	WRITE_ONCE(nmictrl_builtin_active, 0);
+	nmictrl_clear_handler_unlocked(&reclaim_list);
 	/*
 	 * Put memory barrier here to prevent overlapping between cpumask_clear code and new IPI signal.
 	 *
-	 * All 'nmictrl_trigger_*' functions check handler list existence before they raise IPI signal.
-	 * Thus, when all handler list flushed-out, no more IPI signal will generate.
+	 * All 'nmictrl_trigger_*' functions check handler list existence and 'nmictrl_builtin_active'
+	 * before they raise IPI signal.
+	 * Thus, when all handler list flushed-out and builtins deactivated, no more IPI signal will generate.
 	 *
 	 * This memory barrier guaranteeing all handler flushed-out before we clear the cpumask.
 	 */
 	smp_wmb();
 	cpumask_clear(&nmictrl_processor_mask);
-	smp_wmb();
-	unregister_nmi_handler(NMI_LOCAL, NMICTRL_GENERIC_HANDLER_NAME);
-	wmb();
+	for_each_possible_cpu(cpu)
+		per_cpu(nmictrl_builtin_pending, cpu) = 0;
 	spin_unlock(&nmictrl_global_write_lock);
+
+	unregister_nmi_handler(NMI_LOCAL, NMICTRL_GENERIC_HANDLER_NAME);
+	nmictrl_reclaim_handlers(&reclaim_list);
 }
 
 void nmictrl_shutdown_sync(void)
 {
+	unsigned long timeout = NMICTRL_SYNC_TIMEOUT;
+	LIST_HEAD(reclaim_list);
+	unsigned int cpu;
+
 	/*
 	 * Try to trigger all prepared handlers.
 	 */
 	nmictrl_trigger_all();
 	spin_lock(&nmictrl_global_write_lock);
-	nmictrl_clear_handler_unlocked();
-	smp_wmb();
+	WRITE_ONCE(nmictrl_builtin_active, 0);
+	nmictrl_clear_handler_unlocked(&reclaim_list);
+	spin_unlock(&nmictrl_global_write_lock);
+	smp_mb();
 	/*
 	 * NMI-Enter detecting phase.
 	 * If 'nmictrl_processor_mask' is not empty, meaning triggered but not yet handled IPI signal still exist.
 	 * An each bit of 'nmictrl_processor_mask' is cleared when IPI signal handled and entered NMI context.
 	 * To sum up, for detecting that all IPI signals handled, we must observe the cpumask is empty.
 	 */
-	while(!cpumask_empty(&nmictrl_processor_mask))
-		cpu_relax();
+	while (!cpumask_empty(&nmictrl_processor_mask)) {
+		if (!timeout--) {
+			pr_warn("Some triggered NMIs did not arrive (cpus: %*pbl)\n",
+				cpumask_pr_args(&nmictrl_processor_mask));
+			cpumask_clear(&nmictrl_processor_mask);
+			for_each_possible_cpu(cpu)
+				per_cpu(nmictrl_builtin_pending, cpu) = 0;
+			break;
+		}
+		udelay(1);
+	}
 	/*
 	 * NMI-Exit detecting phase.
-	 * 'nmictrl_generic_handler' always return with rcu_read_unlock.
-	 * Therefore, we can determine that other CPUs escaped from NMI context by detecting the RCU grace period.
+	 * Every CPU which entered the generic handler is waited for through its in-flight sequence,
+	 * so neither unrelated RCU readers nor queued RCU callbacks of the rest of the kernel delay us.
 	 */
-	rcu_barrier();
+	nmictrl_reclaim_handlers(&reclaim_list);
 	/*
 	 * No unhandled NMI. Hooray!
 	 */
 	unregister_nmi_handler(NMI_LOCAL, NMICTRL_GENERIC_HANDLER_NAME);
-	wmb();
-	spin_unlock(&nmictrl_global_write_lock);
+}
+
+void nmictrl_set_bcast(nmictrl_bcast_t mode)
+{
+	/* See nmictrl_forward_node() */
+	if (mode == NMICTRL_BCAST_TREE && !x2apic_enabled()) {
+		pr_info("Tree broadcasts need x2APIC; falling back to flat broadcasts\n");
+		mode = NMICTRL_BCAST_FLAT;
+	}
+	WRITE_ONCE(nmictrl_bcast_mode, mode);
+}
+
+nmictrl_bcast_t nmictrl_get_bcast(void)
+{
+	return READ_ONCE(nmictrl_bcast_mode);
+}
+
+/**
+ * @brief Internal function to broadcast through one leader CPU per NUMA node.
+ *
+ * The triggering CPU leads its own node.
+ * The leader of a remote node is its first online CPU; the hotplug lock is not needed,
+ * because an offline leader only loses its node the same way a flat broadcast would.
+ * Leaders are sent one by one rather than through a mask, which would not fit on the stack with a large NR_CPUS;
+ * in x2APIC mode, which this mode requires, a mask send costs a 'wrmsr' per CPU or per cluster anyway.
+ *
+ * @param include_self
+ * 	non-zero to trigger the current CPU as well
+ */
+static void nmictrl_send_tree(int include_self)
+{
+	unsigned int this_cpu, leader;
+	int this_node, node;
+
+	this_cpu = get_cpu();
+	this_node = cpu_to_node(this_cpu);
+
+	for_each_online_node(node) {
+		if (node == this_node)
+			continue;
+		leader = cpumask_first_and(cpumask_of_node(node), cpu_online_mask);
+		if (leader >= nr_cpu_ids)
+			continue;
+		atomic_inc(&per_cpu(nmictrl_fanout, leader));
+		smp_mb__after_atomic();
+		apic->send_IPI(leader, NMI_VECTOR);
+	}
+
+	nmictrl_forward_node();
+	if (!!include_self)
+		apic->send_IPI_self(NMI_VECTOR);
+	put_cpu();
 }
 
 void nmictrl_trigger_all(void)
 {
 	rcu_read_lock();
-	if (!list_empty(&nmictrl_handler_list))
+	if (nmictrl_is_armed())
 	{
 		rcu_read_unlock();
-		apic->send_IPI_all(NMI_VECTOR);
+		if (READ_ONCE(nmictrl_bcast_mode) == NMICTRL_BCAST_TREE)
+			nmictrl_send_tree(1);
+		else
+			apic->send_IPI_all(NMI_VECTOR);
 		goto skip_unlock;
 	}
 	rcu_read_unlock();
@@ -195,7 +433,7 @@ skip_unlock:;
 void nmictrl_trigger_self(void)
 {
 	rcu_read_lock();
-	if (!list_empty(&nmictrl_handler_list))
+	if (nmictrl_is_armed())
 	{
 		rcu_read_unlock();
 		apic->send_IPI_self(NMI_VECTOR);
@@ -208,10 +446,13 @@ skip_unlock:;
 void nmictrl_trigger_others(void)
 {
 	rcu_read_lock();
-	if (!list_empty(&nmictrl_handler_list))
+	if (nmictrl_is_armed())
 	{
 		rcu_read_unlock();
-		apic->send_IPI_allbutself(NMI_VECTOR);
+		if (READ_ONCE(nmictrl_bcast_mode) == NMICTRL_BCAST_TREE)
+			nmictrl_send_tree(0);
+		else
+			apic->send_IPI_allbutself(NMI_VECTOR);
 		goto skip_unlock;
 	}
 	rcu_read_unlock();
@@ -221,7 +462,7 @@ skip_unlock:;
 void nmictrl_trigger_cpu(unsigned int cpu_id)
 {
 	rcu_read_lock();
-	if (!list_empty(&nmictrl_handler_list))
+	if (nmictrl_is_armed())
 	{
 		cpumask_t local_mask;
 
@@ -235,6 +476,19 @@ void nmictrl_trigger_cpu(unsigned int cpu_id)
 skip_unlock:;
 }
 
+void nmictrl_trigger_mask(const struct cpumask *cpu_mask)
+{
+	rcu_read_lock();
+	if (nmictrl_is_armed() && !cpumask_empty(cpu_mask))
+	{
+		rcu_read_unlock();
+		apic->send_IPI_mask(cpu_mask, NMI_VECTOR);
+		goto skip_unlock;
+	}
+	rcu_read_unlock();
+skip_unlock:;
+}
+
 int nmictrl_add_handler(const char *handler_name, nmictrl_fn_t handler_fn)
 {
 	nmictrl_handler_t *handler_ptr;
@@ -283,38 +537,72 @@ error:
 void nmictrl_del_handler(const char *handler_name)
 {
 	nmictrl_handler_t *handler_ptr;
+	LIST_HEAD(reclaim_list);
 
 	spin_lock(&nmictrl_global_write_lock);
 	list_for_each_entry(handler_ptr, &nmictrl_handler_list, handler_list) {
 		if (strncmp(handler_ptr->handler_name, handler_name, NMICTRL_HANDLER_NAMESZ) == 0) {
 			list_del_rcu(&handler_ptr->handler_list);
-			smp_wmb();
-			call_rcu(&handler_ptr->handler_rcu, nmictrl_reclaim_handler);
+			list_add_tail(&handler_ptr->handler_reclaim, &reclaim_list);
+			break;
 		}
 	}
 	spin_unlock(&nmictrl_global_write_lock);
+	nmictrl_reclaim_handlers(&reclaim_list);
 }
 
 void nmictrl_clear_handler(void)
 {
+	LIST_HEAD(reclaim_list);
+
 	spin_lock(&nmictrl_global_write_lock);
-	nmictrl_clear_handler_unlocked();
+	nmictrl_clear_handler_unlocked(&reclaim_list);
 	spin_unlock(&nmictrl_global_write_lock);
+	nmictrl_reclaim_handlers(&reclaim_list);
 }
 
-void nmictrl_prepare_handler(const char *handler_name, unsigned int cpu_id)
+int nmictrl_prepare_handler(const char *handler_name, unsigned int cpu_id)
 {
 	nmictrl_handler_t *handler_ptr;
+	int ret = -1;
 
 	rcu_read_lock();
 	list_for_each_entry_rcu(handler_ptr, &nmictrl_handler_list, handler_list) {
 		if (strncmp(handler_ptr->handler_name, handler_name, NMICTRL_HANDLER_NAMESZ) == 0) {
 			if (!cpumask_test_and_set_cpu(cpu_id, &handler_ptr->handler_mask)) {
+				atomic_set(&per_cpu(nmictrl_dynamic_pending, cpu_id), 1);
 				smp_wmb();
 				cpumask_set_cpu(cpu_id, &nmictrl_processor_mask);
-				break;
 			}
+			ret = 0;
+			break;
 		}
 	}
 	rcu_read_unlock();
+	return ret;
+}
+
+void nmictrl_prepare_builtin(nmictrl_builtin_t builtin_id, unsigned int cpu_id)
+{
+	if (builtin_id >= NMICTRL_NR_BUILTINS || cpu_id >= nr_cpu_ids)
+		return;
+
+	set_bit(builtin_id, per_cpu_ptr(&nmictrl_builtin_pending, cpu_id));
+	smp_mb__after_atomic();
+	cpumask_set_cpu(cpu_id, &nmictrl_processor_mask);
+}
+
+unsigned long nmictrl_get_probe_hits(unsigned int cpu_id)
+{
+	return READ_ONCE(per_cpu(nmictrl_probe_hits, cpu_id));
+}
+
+void nmictrl_set_dispatch_stamp(int enable)
+{
+	WRITE_ONCE(nmictrl_dispatch_stamp, !!enable);
+}
+
+u64 nmictrl_get_dispatch_cycles(unsigned int cpu_id)
+{
+	return READ_ONCE(per_cpu(nmictrl_dispatch_cycles, cpu_id));
 }
\ No newline at end of file
@@ -29,11 +29,48 @@ typedef enum {
 	NMICTRL_FORWARD,
 } nmictrl_ret_t;
 
+/**
+ * @brief Broadcast modes of nmictrl_trigger_all() and nmictrl_trigger_others().
+ */
+typedef enum {
+	/** A single broadcast IPI from the triggering CPU */
+	NMICTRL_BCAST_FLAT = 0,
+	/**
+	 * The triggering CPU NMIs one leader CPU per remote NUMA node and its own node directly;
+	 * each leader re-targets the other CPUs of its node from its NMI
+	 */
+	NMICTRL_BCAST_TREE,
+} nmictrl_bcast_t;
+
+/**
+ * @brief Handlers known at build time.
+ *
+ * They are dispatched by direct calls ahead of the registered handlers,
+ * without the list walk nor an indirect call. They cannot be registered nor unregistered.
+ */
+typedef enum {
+	/** Attach the subsystems of the core module (core.c) */
+	NMICTRL_BUILTIN_SUBSYS_ATTACH = 0,
+	/** Detach the subsystems of the core module (core.c) */
+	NMICTRL_BUILTIN_SUBSYS_DETACH,
+	/** Count the NMI on the current CPU; see nmictrl_get_probe_hits() */
+	NMICTRL_BUILTIN_PROBE,
+	NMICTRL_NR_BUILTINS,
+} nmictrl_builtin_t;
+
 /**
  * @brief User-defined handler function type.
  */
 typedef nmictrl_ret_t (*nmictrl_fn_t)(struct pt_regs *);
 
+/**
+ * @brief Builtin handlers owned by a module.
+ *
+ * The module which builds them in defines them; the others get fallbacks returning NMICTRL_ERROR.
+ */
+nmictrl_ret_t nmictrl_builtin_subsys_attach(struct pt_regs *regs);
+nmictrl_ret_t nmictrl_builtin_subsys_detach(struct pt_regs *regs);
+
 /**
  * @brief Activate the NMI control system.
  * @return
@@ -48,9 +85,30 @@ void nmictrl_shutdown(void);
 
 /**
  * @brief Deactivate NMI control system and wait for triggered IPI signals to finish.
+ *
+ * Only NMIs of the NMI control system are waited for; RCU callbacks of the rest of the kernel are not.
  */
 void nmictrl_shutdown_sync(void);
 
+/**
+ * @brief Select how nmictrl_trigger_all() and nmictrl_trigger_others() reach the CPUs.
+ *
+ * In NMICTRL_BCAST_TREE mode, a leader busy in a long NMI delays its whole node.
+ * NMICTRL_BCAST_TREE needs x2APIC; without it, NMICTRL_BCAST_FLAT is selected instead.
+ *
+ * @param mode
+ * 	one of nmictrl_bcast_t
+ */
+void nmictrl_set_bcast(nmictrl_bcast_t mode);
+
+/**
+ * @brief Get the current broadcast mode.
+ *
+ * @return
+ * 	one of nmictrl_bcast_t
+ */
+nmictrl_bcast_t nmictrl_get_bcast(void);
+
 /**
  * @brief Send IPI signals to entire CPUs.
  */
@@ -71,6 +129,14 @@ void nmictrl_trigger_others(void);
  */
 void nmictrl_trigger_cpu(unsigned int cpu_id);
 
+/**
+ * @brief Send IPI signals to a set of CPUs at once.
+ *
+ * @param cpu_mask
+ * 	The CPUs to be triggered
+ */
+void nmictrl_trigger_mask(const struct cpumask *cpu_mask);
+
 /**
  * @brief Register an user-defined handler.
  *
@@ -87,6 +153,10 @@ int nmictrl_add_handler(const char *handler_name, nmictrl_fn_t nmi_handler);
 
 /**
  * @brief Unregister an user-defined handler.
+ *
+ * When it returns, no CPU is running the handler anymore.
+ * It never sleeps, but it spins while another CPU is inside an NMI of the NMI control system.
+ *
  * @param handler_name
  * 	The handler name to be unregistered
  */
@@ -94,6 +164,8 @@ void nmictrl_del_handler(const char *handler_name);
 
 /**
  * @brief Unregister all user-defined handlers.
+ *
+ * When it returns, no CPU is running any of them anymore.
  */
 void nmictrl_clear_handler(void);
 
@@ -107,6 +179,52 @@ void nmictrl_clear_handler(void);
  * 	The handler name to be prepared
  * @param cpu_id
  * 	The cpu id that handler will be triggered on
+ * @return
+ * 	0 if the handler is registered (it may already have been prepared on the CPU).
+ */
+int nmictrl_prepare_handler(const char *handler_name, unsigned int cpu_id);
+
+/**
+ * @brief Prepare a builtin handler.
+ *
+ * Prepared builtins run before the user-registered handlers, in the order of their ids.
+ * An NMI which has only builtins to run skips the handler list entirely.
+ *
+ * @param builtin_id
+ * 	The builtin to be prepared
+ * @param cpu_id
+ * 	The cpu id that handler will be triggered on
+ */
+void nmictrl_prepare_builtin(nmictrl_builtin_t builtin_id, unsigned int cpu_id);
+
+/**
+ * @brief Get the number of NMICTRL_BUILTIN_PROBE runs on a CPU.
+ *
+ * @param cpu_id
+ * 	The cpu id to be read
+ * @return
+ * 	runs since the module was loaded
+ */
+unsigned long nmictrl_get_probe_hits(unsigned int cpu_id);
+
+/**
+ * @brief Turn the timing of the dispatch on or off.
+ *
+ * While it is on, the generic handler stamps the TSC around the builtins and the handler list walk
+ * of every NMI it has something to run for; it costs two serialized TSC reads per NMI.
+ *
+ * @param enable
+ * 	non-zero to time the dispatch
+ */
+void nmictrl_set_dispatch_stamp(int enable);
+
+/**
+ * @brief Get the cycles the last timed dispatch took on a CPU.
+ *
+ * @param cpu_id
+ * 	The cpu id to be read
+ * @return
+ * 	cycles from the entry of the dispatch until every prepared handler returned
  */
-void nmictrl_prepare_handler(const char *handler_name, unsigned int cpu_id);
+u64 nmictrl_get_dispatch_cycles(unsigned int cpu_id);
 #endif
\ No newline at end of file
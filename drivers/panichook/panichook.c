@@ -14,22 +14,34 @@
 #include <linux/uaccess.h>
 #include <asm/processor.h>
 #include <linux/delay.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <asm/tsc.h>
 
 #include "define.h"
 
 /**
- * @brief Internal structure for user-defined handler.
+ * @brief Internal structure for a panic callback.
  */
 typedef struct {
-	/** Handler name */
-	char handler_name[PANICHOOK_HANDLER_NAMESZ];
-	/** Handler function */
-	nmictrl_fn_t handler_fn;
-	/** Handler list */
-	struct list_head handler_list;
-	/** Handler RCU object */
-	struct rcu_head handler_rcu;
-} nmictrl_handler_t;
+	/** Callback name */
+	char callback_name[PANICHOOK_HANDLER_NAMESZ];
+	/** Callback function */
+	panichook_fn_t callback_fn;
+	/** Callbacks of higher priority run first */
+	int priority;
+	/** Cycles the callback may take */
+	u64 budget;
+	/** Callback list */
+	struct list_head callback_list;
+	/** Callback RCU object */
+	struct rcu_head callback_rcu;
+} panichook_callback_t;
 
 typedef void (*panichook_fentry_kfn_t)(void);
 typedef void (*panichook_panic_kfn_t)(const u8 *fmt, ...);
@@ -49,6 +61,16 @@ static u8 panichook_opcodes_panic[5] = {0x00, };
 static int panichook_modified_oops = 0;
 static u8 panichook_opcodes_oops[5] = {0x00, };
 
+static DEFINE_SPINLOCK(panichook_callback_write_lock);
+static LIST_HEAD(panichook_callback_list);
+
+/* Cycles the whole callback chain may take */
+static u64 panichook_window = 0;
+/* Deadline of the running callback */
+static u64 panichook_deadline = 0;
+/* Only the first CPU entering the hook runs the callbacks */
+static atomic_t panichook_running = ATOMIC_INIT(0);
+
 /**
  * @brief Internal function to lookup the address of kernel function.
  */
@@ -127,12 +149,72 @@ static int panichook_test_kfn_hookable(void *kfn)
 	return -1;
 }
 
+/**
+ * @brief Internal function to convert microseconds into TSC cycles.
+ */
+static __always_inline u64 panichook_us_to_cycles(unsigned long us)
+{
+	return div_u64((u64)us * tsc_khz, USEC_PER_MSEC);
+}
+
+/**
+ * @brief Internal function to run the callback chain within a window.
+ *
+ * The chain is walked without taking any lock, so a CPU which panicked while holding the write lock cannot block it.
+ * A callback whose budget does not fit in what is left of the window is skipped.
+ * Callbacks poll the deadline test to stop at the end of their budget;
+ * an overrun past it is reported and shrinks the window of the callbacks after it.
+ *
+ * @param window
+ * 	cycles the whole chain may take
+ * @return
+ * 	the number of callbacks run.
+ */
+static int panichook_run_window(u64 window)
+{
+	panichook_callback_t *callback_ptr;
+	u64 end = rdtsc() + window;
+	int nr_run = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(callback_ptr, &panichook_callback_list, callback_list) {
+		u64 begin = rdtsc(), spent;
+		s64 left = (s64)(end - begin);
+
+		if (left < (s64)callback_ptr->budget) {
+			pr_info("Skipped panic callback %s (budget: %llu, left: %lld cycles)\n",
+				callback_ptr->callback_name, callback_ptr->budget, left);
+			continue;
+		}
+
+		WRITE_ONCE(panichook_deadline, begin + callback_ptr->budget);
+		callback_ptr->callback_fn(&panichook_time_is_up);
+		nr_run++;
+		spent = rdtsc() - begin;
+		if (spent > callback_ptr->budget)
+			pr_info("Panic callback %s overran its budget (%llu/%llu cycles)\n",
+				callback_ptr->callback_name, spent, callback_ptr->budget);
+	}
+	rcu_read_unlock();
+	return nr_run;
+}
+
+/**
+ * @brief Internal function to run the callback chain from the panic path.
+ */
+static void panichook_run_callbacks(void)
+{
+	(void) panichook_run_window(READ_ONCE(panichook_window));
+}
+
 /**
  * @brief Internal function to handle a kernel panic.
  */
 static void panichook_generic_handler(void)
 {
 	pr_info("PANIC_HANDLED!!!!!!!!!!!!!!!!!!\n");
+	if (atomic_cmpxchg(&panichook_running, 0, 1) == 0)
+		panichook_run_callbacks();
 	while (1)
 		cpu_relax();
 }
@@ -248,6 +330,90 @@ void panichook_member_init(void)
 	panichook_fentry_kfn = panichook_resolve_kfn_symbol("__fentry__");
 	panichook_panic_kfn = panichook_resolve_kfn_symbol("panic");
 	panichook_oops_kfn = panichook_resolve_kfn_symbol("oops_enter");
+	panichook_set_window(PANICHOOK_DEFAULT_WINDOW_US);
+}
+
+void panichook_set_window(unsigned long window_us)
+{
+	WRITE_ONCE(panichook_window, panichook_us_to_cycles(window_us));
+}
+
+int panichook_run_chain(unsigned long window_us)
+{
+	return panichook_run_window(panichook_us_to_cycles(window_us));
+}
+
+int panichook_time_is_up(void)
+{
+	return (s64)(rdtsc() - READ_ONCE(panichook_deadline)) >= 0;
+}
+
+int panichook_add_callback(const char *callback_name, panichook_fn_t callback_fn,
+	int priority, unsigned long budget_us)
+{
+	panichook_callback_t *callback_ptr, *pos_ptr;
+	struct list_head *next = &panichook_callback_list;
+
+	if (callback_name == NULL || callback_fn == NULL ||
+		strlen(callback_name) >= PANICHOOK_HANDLER_NAMESZ)
+		goto err;
+
+	callback_ptr = kzalloc(sizeof(*callback_ptr), GFP_KERNEL);
+	if (callback_ptr == NULL)
+		goto err;
+	strlcpy(callback_ptr->callback_name, callback_name, PANICHOOK_HANDLER_NAMESZ);
+	callback_ptr->callback_fn = callback_fn;
+	callback_ptr->priority = priority;
+	callback_ptr->budget = panichook_us_to_cycles(budget_us);
+
+	spin_lock(&panichook_callback_write_lock);
+	list_for_each_entry(pos_ptr, &panichook_callback_list, callback_list) {
+		if (strncmp(pos_ptr->callback_name, callback_name, PANICHOOK_HANDLER_NAMESZ) == 0)
+			goto err_unlock;
+		/* Callbacks of the same priority run in registration order */
+		if (next == &panichook_callback_list && pos_ptr->priority < priority)
+			next = &pos_ptr->callback_list;
+	}
+	list_add_tail_rcu(&callback_ptr->callback_list, next);
+	spin_unlock(&panichook_callback_write_lock);
+
+	pr_info("Registered panic callback %s (priority: %d, budget: %llu cycles)\n",
+		callback_name, priority, callback_ptr->budget);
+	return 0;
+
+err_unlock:
+	spin_unlock(&panichook_callback_write_lock);
+	kfree(callback_ptr);
+err:
+	pr_warn("Failed to register panic callback %s\n", !!callback_name ? callback_name : "NULL");
+	return -1;
+}
+
+void panichook_del_callback(const char *callback_name)
+{
+	panichook_callback_t *callback_ptr;
+
+	spin_lock(&panichook_callback_write_lock);
+	list_for_each_entry(callback_ptr, &panichook_callback_list, callback_list) {
+		if (strncmp(callback_ptr->callback_name, callback_name, PANICHOOK_HANDLER_NAMESZ) == 0) {
+			list_del_rcu(&callback_ptr->callback_list);
+			kfree_rcu(callback_ptr, callback_rcu);
+			break;
+		}
+	}
+	spin_unlock(&panichook_callback_write_lock);
+}
+
+void panichook_clear_callback(void)
+{
+	panichook_callback_t *callback_ptr, *callback_nptr;
+
+	spin_lock(&panichook_callback_write_lock);
+	list_for_each_entry_safe(callback_ptr, callback_nptr, &panichook_callback_list, callback_list) {
+		list_del_rcu(&callback_ptr->callback_list);
+		kfree_rcu(callback_ptr, callback_rcu);
+	}
+	spin_unlock(&panichook_callback_write_lock);
 }
 
 nmictrl_ret_t panichook_attach_nmifn(struct pt_regs *regs)
@@ -269,12 +435,12 @@ nmictrl_ret_t panichook_attach_nmifn(struct pt_regs *regs)
 	if (!!panichook_modify_kfn_oops(panichook_oops_kfn))
 		goto err_on_oops;
 
-err:
 	return NMICTRL_HANDLED;
 
 err_on_oops:
 	panichook_recover_kfn_panic(panichook_panic_kfn);
-	goto err;
+err:
+	return NMICTRL_ERROR;
 }
 
 nmictrl_ret_t panichook_detach_nmifn(struct pt_regs *regs)
@@ -289,31 +455,4 @@ nmictrl_ret_t panichook_detach_nmifn(struct pt_regs *regs)
 
 err:
 	return NMICTRL_HANDLED;
-}
-
-int panichook_sync_attach(unsigned long timeout)
-{
-	while(!!(timeout--) &&
-		(!panichook_modified_panic ||
-			!panichook_modified_oops))
-		udelay(1);
-	if (!timeout)
-		return -1;
-
-	pr_info("Attached the panichook subsystem successfully (panic: %p, oops: %p, generic: %p)\n",
-		panichook_panic_kfn, panichook_oops_kfn, &panichook_generic_handler);
-	return 0;
-}
-
-int panichook_sync_detach(unsigned long timeout)
-{
-	while(!!(timeout--) &&
-		(!!panichook_modified_panic ||
-			!!panichook_modified_oops))
-		udelay(1);
-	if (!timeout)
-		return -1;
-	pr_info("Detached the panichook subsystem successfully (panic: %p, oops: %p, generic: %p)\n",
-		panichook_panic_kfn, panichook_oops_kfn, &panichook_generic_handler);
-	return 0;
 }
\ No newline at end of file
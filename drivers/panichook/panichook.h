@@ -12,14 +12,30 @@
 #ifndef _NMDBG_PANICHOOK_H
 #define _NMDBG_PANICHOOK_H
 
+#include <linux/time64.h>
+
 #include "nmictrl.h"
 
 #define PANICHOOK_HANDLER_NAMESZ 32
 
+/* Time the whole callback chain may take; keep it below the hardware watchdog timeout */
+#define PANICHOOK_DEFAULT_WINDOW_US (30 * USEC_PER_SEC)
+
+/**
+ * @brief Deadline test passed to panic callbacks.
+ *
+ * It returns non-zero once the running callback used up its budget.
+ */
+typedef int (*panichook_time_fn_t)(void);
+
 /**
- * @brief User-defined handler function type.
+ * @brief Panic callback function type.
+ *
+ * It runs in the panic path before the panicked CPU halts; it must not sleep nor allocate.
+ * Long-running callbacks must poll the deadline test they are given and stop early once it fires,
+ * so the callbacks after them still fit in the window.
  */
-typedef void (*panichook_fn_t)(void);
+typedef void (*panichook_fn_t)(panichook_time_fn_t time_is_up);
 
 /**
  * @brief Initialize panichook's member variables.
@@ -30,47 +46,96 @@ typedef void (*panichook_fn_t)(void);
 void panichook_member_init(void);
 
 /**
- * @brief Activate the panichook subsys.
+ * @brief Set the time the whole callback chain may take.
  *
- * This function activates the panichook subsys by attaching to the nmictrl coresys.
+ * @param window_us
+ * 	window (microsec)
+ */
+void panichook_set_window(unsigned long window_us);
+
+/**
+ * @brief Register a callback to be run when a kernel panic is hooked.
  *
- * @param regs
- *	Unused (nmictrl reserve)
+ * Callbacks run in the order of priority, highest first, on the first CPU entering the hook.
+ * A callback is skipped if its budget does not fit in what is left of the window.
+ * Registration is RCU-protected; the panic path walks the chain without locking.
+ *
+ * @param callback_name
+ * 	unique name of the callback
+ * @param callback_fn
+ * 	function to be called
+ * @param priority
+ * 	callbacks of higher priority run first
+ * @param budget_us
+ * 	time the callback may take (microsec)
  * @return
- *	NMICTRL_HANDLED (always)
+ * 	0 if registration success.
  */
-nmictrl_ret_t panichook_attach_nmifn(struct pt_regs *regs);
+int panichook_add_callback(const char *callback_name, panichook_fn_t callback_fn,
+	int priority, unsigned long budget_us);
 
 /**
- * @brief Deactivate the panichook subsys.
+ * @brief Unregister a callback.
  *
- * This function deactivates the panichook subsys by detaching from the nmictrl coresys.
+ * The callback may still run until the next RCU grace period.
  *
- * @param regs
- *	Unused (nmictrl reserve)
+ * @param callback_name
+ * 	name of the callback
+ */
+void panichook_del_callback(const char *callback_name);
+
+/**
+ * @brief Unregister all callbacks.
+ */
+void panichook_clear_callback(void);
+
+/**
+ * @brief Run the callback chain once, the way the panic path runs it.
+ *
+ * It does not panic nor halt; it lets the chain be tested from process context.
+ * It must not run concurrently with itself nor with a panic.
+ *
+ * @param window_us
+ * 	time the whole chain may take (microsec)
  * @return
- *	NMICTRL_HANDLED (always)
+ * 	the number of callbacks run.
  */
-nmictrl_ret_t panichook_detach_nmifn(struct pt_regs *regs);
+int panichook_run_chain(unsigned long window_us);
 
 /**
- * @brief Make sure the panichook subsys was successfully activated.
+ * @brief Test if the running callback used up its budget.
+ *
+ * This is the deadline test passed to the callbacks.
  *
- * @params timeout
- * 	syncing timeout (microsec)
  * @return
- * 	0 if subsys was activated.
+ * 	non-zero if the budget is used up.
  */
-int panichook_sync_attach(unsigned long timeout);
+int panichook_time_is_up(void);
 
 /**
- * @brief Make sure the panichook subsys was successfully deactivated.
+ * @brief Activate the panichook subsys.
+ *
+ * This function activates the panichook subsys by patching 'panic()' and 'oops_enter()'.
+ * It must run in an NMI of the nmictrl coresys; both sites are patched, or none.
  *
- * @params timeout
- * 	syncing timeout (microsec)
+ * @param regs
+ *	Unused (nmictrl reserve)
  * @return
- * 	0 if subsys was deactivated.
+ *	NMICTRL_HANDLED if activated, NMICTRL_ERROR if not.
  */
-int panichook_sync_detach(unsigned long timeout);
+nmictrl_ret_t panichook_attach_nmifn(struct pt_regs *regs);
+
+/**
+ * @brief Deactivate the panichook subsys.
+ *
+ * This function deactivates the panichook subsys by restoring the patched sites.
+ * It must run in an NMI of the nmictrl coresys.
+ *
+ * @param regs
+ *	Unused (nmictrl reserve)
+ * @return
+ *	NMICTRL_HANDLED (always)
+ */
+nmictrl_ret_t panichook_detach_nmifn(struct pt_regs *regs);
 
 #endif
\ No newline at end of file
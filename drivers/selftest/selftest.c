@@ -2,16 +2,36 @@
 #include <linux/module.h>
 
 #include "selftest_nmictrl.h"
+#include "selftest_watch.h"
+#include "selftest_fhook.h"
+#include "selftest_panichook.h"
+#include "selftest_textscan.h"
+#include "selftest_stress.h"
+
+static unsigned int selftest_stress_ms = SELFTEST_STRESS_DEFAULT_MS;
+module_param(selftest_stress_ms, uint, 0444);
+MODULE_PARM_DESC(selftest_stress_ms, "Duration of each CPU count of the registration and trigger stress test (millisec, 0 to skip)");
 
 static int __init selftest_nmdbg_init(void)
 {
 	KTX_RUN(selftest_nmictrl);
+	KTX_RUN(selftest_watch);
+	KTX_RUN(selftest_fhook);
+	KTX_RUN(selftest_panichook);
+	KTX_RUN(selftest_textscan);
+	selftest_stress_set_duration(selftest_stress_ms);
+	KTX_RUN(selftest_stress);
 	return 0;
 }
 
 static void __exit selftest_nmdbg_exit(void)
 {
 	KTX_REPORT(selftest_nmictrl);
+	KTX_REPORT(selftest_watch);
+	KTX_REPORT(selftest_fhook);
+	KTX_REPORT(selftest_panichook);
+	KTX_REPORT(selftest_textscan);
+	KTX_REPORT(selftest_stress);
 	return;
 }
 
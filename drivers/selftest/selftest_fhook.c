@@ -0,0 +1,59 @@
+#include "selftest_fhook.h"
+
+#include <linux/kernel.h>
+
+#include "tracering.h"
+#include "fhook.h"
+
+/* Exported, traceable, side-effect free, and hardly called by anyone else */
+#define SELFTEST_FHOOK_TARGET "kstrtobool"
+#define SELFTEST_FHOOK_CALLS 1000
+
+static noinline void selftest_fhook_call(unsigned int calls)
+{
+	unsigned int i;
+	bool res;
+
+	for (i = 0; i < calls; i++)
+		(void) kstrtobool("1", &res);
+}
+
+KTX_DEFINE(selftest_fhook)
+{
+	fhook_stat_t stat;
+	u64 nr_hits;
+	int id;
+
+	KTX_REQUIRE(selftest_fhook, tracering_startup(TRACERING_DEFAULT_SIZE, NULL), 0);
+	KTX_REQUIRE(selftest_fhook, fhook_startup(NULL), 0);
+
+	id = fhook_add(SELFTEST_FHOOK_TARGET, 0);
+	KTX_REQUIRE(selftest_fhook, id >= 0, 1);
+	KTX_CHECK(selftest_fhook, fhook_find(SELFTEST_FHOOK_TARGET), id);
+	/* A function is probed once */
+	KTX_CHECK(selftest_fhook, fhook_add(SELFTEST_FHOOK_TARGET, 0), -1);
+
+	/* Every call must be counted; others may call it too, but nobody can take hits away */
+	selftest_fhook_call(SELFTEST_FHOOK_CALLS);
+	KTX_CHECK(selftest_fhook, fhook_get_stat(id, &stat), 0);
+	KTX_CHECK(selftest_fhook, stat.nr_hits >= SELFTEST_FHOOK_CALLS, 1);
+	KTX_CHECK(selftest_fhook, stat.sample, 0);
+	nr_hits = stat.nr_hits;
+
+	/* The sampling slow path must count the same way */
+	KTX_CHECK(selftest_fhook, fhook_set_sample(id, 1), 0);
+	selftest_fhook_call(SELFTEST_FHOOK_CALLS);
+	KTX_CHECK(selftest_fhook, fhook_get_stat(id, &stat), 0);
+	KTX_CHECK(selftest_fhook, stat.nr_hits >= nr_hits + SELFTEST_FHOOK_CALLS, 1);
+
+	/* Removed probes are gone */
+	KTX_CHECK(selftest_fhook, fhook_del(id), 0);
+	KTX_CHECK(selftest_fhook, fhook_get_stat(id, &stat), -1);
+	KTX_CHECK(selftest_fhook, fhook_find(SELFTEST_FHOOK_TARGET), -1);
+
+	/* Module text is rejected */
+	KTX_CHECK(selftest_fhook, fhook_add("selftest_fhook_call", 0), -1);
+
+	fhook_shutdown();
+	tracering_shutdown();
+}
\ No newline at end of file
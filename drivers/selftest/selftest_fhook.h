@@ -0,0 +1,8 @@
+#ifndef _NMIDBG_SELFTEST_FHOOK_H
+#define _NMIDBG_SELFTEST_FHOOK_H
+
+#include "selftest.h"
+
+KTX_DECLARE(selftest_fhook);
+
+#endif
\ No newline at end of file
@@ -26,6 +26,13 @@ static nmictrl_ret_t selftest_nmictrl_another_testfn(struct pt_regs *regs)
 	return NMICTRL_HANDLED;
 }
 
+static int selftest_nmictrl_mask_flag = 0;
+static nmictrl_ret_t selftest_nmictrl_mask_testfn(struct pt_regs *regs)
+{
+	selftest_nmictrl_mask_flag = 1;
+	return NMICTRL_HANDLED;
+}
+
 static nmictrl_ret_t selftest_nmictrl_shutdown_testfn(struct pt_regs *regs)
 {
 	return NMICTRL_HANDLED;
@@ -37,6 +44,7 @@ KTX_DEFINE(selftest_nmictrl)
 	KTX_REQUIRE(selftest_nmictrl, nmictrl_add_handler("selftest_nmictrl_self", &selftest_nmictrl_self_testfn), 0);
 	KTX_REQUIRE(selftest_nmictrl, nmictrl_add_handler("selftest_nmictrl_all", &selftest_nmictrl_all_testfn), 0);
 	KTX_REQUIRE(selftest_nmictrl, nmictrl_add_handler("selftest_nmictrl_another", &selftest_nmictrl_another_testfn), 0);
+	KTX_REQUIRE(selftest_nmictrl, nmictrl_add_handler("selftest_nmictrl_mask", &selftest_nmictrl_mask_testfn), 0);
 	KTX_REQUIRE(selftest_nmictrl, nmictrl_add_handler("selftest_nmictrl_shutdown", &selftest_nmictrl_shutdown_testfn), 0);
 
 	nmictrl_prepare_handler("selftest_nmictrl_self", smp_processor_id());
@@ -51,6 +59,8 @@ KTX_DEFINE(selftest_nmictrl)
 		nmictrl_prepare_handler("selftest_nmictrl_another", processor_id);
 		nmictrl_trigger_others();
 	}
+	nmictrl_prepare_handler("selftest_nmictrl_mask", smp_processor_id());
+	nmictrl_trigger_mask(cpumask_of(smp_processor_id()));
 	/* Wait for triggering IPI signals */
 	mdelay(1);
 
@@ -58,10 +68,12 @@ KTX_DEFINE(selftest_nmictrl)
 	KTX_CHECK(selftest_nmictrl, selftest_nmictrl_self_flag, 1);
 	KTX_CHECK(selftest_nmictrl, selftest_nmictrl_all_flag, 1);
 	KTX_CHECK(selftest_nmictrl, selftest_nmictrl_another_flag, 1);
+	KTX_CHECK(selftest_nmictrl, selftest_nmictrl_mask_flag, 1);
 
 	nmictrl_del_handler("selftest_nmictrl_self");
 	nmictrl_del_handler("selftest_nmictrl_all");
 	nmictrl_del_handler("selftest_nmictrl_another");
+	nmictrl_del_handler("selftest_nmictrl_mask");
 	/* 'selftest_nmictrl_shutdown' will automatically be deleted in the shutdown phase. */
 	nmictrl_shutdown_sync();
 }
\ No newline at end of file
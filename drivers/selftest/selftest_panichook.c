@@ -0,0 +1,114 @@
+#include "selftest_panichook.h"
+
+#include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/rcupdate.h>
+#include <linux/string.h>
+
+#include "panichook.h"
+
+/* Window of a test run and budget of a test callback (microsec) */
+#define SELFTEST_PANICHOOK_WINDOW_US USEC_PER_SEC
+#define SELFTEST_PANICHOOK_BUDGET_US 1000
+/* Budget which never fits in the window */
+#define SELFTEST_PANICHOOK_HUGE_BUDGET_US (10 * USEC_PER_SEC)
+
+/* Callbacks append their letter in the order they ran */
+static char selftest_panichook_order[16];
+static int selftest_panichook_nr_run = 0;
+static int selftest_panichook_poll_stopped = 0;
+
+static void selftest_panichook_record(char letter)
+{
+	if (selftest_panichook_nr_run < (int)sizeof(selftest_panichook_order) - 1)
+		selftest_panichook_order[selftest_panichook_nr_run++] = letter;
+}
+
+static void selftest_panichook_reset(void)
+{
+	memset(selftest_panichook_order, 0, sizeof(selftest_panichook_order));
+	selftest_panichook_nr_run = 0;
+	selftest_panichook_poll_stopped = 0;
+}
+
+static void selftest_panichook_a_testfn(int (*time_is_up)(void))
+{
+	selftest_panichook_record('a');
+}
+
+static void selftest_panichook_b_testfn(int (*time_is_up)(void))
+{
+	selftest_panichook_record('b');
+}
+
+static void selftest_panichook_c_testfn(int (*time_is_up)(void))
+{
+	selftest_panichook_record('c');
+}
+
+static void selftest_panichook_huge_testfn(int (*time_is_up)(void))
+{
+	selftest_panichook_record('h');
+}
+
+/**
+ * @brief Spin until the deadline fires; it must fire well before the bound.
+ */
+static void selftest_panichook_poll_testfn(int (*time_is_up)(void))
+{
+	unsigned long bound = 10 * SELFTEST_PANICHOOK_BUDGET_US;
+
+	selftest_panichook_record('p');
+	while (!time_is_up()) {
+		if (!bound--)
+			return;
+		udelay(1);
+	}
+	selftest_panichook_poll_stopped = 1;
+}
+
+KTX_DEFINE(selftest_panichook)
+{
+	KTX_REQUIRE(selftest_panichook, panichook_add_callback("selftest_panichook_a",
+		&selftest_panichook_a_testfn, 10, SELFTEST_PANICHOOK_BUDGET_US), 0);
+	KTX_REQUIRE(selftest_panichook, panichook_add_callback("selftest_panichook_b",
+		&selftest_panichook_b_testfn, 20, SELFTEST_PANICHOOK_BUDGET_US), 0);
+	KTX_REQUIRE(selftest_panichook, panichook_add_callback("selftest_panichook_c",
+		&selftest_panichook_c_testfn, 10, SELFTEST_PANICHOOK_BUDGET_US), 0);
+	/* Names are unique */
+	KTX_CHECK(selftest_panichook, panichook_add_callback("selftest_panichook_a",
+		&selftest_panichook_c_testfn, 30, SELFTEST_PANICHOOK_BUDGET_US), -1);
+
+	/* Higher priority first; equal priorities in registration order */
+	selftest_panichook_reset();
+	KTX_CHECK(selftest_panichook, panichook_run_chain(SELFTEST_PANICHOOK_WINDOW_US), 3);
+	KTX_CHECK(selftest_panichook, strcmp(selftest_panichook_order, "bac"), 0);
+
+	/* A budget which does not fit in the window is skipped, and the rest still runs */
+	KTX_REQUIRE(selftest_panichook, panichook_add_callback("selftest_panichook_huge",
+		&selftest_panichook_huge_testfn, 30, SELFTEST_PANICHOOK_HUGE_BUDGET_US), 0);
+	selftest_panichook_reset();
+	KTX_CHECK(selftest_panichook, panichook_run_chain(SELFTEST_PANICHOOK_WINDOW_US), 3);
+	KTX_CHECK(selftest_panichook, strcmp(selftest_panichook_order, "bac"), 0);
+	panichook_del_callback("selftest_panichook_huge");
+
+	/* The deadline test fires at the end of the budget */
+	KTX_REQUIRE(selftest_panichook, panichook_add_callback("selftest_panichook_poll",
+		&selftest_panichook_poll_testfn, 15, SELFTEST_PANICHOOK_BUDGET_US), 0);
+	selftest_panichook_reset();
+	KTX_CHECK(selftest_panichook, panichook_run_chain(SELFTEST_PANICHOOK_WINDOW_US), 4);
+	KTX_CHECK(selftest_panichook, strcmp(selftest_panichook_order, "bpac"), 0);
+	KTX_CHECK(selftest_panichook, selftest_panichook_poll_stopped, 1);
+
+	/* Removed callbacks do not run */
+	panichook_del_callback("selftest_panichook_b");
+	selftest_panichook_reset();
+	KTX_CHECK(selftest_panichook, panichook_run_chain(SELFTEST_PANICHOOK_WINDOW_US), 3);
+	KTX_CHECK(selftest_panichook, strcmp(selftest_panichook_order, "pac"), 0);
+
+	panichook_clear_callback();
+	selftest_panichook_reset();
+	KTX_CHECK(selftest_panichook, panichook_run_chain(SELFTEST_PANICHOOK_WINDOW_US), 0);
+	/* Let the freed callbacks go before the module does */
+	rcu_barrier();
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#ifndef _NMIDBG_SELFTEST_PANICHOOK_H
+#define _NMIDBG_SELFTEST_PANICHOOK_H
+
+#include "selftest.h"
+
+KTX_DECLARE(selftest_panichook);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,257 @@
+#include "selftest_stress.h"
+
+#include <linux/kernel.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "nmictrl.h"
+
+#define SELFTEST_STRESS_HANDLER_NAME "selftest_stress%u"
+
+/* NMIs prepared per registration of the handler */
+#define SELFTEST_STRESS_BATCH 16
+
+/* Maximum time to wait for a single NMI (microsec) */
+#define SELFTEST_STRESS_TIMEOUT 1000000
+
+/**
+ * @brief Internal state of a churning kthread; written only by the kthread until it is stopped.
+ */
+typedef struct {
+	struct task_struct *task;
+	unsigned int cpu;
+	/** Registrations, unregistrations and triggered NMIs */
+	unsigned long nr_ops;
+	/** Prepared NMIs whose handler did not run */
+	unsigned long nr_lost;
+	/** Handler runs nobody prepared */
+	unsigned long nr_dup;
+	/** Failed registrations */
+	unsigned long nr_failed;
+} selftest_stress_worker_t;
+
+static unsigned int selftest_stress_duration_ms = SELFTEST_STRESS_DEFAULT_MS;
+
+static DEFINE_PER_CPU(unsigned long, selftest_stress_hits);
+
+static nmictrl_ret_t selftest_stress_testfn(struct pt_regs *regs)
+{
+	this_cpu_inc(selftest_stress_hits);
+	return NMICTRL_HANDLED;
+}
+
+void selftest_stress_set_duration(unsigned int duration_ms)
+{
+	selftest_stress_duration_ms = duration_ms;
+}
+
+/**
+ * @brief Internal function to trigger the current CPU, rotating over the triggers which reach it.
+ */
+static void selftest_stress_trigger(selftest_stress_worker_t *worker, unsigned int seq)
+{
+	switch (seq & 3) {
+	case 0:
+		nmictrl_trigger_self();
+		break;
+	case 1:
+		nmictrl_trigger_cpu(worker->cpu);
+		break;
+	case 2:
+		nmictrl_trigger_mask(cpumask_of(worker->cpu));
+		break;
+	default:
+		nmictrl_trigger_all();
+		break;
+	}
+}
+
+/**
+ * @brief Internal function to read the runs of the registered handler or of the builtin probe on the worker CPU.
+ */
+static __always_inline unsigned long selftest_stress_read(selftest_stress_worker_t *worker, int builtin)
+{
+	return !!builtin ? nmictrl_get_probe_hits(worker->cpu) : READ_ONCE(per_cpu(selftest_stress_hits, worker->cpu));
+}
+
+/**
+ * @brief Internal function to wait until the runs reach @p expected.
+ *
+ * @return
+ * 	0 if it was reached exactly.
+ */
+static int selftest_stress_wait(selftest_stress_worker_t *worker, int builtin, unsigned long expected)
+{
+	unsigned long timeout = SELFTEST_STRESS_TIMEOUT;
+	unsigned long hits;
+
+	while ((hits = selftest_stress_read(worker, builtin)) < expected) {
+		if (!timeout--) {
+			worker->nr_lost += expected - hits;
+			return -1;
+		}
+		udelay(1);
+	}
+	if (hits > expected) {
+		worker->nr_dup += hits - expected;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal function to prepare a single NMI on the worker CPU, trigger it, and check it ran once.
+ */
+static void selftest_stress_round(selftest_stress_worker_t *worker, const char *handler_name, unsigned int seq)
+{
+	int builtin = (handler_name == NULL);
+	unsigned long expected = selftest_stress_read(worker, builtin) + 1;
+
+	if (!!builtin)
+		nmictrl_prepare_builtin(NMICTRL_BUILTIN_PROBE, worker->cpu);
+	else
+		nmictrl_prepare_handler(handler_name, worker->cpu);
+	selftest_stress_trigger(worker, seq);
+	worker->nr_ops++;
+	(void) selftest_stress_wait(worker, builtin, expected);
+}
+
+/**
+ * @brief Internal kthread function to churn registrations and triggers on its CPU until stopped.
+ *
+ * Every prepared NMI must run its handler exactly once, whatever the other kthreads do to the handler list.
+ * The builtin probe is checked the same way in between.
+ */
+static int selftest_stress_worker_fn(void *data)
+{
+	selftest_stress_worker_t *worker = data;
+	char handler_name[NMICTRL_HANDLER_NAMESZ];
+	unsigned int seq = 0, idx;
+
+	snprintf(handler_name, sizeof(handler_name), SELFTEST_STRESS_HANDLER_NAME, worker->cpu);
+
+	while (!kthread_should_stop()) {
+		if (!!nmictrl_add_handler(handler_name, &selftest_stress_testfn)) {
+			worker->nr_failed++;
+			msleep(1);
+			continue;
+		}
+		worker->nr_ops++;
+
+		for (idx = 0; idx < SELFTEST_STRESS_BATCH; idx++, seq++) {
+			selftest_stress_round(worker, handler_name, seq);
+			selftest_stress_round(worker, NULL, seq + 1);
+		}
+
+		nmictrl_del_handler(handler_name);
+		worker->nr_ops++;
+		cond_resched();
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal function to churn on the first @p nr_cpus online CPUs for the configured duration.
+ *
+ * @return
+ * 	0 if every kthread ran and no NMI was lost nor duplicated.
+ */
+static int selftest_stress_step(selftest_stress_worker_t *workers, unsigned int nr_cpus)
+{
+	unsigned long nr_ops = 0, nr_lost = 0, nr_dup = 0, nr_failed = 0;
+	unsigned int idx, nr_started = 0, cpu;
+	u64 begin, elapsed_ms;
+
+	idx = 0;
+	for_each_online_cpu(cpu) {
+		if (idx == nr_cpus)
+			break;
+		memset(&workers[idx], 0, sizeof(workers[idx]));
+		workers[idx++].cpu = cpu;
+	}
+
+	begin = ktime_get_ns();
+	for (idx = 0; idx < nr_cpus; idx++) {
+		struct task_struct *task = kthread_create_on_node(selftest_stress_worker_fn, &workers[idx],
+			cpu_to_node(workers[idx].cpu), "nmdbg-stress/%u", workers[idx].cpu);
+
+		if (IS_ERR(task))
+			break;
+		kthread_bind(task, workers[idx].cpu);
+		workers[idx].task = task;
+		wake_up_process(task);
+		nr_started++;
+	}
+	if (nr_started == nr_cpus)
+		msleep(selftest_stress_duration_ms);
+	for (idx = 0; idx < nr_started; idx++)
+		kthread_stop(workers[idx].task);
+	elapsed_ms = div_u64(ktime_get_ns() - begin, NSEC_PER_MSEC);
+
+	for (idx = 0; idx < nr_started; idx++) {
+		nr_ops += workers[idx].nr_ops;
+		nr_lost += workers[idx].nr_lost;
+		nr_dup += workers[idx].nr_dup;
+		nr_failed += workers[idx].nr_failed;
+	}
+	if (nr_started != nr_cpus) {
+		pr_info("selftest_stress: failed to start the kthreads of %u cpus\n", nr_cpus);
+		return -1;
+	}
+
+	pr_info("selftest_stress: %u cpus, %llu ops/s (%llu ops/s per cpu), lost %lu, duplicated %lu, failed registrations %lu\n",
+		nr_cpus, div64_u64((u64)nr_ops * MSEC_PER_SEC, max_t(u64, elapsed_ms, 1)),
+		div64_u64((u64)nr_ops * MSEC_PER_SEC, max_t(u64, elapsed_ms, 1) * nr_cpus),
+		nr_lost, nr_dup, nr_failed);
+	return (nr_lost == 0 && nr_dup == 0 && nr_failed == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Internal function to run a step per CPU count, doubling it up to all online CPUs.
+ *
+ * @return
+ * 	0 if every step passed.
+ */
+static int selftest_stress_run(void)
+{
+	selftest_stress_worker_t *workers;
+	unsigned int nr_online, nr_cpus;
+	int ret = 0;
+
+	get_online_cpus();
+	nr_online = num_online_cpus();
+	workers = kcalloc(nr_online, sizeof(*workers), GFP_KERNEL);
+	if (workers == NULL) {
+		put_online_cpus();
+		return -1;
+	}
+
+	for (nr_cpus = 1; ; nr_cpus = min(nr_cpus * 2, nr_online)) {
+		if (!!selftest_stress_step(workers, nr_cpus))
+			ret = -1;
+		if (nr_cpus == nr_online)
+			break;
+	}
+
+	kfree(workers);
+	put_online_cpus();
+	return ret;
+}
+
+KTX_DEFINE(selftest_stress)
+{
+	if (selftest_stress_duration_ms == 0)
+		pr_info("selftest_stress: skipped\n");
+	else {
+		KTX_REQUIRE(selftest_stress, nmictrl_startup(), 0);
+		KTX_CHECK(selftest_stress, selftest_stress_run(), 0);
+		nmictrl_shutdown_sync();
+	}
+}
\ No newline at end of file
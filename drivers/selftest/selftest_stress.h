@@ -0,0 +1,20 @@
+#ifndef _NMIDBG_SELFTEST_STRESS_H
+#define _NMIDBG_SELFTEST_STRESS_H
+
+#include "selftest.h"
+
+#define SELFTEST_STRESS_DEFAULT_MS 1000
+
+/**
+ * @brief Set how long each step of the stress test churns.
+ *
+ * The test runs one step per CPU count (1, 2, 4, ... and all online CPUs).
+ *
+ * @param duration_ms
+ * 	duration of a step (millisec); 0 skips the stress test
+ */
+void selftest_stress_set_duration(unsigned int duration_ms);
+
+KTX_DECLARE(selftest_stress);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#include "selftest_textscan.h"
+
+#include <linux/kernel.h>
+#include <linux/kallsyms.h>
+#include <linux/mm.h>
+
+#include "nmictrl.h"
+#include "textscan.h"
+
+KTX_DEFINE(selftest_textscan)
+{
+	unsigned long stext = kallsyms_lookup_name("_stext");
+	unsigned long etext = kallsyms_lookup_name("_etext");
+	textscan_stat_t stat;
+
+	KTX_REQUIRE(selftest_textscan, !!stext && !!etext, 1);
+	KTX_REQUIRE(selftest_textscan, nmictrl_startup(), 0);
+	/* This takes the baseline */
+	KTX_REQUIRE(selftest_textscan, textscan_startup(NULL), 0);
+
+	/* The core text alone needs a chunk per page it touches; module text comes on top */
+	textscan_get_stat(&stat);
+	KTX_CHECK(selftest_textscan, stat.nr_chunks >= (PAGE_ALIGN(etext) - (stext & PAGE_MASK)) >> PAGE_SHIFT, 1);
+	KTX_CHECK(selftest_textscan, stat.incomplete, 0);
+
+	/* Nothing patches the text in between, so nothing may diverge */
+	KTX_CHECK(selftest_textscan, textscan_rescan(), 0);
+	textscan_get_stat(&stat);
+	KTX_CHECK(selftest_textscan, stat.nr_diverged, 0);
+	KTX_CHECK(selftest_textscan, stat.incomplete, 0);
+	KTX_CHECK(selftest_textscan, stat.nr_cpus, num_online_cpus());
+
+	/* A new baseline matches as well */
+	KTX_CHECK(selftest_textscan, textscan_baseline(), 0);
+	KTX_CHECK(selftest_textscan, textscan_rescan(), 0);
+
+	textscan_shutdown();
+	nmictrl_shutdown_sync();
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#ifndef _NMIDBG_SELFTEST_TEXTSCAN_H
+#define _NMIDBG_SELFTEST_TEXTSCAN_H
+
+#include "selftest.h"
+
+KTX_DECLARE(selftest_textscan);
+
+#endif
\ No newline at end of file
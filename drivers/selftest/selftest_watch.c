@@ -0,0 +1,69 @@
+#include "selftest_watch.h"
+
+#include <linux/compiler.h>
+#include <linux/err.h>
+#include <linux/hw_breakpoint.h>
+#include <asm/debugreg.h>
+
+#include "nmictrl.h"
+#include "tracering.h"
+#include "watch.h"
+
+static u64 selftest_watch_target __aligned(8) = 0;
+
+KTX_DEFINE(selftest_watch)
+{
+	struct perf_event * __percpu *bp;
+	struct perf_event_attr attr;
+	watch_stat_t stat;
+	unsigned long dr7;
+
+	KTX_REQUIRE(selftest_watch, nmictrl_startup(), 0);
+	KTX_REQUIRE(selftest_watch, tracering_startup(TRACERING_DEFAULT_SIZE, NULL), 0);
+	KTX_REQUIRE(selftest_watch, watch_startup(NULL), 0);
+
+	/* The debug registers are claimed, so other breakpoints are refused */
+	hw_breakpoint_init(&attr);
+	attr.bp_addr = (unsigned long)&selftest_watch_target;
+	attr.bp_len = HW_BREAKPOINT_LEN_8;
+	attr.bp_type = HW_BREAKPOINT_W;
+	attr.disabled = 1;
+	bp = register_wide_hw_breakpoint(&attr, NULL, NULL);
+	KTX_CHECK(selftest_watch, IS_ERR(bp), 1);
+	if (!IS_ERR(bp))
+		unregister_wide_hw_breakpoint(bp);
+
+	/* Every online CPU must acknowledge the broadcast */
+	KTX_CHECK(selftest_watch, watch_set(0, (unsigned long)&selftest_watch_target, 8, WATCH_TYPE_WRITE), 0);
+
+	/* Armed slots are mirrored where the kernel restores DR7 from */
+	get_cpu();
+	get_debugreg(dr7, 7);
+	KTX_CHECK(selftest_watch, this_cpu_read(cpu_dr7) == dr7, 1);
+	KTX_CHECK(selftest_watch, !!(dr7 & DR_GLOBAL_ENABLE), 1);
+	put_cpu();
+
+	/* Reads must not hit a write-only watchpoint */
+	(void) READ_ONCE(selftest_watch_target);
+	watch_get_stat(&stat);
+	KTX_CHECK(selftest_watch, stat.nr_hits[0], 0);
+
+	WRITE_ONCE(selftest_watch_target, 1);
+	watch_get_stat(&stat);
+	KTX_CHECK(selftest_watch, stat.nr_hits[0], 1);
+	KTX_CHECK(selftest_watch, stat.nr_dropped, 0);
+
+	/* Disarmed slots must not hit anymore */
+	KTX_CHECK(selftest_watch, watch_clear(0), 0);
+	WRITE_ONCE(selftest_watch_target, 2);
+	watch_get_stat(&stat);
+	KTX_CHECK(selftest_watch, stat.nr_hits[0], 1);
+
+	/* Misaligned and oversized watchpoints are rejected */
+	KTX_CHECK(selftest_watch, watch_set(1, (unsigned long)&selftest_watch_target + 1, 8, WATCH_TYPE_RW), -1);
+	KTX_CHECK(selftest_watch, watch_set(WATCH_NR_SLOTS, (unsigned long)&selftest_watch_target, 8, WATCH_TYPE_RW), -1);
+
+	watch_shutdown();
+	nmictrl_shutdown_sync();
+	tracering_shutdown();
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#ifndef _NMIDBG_SELFTEST_WATCH_H
+#define _NMIDBG_SELFTEST_WATCH_H
+
+#include "selftest.h"
+
+KTX_DECLARE(selftest_watch);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,545 @@
+/**
+ * @file textscan.c
+ * @brief The textscan subsystem.
+ *
+ * This is implementations of 'textscan subsystem'
+ *
+ * Text is split into page-sized chunks which CPUs claim one by one from a shared counter,
+ * so a CPU slowed down by cache misses or a late NMI never holds back the others.
+ * Checksums are crc32c, computed with the SSE4.2 'crc32' instruction when available and by the table-driven
+ * '__crc32c_le()' otherwise. Both use general purpose registers only; the crc32c library may go through
+ * the crypto API into a driver which takes the FPU, and the FPU state must never be touched from an NMI.
+ *
+ * Text legitimately patched after the baseline (jump labels, ftrace, kprobes, fhook probes) is reported as well;
+ * take a new baseline after enabling such features.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "textscan.h"
+
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/kallsyms.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <asm/cpufeature.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+#define TEXTSCAN_WORKER_HANDLER_NAME "textscan_worker"
+
+/* Maximum time to wait for all chunks of a scan (microsec) */
+#define TEXTSCAN_SYNC_TIMEOUT 1000000
+
+#define TEXTSCAN_MODE_BASELINE 0
+#define TEXTSCAN_MODE_COMPARE 1
+
+/**
+ * @brief Internal structure for a contiguous text range.
+ */
+typedef struct {
+	unsigned long start;
+	unsigned long end;
+	/** Owner module (NULL for the core kernel); only compared, never dereferenced */
+	struct module *owner;
+	char name[MODULE_NAME_LEN];
+	/** Number of chunks of this range */
+	unsigned long nr_chunks;
+	/** Set when the owner module goes away */
+	int dead;
+} textscan_range_t;
+
+/**
+ * @brief Internal structure for a chunk of a text range.
+ */
+typedef struct {
+	unsigned long start;
+	u32 size;
+	/** Baseline checksum */
+	u32 crc;
+	/** Index of the owning range */
+	u32 range;
+} textscan_chunk_t;
+
+static textscan_range_t *textscan_ranges = NULL;
+static unsigned int textscan_nr_ranges = 0;
+static textscan_chunk_t *textscan_chunks = NULL;
+static unsigned long textscan_nr_chunks = 0;
+static unsigned long *textscan_diverged = NULL;
+
+/* Scan state; a scan runs only while 'textscan_busy' is held */
+static atomic_t textscan_busy = ATOMIC_INIT(0);
+static atomic_long_t textscan_next_chunk = ATOMIC_LONG_INIT(0);
+static atomic_long_t textscan_nr_done = ATOMIC_LONG_INIT(0);
+static atomic_t textscan_nr_cpus = ATOMIC_INIT(0);
+static int textscan_mode = TEXTSCAN_MODE_BASELINE;
+static textscan_stat_t textscan_last;
+
+/* Serializes the control paths, which may sleep */
+static DEFINE_MUTEX(textscan_lock);
+
+static struct dentry *textscan_file = NULL;
+static int textscan_active = 0;
+
+/**
+ * @brief Internal function to compute the crc32c of a chunk, safe in an NMI.
+ *
+ * The result is the same whichever implementation runs, so a baseline taken on one can be compared with the other.
+ */
+static u32 textscan_crc32c(u32 crc, const void *addr, u32 size)
+{
+	const unsigned long *words = addr;
+	const u8 *bytes;
+	unsigned long crc_long = crc;
+	u32 nr_words = size / sizeof(unsigned long);
+
+	if (!static_cpu_has(X86_FEATURE_XMM4_2))
+		return __crc32c_le(crc, addr, size);
+
+	while (nr_words--)
+		asm("crc32q %1, %q0" : "+r" (crc_long) : "rm" (*words++));
+	for (bytes = (const u8 *)words; bytes < (const u8 *)addr + size; bytes++)
+		asm("crc32b %1, %k0" : "+r" (crc_long) : "rm" (*bytes));
+	return (u32)crc_long;
+}
+
+/**
+ * @brief Internal function to checksum chunks until none is left.
+ *
+ * It runs with preemption disabled, so a going module cannot be freed under it.
+ *
+ * @param time_is_up
+ * 	deadline test polled between chunks (NULL for no deadline)
+ */
+static void textscan_work(int (*time_is_up)(void))
+{
+	unsigned long idx;
+
+	atomic_inc(&textscan_nr_cpus);
+	while ((time_is_up == NULL || !time_is_up()) &&
+		(idx = atomic_long_inc_return(&textscan_next_chunk) - 1) < textscan_nr_chunks) {
+		textscan_chunk_t *chunk = &textscan_chunks[idx];
+
+		if (!READ_ONCE(textscan_ranges[chunk->range].dead)) {
+			u32 crc = textscan_crc32c(~0U, (const void *)chunk->start, chunk->size);
+
+			if (textscan_mode == TEXTSCAN_MODE_BASELINE)
+				chunk->crc = crc;
+			else if (crc != chunk->crc)
+				set_bit(idx, textscan_diverged);
+		}
+		smp_mb__before_atomic();
+		atomic_long_inc(&textscan_nr_done);
+	}
+}
+
+/**
+ * @brief Internal NMI function to take part in a scan.
+ */
+static nmictrl_ret_t textscan_worker_nmifn(struct pt_regs *regs)
+{
+	textscan_work(NULL);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to run a scan on all online CPUs.
+ *
+ * 'textscan_busy' must be held.
+ *
+ * @param time_is_up
+ * 	deadline test of the calling CPU (NULL for no deadline); chunks left when it fires stay unscanned
+ */
+static void textscan_run_busy(int mode, int (*time_is_up)(void))
+{
+	unsigned long timeout = TEXTSCAN_SYNC_TIMEOUT;
+	unsigned int cpu, this_cpu, range;
+	u64 begin = rdtsc();
+
+	textscan_mode = mode;
+	bitmap_zero(textscan_diverged, textscan_nr_chunks);
+	atomic_long_set(&textscan_nr_done, 0);
+	atomic_set(&textscan_nr_cpus, 0);
+	smp_wmb();
+	atomic_long_set(&textscan_next_chunk, 0);
+
+	this_cpu = get_cpu();
+	for_each_online_cpu(cpu)
+		if (cpu != this_cpu)
+			nmictrl_prepare_handler(TEXTSCAN_WORKER_HANDLER_NAME, cpu);
+	nmictrl_trigger_others();
+	textscan_work(time_is_up);
+	put_cpu();
+
+	while (atomic_long_read(&textscan_nr_done) < textscan_nr_chunks) {
+		if (!timeout-- || (time_is_up != NULL && !!time_is_up()))
+			break;
+		udelay(1);
+	}
+	smp_rmb();
+
+	memset(&textscan_last, 0, sizeof(textscan_last));
+	textscan_last.nr_chunks = textscan_nr_chunks;
+	textscan_last.nr_diverged = bitmap_weight(textscan_diverged, textscan_nr_chunks);
+	for (range = 0; range < textscan_nr_ranges; range++)
+		if (!!READ_ONCE(textscan_ranges[range].dead))
+			textscan_last.nr_skipped += textscan_ranges[range].nr_chunks;
+	textscan_last.nr_cpus = atomic_read(&textscan_nr_cpus);
+	textscan_last.incomplete = atomic_long_read(&textscan_nr_done) < textscan_nr_chunks;
+	textscan_last.scan_cycles = rdtsc() - begin;
+}
+
+/**
+ * @brief Internal function to visit every diverging range of the last scan.
+ *
+ * Adjacent diverging chunks of the same range are merged.
+ */
+static void textscan_for_each_diverged(void (*fn)(void *arg, const textscan_range_t *range,
+	unsigned long start, unsigned long end), void *arg)
+{
+	unsigned long idx = find_first_bit(textscan_diverged, textscan_nr_chunks);
+
+	while (idx < textscan_nr_chunks) {
+		textscan_chunk_t *first = &textscan_chunks[idx];
+		unsigned long last = idx;
+
+		while (last + 1 < textscan_nr_chunks &&
+			test_bit(last + 1, textscan_diverged) &&
+			textscan_chunks[last + 1].range == first->range)
+			last++;
+
+		fn(arg, &textscan_ranges[first->range], first->start,
+			textscan_chunks[last].start + textscan_chunks[last].size);
+		idx = find_next_bit(textscan_diverged, textscan_nr_chunks, last + 1);
+	}
+}
+
+static void textscan_report_fn(void *arg, const textscan_range_t *range, unsigned long start, unsigned long end)
+{
+	pr_warn("Text diverged from the baseline: 0x%lx-0x%lx [%s] %pS\n", start, end, range->name, (void *)start);
+}
+
+/**
+ * @brief Internal function to report the last scan to the kernel log.
+ */
+static void textscan_report(void)
+{
+	textscan_for_each_diverged(textscan_report_fn, NULL);
+	pr_info("Scanned %lu text chunks on %u cpus in %llu cycles (diverged: %lu, skipped: %lu%s)\n",
+		textscan_last.nr_chunks, textscan_last.nr_cpus, textscan_last.scan_cycles,
+		textscan_last.nr_diverged, textscan_last.nr_skipped,
+		!!textscan_last.incomplete ? ", incomplete" : "");
+}
+
+int textscan_baseline(void)
+{
+	int ret = -1;
+
+	mutex_lock(&textscan_lock);
+	if (!textscan_active || atomic_cmpxchg(&textscan_busy, 0, 1) != 0)
+		goto out_unlock;
+
+	textscan_run_busy(TEXTSCAN_MODE_BASELINE, NULL);
+	ret = !!textscan_last.incomplete ? -1 : 0;
+
+	atomic_set(&textscan_busy, 0);
+out_unlock:
+	mutex_unlock(&textscan_lock);
+	return ret;
+}
+
+int textscan_rescan(void)
+{
+	int ret = -1;
+
+	mutex_lock(&textscan_lock);
+	if (!textscan_active || atomic_cmpxchg(&textscan_busy, 0, 1) != 0)
+		goto out_unlock;
+
+	textscan_run_busy(TEXTSCAN_MODE_COMPARE, NULL);
+	textscan_report();
+	ret = textscan_last.nr_diverged;
+
+	atomic_set(&textscan_busy, 0);
+out_unlock:
+	mutex_unlock(&textscan_lock);
+	return ret;
+}
+
+void textscan_panic_scan(int (*time_is_up)(void))
+{
+	if (!READ_ONCE(textscan_active) || atomic_cmpxchg(&textscan_busy, 0, 1) != 0)
+		return;
+
+	textscan_run_busy(TEXTSCAN_MODE_COMPARE, time_is_up);
+	textscan_report();
+	/* Keep 'textscan_busy' held; nothing runs after the panic path */
+}
+
+void textscan_get_stat(textscan_stat_t *stat)
+{
+	mutex_lock(&textscan_lock);
+	memcpy(stat, &textscan_last, sizeof(*stat));
+	mutex_unlock(&textscan_lock);
+}
+
+static void textscan_show_fn(void *arg, const textscan_range_t *range, unsigned long start, unsigned long end)
+{
+	seq_printf((struct seq_file *)arg, "0x%lx-0x%lx [%s] %pS\n", start, end, range->name, (void *)start);
+}
+
+static int textscan_show(struct seq_file *seq, void *unused)
+{
+	mutex_lock(&textscan_lock);
+	seq_printf(seq, "chunks %lu diverged %lu skipped %lu cpus %u cycles %llu%s\n",
+		textscan_last.nr_chunks, textscan_last.nr_diverged, textscan_last.nr_skipped,
+		textscan_last.nr_cpus, textscan_last.scan_cycles,
+		!!textscan_last.incomplete ? " incomplete" : "");
+	if (textscan_mode == TEXTSCAN_MODE_COMPARE)
+		textscan_for_each_diverged(textscan_show_fn, seq);
+	mutex_unlock(&textscan_lock);
+	return 0;
+}
+
+static int textscan_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, textscan_show, NULL);
+}
+
+/**
+ * @brief Internal function to parse a control command.
+ *
+ * 'scan' rescans the text, 'baseline' takes the baseline again.
+ */
+static ssize_t textscan_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char buf[16];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (!!copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	strim(buf);
+
+	if (strcmp(buf, "scan") == 0)
+		return (textscan_rescan() >= 0) ? count : -EIO;
+	if (strcmp(buf, "baseline") == 0)
+		return !textscan_baseline() ? count : -EIO;
+	return -EINVAL;
+}
+
+static const struct file_operations textscan_fops = {
+	.owner = THIS_MODULE,
+	.open = textscan_open,
+	.read = seq_read,
+	.write = textscan_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * @brief Internal function to retire the ranges of a going module.
+ */
+static int textscan_module_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+	unsigned int range;
+
+	if (action != MODULE_STATE_GOING)
+		return NOTIFY_DONE;
+
+	for (range = 0; range < textscan_nr_ranges; range++)
+		if (textscan_ranges[range].owner == data)
+			WRITE_ONCE(textscan_ranges[range].dead, 1);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block textscan_module_nb = {
+	.notifier_call = textscan_module_notify,
+};
+
+/**
+ * @brief Internal function to add a range, or only count it if 'textscan_ranges' is NULL.
+ */
+static void textscan_add_range(unsigned long start, unsigned long end, struct module *owner, const char *name)
+{
+	if (start >= end)
+		return;
+
+	if (textscan_ranges != NULL) {
+		textscan_range_t *range = &textscan_ranges[textscan_nr_ranges];
+
+		range->start = start;
+		range->end = end;
+		range->owner = owner;
+		strlcpy(range->name, name, sizeof(range->name));
+		range->nr_chunks = 0;
+		range->dead = 0;
+	}
+	textscan_nr_ranges++;
+}
+
+/**
+ * @brief Internal function to collect the core kernel text and the text of every loaded module.
+ *
+ * The module list is walked twice under 'module_mutex': once to count, once to fill.
+ */
+static int textscan_collect_ranges(void)
+{
+	struct list_head *modules = (struct list_head *)kallsyms_lookup_name("modules");
+	unsigned long stext = kallsyms_lookup_name("_stext");
+	unsigned long etext = kallsyms_lookup_name("_etext");
+	struct module *mod;
+	int pass;
+
+	if (modules == NULL || !stext || !etext)
+		return -1;
+
+	mutex_lock(&module_mutex);
+	for (pass = 0; pass < 2; pass++) {
+		textscan_nr_ranges = 0;
+		textscan_add_range(stext, etext, NULL, "kernel");
+		list_for_each_entry(mod, modules, list) {
+			if (mod->state == MODULE_STATE_UNFORMED)
+				continue;
+			textscan_add_range((unsigned long)mod->core_layout.base,
+				(unsigned long)mod->core_layout.base + mod->core_layout.text_size, mod, mod->name);
+		}
+		if (pass == 0) {
+			textscan_ranges = kcalloc(textscan_nr_ranges, sizeof(*textscan_ranges), GFP_KERNEL);
+			if (textscan_ranges == NULL) {
+				mutex_unlock(&module_mutex);
+				return -1;
+			}
+		}
+	}
+	mutex_unlock(&module_mutex);
+	return 0;
+}
+
+/**
+ * @brief Internal function to split the ranges into page-sized chunks.
+ */
+static int textscan_split_ranges(void)
+{
+	unsigned int range;
+	unsigned long addr, next, idx = 0;
+
+	textscan_nr_chunks = 0;
+	for (range = 0; range < textscan_nr_ranges; range++) {
+		textscan_range_t *range_ptr = &textscan_ranges[range];
+
+		range_ptr->nr_chunks = (PAGE_ALIGN(range_ptr->end) - (range_ptr->start & PAGE_MASK)) >> PAGE_SHIFT;
+		textscan_nr_chunks += range_ptr->nr_chunks;
+	}
+
+	textscan_chunks = vzalloc(textscan_nr_chunks * sizeof(*textscan_chunks));
+	textscan_diverged = vzalloc(BITS_TO_LONGS(textscan_nr_chunks) * sizeof(unsigned long));
+	if (textscan_chunks == NULL || textscan_diverged == NULL)
+		return -1;
+
+	for (range = 0; range < textscan_nr_ranges; range++) {
+		textscan_range_t *range_ptr = &textscan_ranges[range];
+
+		for (addr = range_ptr->start; addr < range_ptr->end; addr = next) {
+			next = min(range_ptr->end, (addr & PAGE_MASK) + PAGE_SIZE);
+			textscan_chunks[idx].start = addr;
+			textscan_chunks[idx].size = next - addr;
+			textscan_chunks[idx].range = range;
+			idx++;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal function to release all ranges and chunks.
+ */
+static void textscan_free(void)
+{
+	vfree(textscan_diverged);
+	textscan_diverged = NULL;
+	vfree(textscan_chunks);
+	textscan_chunks = NULL;
+	textscan_nr_chunks = 0;
+	kfree(textscan_ranges);
+	textscan_ranges = NULL;
+	textscan_nr_ranges = 0;
+}
+
+int textscan_startup(struct dentry *debugfs_dir)
+{
+	if (!!textscan_active)
+		return -1;
+
+	if (!!textscan_collect_ranges() || !!textscan_split_ranges())
+		goto err_free;
+
+	if (!!nmictrl_add_handler(TEXTSCAN_WORKER_HANDLER_NAME, &textscan_worker_nmifn))
+		goto err_free;
+
+	if (!!register_module_notifier(&textscan_module_nb))
+		goto err_del_handler;
+
+	mutex_lock(&textscan_lock);
+	textscan_active = 1;
+	mutex_unlock(&textscan_lock);
+
+	if (!!textscan_baseline())
+		goto err_shutdown;
+
+	if (debugfs_dir != NULL) {
+		textscan_file = debugfs_create_file(TEXTSCAN_FILE_NAME, 0600, debugfs_dir, NULL, &textscan_fops);
+		if (IS_ERR_OR_NULL(textscan_file)) {
+			textscan_file = NULL;
+			goto err_shutdown;
+		}
+	}
+
+	pr_info("Attached the textscan subsystem successfully (ranges: %u, chunks: %lu, cycles: %llu)\n",
+		textscan_nr_ranges, textscan_nr_chunks, textscan_last.scan_cycles);
+	return 0;
+
+err_shutdown:
+	textscan_shutdown();
+	return -1;
+
+err_del_handler:
+	nmictrl_del_handler(TEXTSCAN_WORKER_HANDLER_NAME);
+err_free:
+	textscan_free();
+	return -1;
+}
+
+void textscan_shutdown(void)
+{
+	mutex_lock(&textscan_lock);
+	if (!textscan_active) {
+		mutex_unlock(&textscan_lock);
+		return;
+	}
+	WRITE_ONCE(textscan_active, 0);
+	mutex_unlock(&textscan_lock);
+
+	debugfs_remove(textscan_file);
+	textscan_file = NULL;
+
+	unregister_module_notifier(&textscan_module_nb);
+	/* This waits for a late NMI of a timed-out scan still walking the chunks */
+	nmictrl_del_handler(TEXTSCAN_WORKER_HANDLER_NAME);
+	textscan_free();
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+/**
+ * @file textscan.h
+ * @brief Prototypes for 'textscan subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'textscan subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_TEXTSCAN_H
+#define _NMDBG_TEXTSCAN_H
+
+#include <linux/types.h>
+#include <linux/dcache.h>
+
+#include "nmictrl.h"
+
+#define TEXTSCAN_FILE_NAME "textscan"
+
+/**
+ * @brief Statistics of the last scan.
+ */
+typedef struct {
+	/** Number of page-sized chunks covered by the baseline */
+	unsigned long nr_chunks;
+	/** Number of chunks whose checksum diverged from the baseline */
+	unsigned long nr_diverged;
+	/** Number of chunks skipped because their module went away */
+	unsigned long nr_skipped;
+	/** Number of CPUs which took part in the scan */
+	unsigned int nr_cpus;
+	/** Non-zero if some chunks were not scanned before the timeout */
+	int incomplete;
+	/** Cycles taken by the scan */
+	u64 scan_cycles;
+} textscan_stat_t;
+
+/**
+ * @brief Activate the textscan subsys.
+ *
+ * This function splits the core kernel text and the text of loaded modules into page-sized chunks
+ * and takes the baseline CRC32C of each chunk.
+ * The nmictrl coresys must be started before, and hooks patching kernel text should be attached before,
+ * so their patches belong to the baseline.
+ *
+ * @param debugfs_dir
+ * 	debugfs directory to create the control file in (NULL to skip)
+ * @return
+ * 	0 if activation success.
+ */
+int textscan_startup(struct dentry *debugfs_dir);
+
+/**
+ * @brief Deactivate the textscan subsys.
+ *
+ * This function must be called before the nmictrl coresys shuts down.
+ */
+void textscan_shutdown(void);
+
+/**
+ * @brief Take the baseline checksums again.
+ *
+ * @return
+ * 	0 if every chunk was checksummed.
+ */
+int textscan_baseline(void);
+
+/**
+ * @brief Rescan the text and compare it with the baseline.
+ *
+ * Chunks are split across all online CPUs through the nmictrl coresys; the caller takes part as well.
+ * Diverging ranges are reported to the kernel log.
+ *
+ * @return
+ * 	the number of diverging chunks, or -1 if the scan did not run.
+ */
+int textscan_rescan(void);
+
+/**
+ * @brief Rescan the text from the panic path.
+ *
+ * It never sleeps nor allocates, and gives up if another scan is running.
+ *
+ * @param time_is_up
+ * 	polled while scanning and waiting for the other CPUs; once it returns non-zero,
+ * 	the scan stops and is reported as incomplete (NULL for no deadline)
+ */
+void textscan_panic_scan(int (*time_is_up)(void));
+
+/**
+ * @brief Get the statistics of the last scan.
+ *
+ * @param stat
+ * 	statistics to be filled
+ */
+void textscan_get_stat(textscan_stat_t *stat);
+
+#endif
\ No newline at end of file
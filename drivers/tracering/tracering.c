@@ -0,0 +1,401 @@
+/**
+ * @file tracering.c
+ * @brief The tracering subsystem.
+ *
+ * This is implementations of 'tracering subsystem'
+ *
+ * Each CPU owns a ring which only that CPU writes to, so writers never share cache lines.
+ * A writer reserves space by a local cmpxchg on the ring head, which keeps nested writers
+ * (process context -> IRQ -> NMI on the same CPU) from overlapping.
+ * Each slot carries a commit flag, so the reader stops at the first uncommitted slot.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "tracering.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <asm/local.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+#define TRACERING_SLOT_COMMITTED 0x1
+#define TRACERING_SLOT_PAD 0x2
+
+/**
+ * @brief Internal slot header preceding every record in a ring.
+ *
+ * Slots never reach readers; only the records inside them do.
+ */
+typedef struct {
+	/** Size of the slot including this header */
+	u32 slot_size;
+	/** TRACERING_SLOT_* flags */
+	u32 slot_flags;
+} tracering_slot_t;
+
+/**
+ * @brief Internal per-cpu ring.
+ */
+typedef struct {
+	/** Ring memory (NULL while inactive) */
+	u8 *ring_base;
+	/** Pages backing 'ring_base' */
+	struct page *ring_page;
+	/** Total bytes ever reserved (written by the owner CPU only) */
+	local_t ring_head;
+	/** Total bytes ever consumed (written by the reader only) */
+	unsigned long ring_tail;
+	/** Number of committed records */
+	local_t nr_written;
+	/** Number of dropped records */
+	local_t nr_dropped;
+} tracering_ring_t;
+
+static DEFINE_PER_CPU(tracering_ring_t, tracering_rings);
+
+static size_t tracering_ring_size = 0;
+static struct dentry *tracering_file = NULL;
+
+static DEFINE_MUTEX(tracering_read_lock);
+static unsigned int tracering_read_cpu = 0;
+
+static tracering_tsc_fn_t tracering_tsc_fn = NULL;
+
+nmdbg_fmt_rec_t *tracering_reserve(u16 type, u32 size)
+{
+	tracering_ring_t *ring_ptr = this_cpu_ptr(&tracering_rings);
+	tracering_slot_t *slot_ptr;
+	nmdbg_fmt_rec_t *rec;
+	unsigned long head, offset, pad;
+	u32 slot_size = sizeof(*slot_ptr) + NMDBG_FMT_ALIGN_SIZE(size);
+
+	if (unlikely(ring_ptr->ring_base == NULL))
+		return NULL;
+
+	do {
+		head = local_read(&ring_ptr->ring_head);
+		offset = head & (tracering_ring_size - 1);
+		/*
+		 * A record never wraps around.
+		 * If it does not fit at the end, the rest of the ring becomes a padding slot.
+		 */
+		pad = (tracering_ring_size - offset < slot_size) ? tracering_ring_size - offset : 0;
+		if (head + pad + slot_size - READ_ONCE(ring_ptr->ring_tail) > tracering_ring_size) {
+			local_inc(&ring_ptr->nr_dropped);
+			return NULL;
+		}
+	} while (local_cmpxchg(&ring_ptr->ring_head, head, head + pad + slot_size) != head);
+
+	if (!!pad) {
+		slot_ptr = (tracering_slot_t *)(ring_ptr->ring_base + offset);
+		slot_ptr->slot_size = pad;
+		smp_store_release(&slot_ptr->slot_flags, TRACERING_SLOT_PAD | TRACERING_SLOT_COMMITTED);
+		offset = 0;
+	}
+
+	slot_ptr = (tracering_slot_t *)(ring_ptr->ring_base + offset);
+	slot_ptr->slot_size = slot_size;
+
+	rec = (nmdbg_fmt_rec_t *)(slot_ptr + 1);
+	rec->type = type;
+	rec->cpu = (u16)raw_smp_processor_id();
+	rec->size = NMDBG_FMT_ALIGN_SIZE(size);
+	rec->tsc = rdtsc();
+	return rec;
+}
+
+void tracering_commit(nmdbg_fmt_rec_t *rec)
+{
+	tracering_slot_t *slot_ptr = (tracering_slot_t *)rec - 1;
+
+	local_inc(this_cpu_ptr(&tracering_rings.nr_written));
+	smp_store_release(&slot_ptr->slot_flags, TRACERING_SLOT_COMMITTED);
+}
+
+void tracering_fill_regs(nmdbg_fmt_regs_rec_t *regs_rec, u32 reason, const struct pt_regs *regs)
+{
+	regs_rec->rec.type = NMDBG_FMT_REC_REGS;
+	regs_rec->rec.cpu = (u16)raw_smp_processor_id();
+	regs_rec->rec.size = sizeof(*regs_rec);
+	regs_rec->rec.tsc = rdtsc();
+	regs_rec->reason = reason;
+	regs_rec->pid = task_pid_nr(current);
+	memcpy(regs_rec->comm, current->comm, NMDBG_FMT_COMM_LEN);
+	regs_rec->regs.ip = regs->ip;
+	regs_rec->regs.sp = regs->sp;
+	regs_rec->regs.flags = regs->flags;
+	regs_rec->regs.ax = regs->ax;
+	regs_rec->regs.bx = regs->bx;
+	regs_rec->regs.cx = regs->cx;
+	regs_rec->regs.dx = regs->dx;
+	regs_rec->regs.si = regs->si;
+	regs_rec->regs.di = regs->di;
+	regs_rec->regs.bp = regs->bp;
+	regs_rec->regs.r8 = regs->r8;
+	regs_rec->regs.r9 = regs->r9;
+	regs_rec->regs.r10 = regs->r10;
+	regs_rec->regs.r11 = regs->r11;
+	regs_rec->regs.r12 = regs->r12;
+	regs_rec->regs.r13 = regs->r13;
+	regs_rec->regs.r14 = regs->r14;
+	regs_rec->regs.r15 = regs->r15;
+	regs_rec->regs.cs = regs->cs;
+	regs_rec->regs.ss = regs->ss;
+}
+
+int tracering_write_regs(u32 reason, const struct pt_regs *regs)
+{
+	nmdbg_fmt_rec_t *rec = tracering_reserve(NMDBG_FMT_REC_REGS, sizeof(nmdbg_fmt_regs_rec_t));
+
+	if (rec == NULL)
+		return -1;
+
+	tracering_fill_regs((nmdbg_fmt_regs_rec_t *)rec, reason, regs);
+	tracering_commit(rec);
+	return 0;
+}
+
+int tracering_write_sample(u32 id, u64 ip, u64 arg)
+{
+	nmdbg_fmt_sample_rec_t *sample_ptr =
+		(nmdbg_fmt_sample_rec_t *)tracering_reserve(NMDBG_FMT_REC_SAMPLE, sizeof(*sample_ptr));
+
+	if (sample_ptr == NULL)
+		return -1;
+
+	sample_ptr->id = id;
+	sample_ptr->reserved = 0;
+	sample_ptr->ip = ip;
+	sample_ptr->arg = arg;
+	tracering_commit(&sample_ptr->rec);
+	return 0;
+}
+
+int tracering_write_watch(u32 slot, u64 ip, u64 addr)
+{
+	nmdbg_fmt_watch_rec_t *watch_ptr =
+		(nmdbg_fmt_watch_rec_t *)tracering_reserve(NMDBG_FMT_REC_WATCH, sizeof(*watch_ptr));
+
+	if (watch_ptr == NULL)
+		return -1;
+
+	watch_ptr->slot = slot;
+	watch_ptr->reserved = 0;
+	watch_ptr->ip = ip;
+	watch_ptr->addr = addr;
+	tracering_commit(&watch_ptr->rec);
+	return 0;
+}
+
+void tracering_set_tsc_fn(tracering_tsc_fn_t tsc_fn)
+{
+	WRITE_ONCE(tracering_tsc_fn, tsc_fn);
+}
+
+u64 tracering_correct_tsc(unsigned int cpu, u64 tsc)
+{
+	tracering_tsc_fn_t tsc_fn = READ_ONCE(tracering_tsc_fn);
+
+	return (tsc_fn != NULL) ? tsc_fn(cpu, tsc) : tsc;
+}
+
+void tracering_get_stat(tracering_stat_t *stat)
+{
+	unsigned int cpu;
+
+	memset(stat, 0, sizeof(*stat));
+	for_each_possible_cpu(cpu) {
+		stat->nr_written += local_read(&per_cpu(tracering_rings, cpu).nr_written);
+		stat->nr_dropped += local_read(&per_cpu(tracering_rings, cpu).nr_dropped);
+	}
+}
+
+/**
+ * @brief Internal function to drain committed records of a ring into a user buffer.
+ *
+ * @param ring_ptr
+ * 	ring to drain
+ * @param ubuf
+ * 	user buffer
+ * @param count
+ * 	free space of @p ubuf
+ * @return
+ * 	the number of copied bytes, or a negative errno.
+ */
+static ssize_t tracering_drain(tracering_ring_t *ring_ptr, char __user *ubuf, size_t count)
+{
+	unsigned long tail = ring_ptr->ring_tail;
+	size_t copied = 0;
+
+	while (tail != local_read(&ring_ptr->ring_head)) {
+		tracering_slot_t *slot_ptr =
+			(tracering_slot_t *)(ring_ptr->ring_base + (tail & (tracering_ring_size - 1)));
+		u32 slot_flags = smp_load_acquire(&slot_ptr->slot_flags);
+		u32 slot_size = slot_ptr->slot_size;
+
+		if (!(slot_flags & TRACERING_SLOT_COMMITTED))
+			break;
+
+		if (!(slot_flags & TRACERING_SLOT_PAD)) {
+			nmdbg_fmt_rec_t rec = *(nmdbg_fmt_rec_t *)(slot_ptr + 1);
+			size_t rec_size = slot_size - sizeof(*slot_ptr);
+
+			if (copied + rec_size > count)
+				break;
+			/* The header goes out separately with the skew-corrected TSC */
+			rec.tsc = tracering_correct_tsc(rec.cpu, rec.tsc);
+			if (!!copy_to_user(ubuf + copied, &rec, sizeof(rec)) ||
+				!!copy_to_user(ubuf + copied + sizeof(rec), (u8 *)(slot_ptr + 1) + sizeof(rec),
+					rec_size - sizeof(rec)))
+				return -EFAULT;
+			copied += rec_size;
+		}
+
+		/*
+		 * Clear the consumed bytes, so a stale commit flag can never be seen
+		 * by the next lap which could split slots at different offsets.
+		 */
+		memset(slot_ptr, 0, slot_size);
+		tail += slot_size;
+		smp_store_release(&ring_ptr->ring_tail, tail);
+	}
+	return copied;
+}
+
+static ssize_t tracering_read(struct file *filp, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	nmdbg_fmt_file_t file_hdr;
+	unsigned int cpu, idx;
+	size_t copied = 0;
+	ssize_t ret;
+
+	mutex_lock(&tracering_read_lock);
+
+	if (*ppos == 0) {
+		if (count < sizeof(file_hdr)) {
+			ret = -EINVAL;
+			goto out_unlock;
+		}
+		memset(&file_hdr, 0, sizeof(file_hdr));
+		file_hdr.magic = NMDBG_FMT_MAGIC;
+		file_hdr.version = NMDBG_FMT_VERSION;
+		if (READ_ONCE(tracering_tsc_fn) != NULL)
+			file_hdr.flags |= NMDBG_FMT_FILE_TSC_CORRECTED;
+		file_hdr.tsc_khz = tsc_khz;
+		file_hdr.nr_cpus = num_possible_cpus();
+		file_hdr.hdr_size = sizeof(file_hdr);
+		if (!!copy_to_user(ubuf, &file_hdr, sizeof(file_hdr))) {
+			ret = -EFAULT;
+			goto out_unlock;
+		}
+		copied = sizeof(file_hdr);
+	}
+
+	/*
+	 * Start from a different CPU every time, so a busy CPU cannot starve the others.
+	 */
+	cpu = tracering_read_cpu;
+	for (idx = 0; idx < nr_cpu_ids; idx++, cpu = (cpu + 1) % nr_cpu_ids) {
+		if (!cpu_possible(cpu) || per_cpu(tracering_rings, cpu).ring_base == NULL)
+			continue;
+		ret = tracering_drain(per_cpu_ptr(&tracering_rings, cpu), ubuf + copied, count - copied);
+		if (ret < 0)
+			goto out_unlock;
+		copied += ret;
+	}
+	tracering_read_cpu = (tracering_read_cpu + 1) % nr_cpu_ids;
+
+	*ppos += copied;
+	ret = copied;
+
+out_unlock:
+	mutex_unlock(&tracering_read_lock);
+	return ret;
+}
+
+static const struct file_operations tracering_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = tracering_read,
+	.llseek = no_llseek,
+};
+
+int tracering_startup(size_t ring_size, struct dentry *debugfs_dir)
+{
+	unsigned int cpu;
+
+	if (!is_power_of_2(ring_size) || ring_size < PAGE_SIZE)
+		return -1;
+	tracering_ring_size = ring_size;
+
+	for_each_possible_cpu(cpu) {
+		tracering_ring_t *ring_ptr = per_cpu_ptr(&tracering_rings, cpu);
+		/*
+		 * Rings are written in the NMI context.
+		 * Use the linear mapping rather than vmalloc to never take a fault there.
+		 */
+		struct page *page = alloc_pages_node(cpu_to_node(cpu), GFP_KERNEL | __GFP_ZERO,
+			get_order(ring_size));
+
+		if (page == NULL)
+			goto err;
+
+		ring_ptr->ring_page = page;
+		local_set(&ring_ptr->ring_head, 0);
+		ring_ptr->ring_tail = 0;
+		local_set(&ring_ptr->nr_written, 0);
+		local_set(&ring_ptr->nr_dropped, 0);
+		smp_wmb();
+		WRITE_ONCE(ring_ptr->ring_base, page_address(page));
+	}
+
+	if (debugfs_dir != NULL) {
+		tracering_file = debugfs_create_file(TRACERING_FILE_NAME, 0400, debugfs_dir, NULL, &tracering_fops);
+		if (IS_ERR_OR_NULL(tracering_file)) {
+			tracering_file = NULL;
+			goto err;
+		}
+	}
+
+	pr_info("Attached the tracering subsystem successfully (%zu bytes per cpu)\n", ring_size);
+	return 0;
+
+err:
+	tracering_shutdown();
+	return -1;
+}
+
+void tracering_shutdown(void)
+{
+	unsigned int cpu;
+
+	debugfs_remove(tracering_file);
+	tracering_file = NULL;
+
+	for_each_possible_cpu(cpu)
+		WRITE_ONCE(per_cpu(tracering_rings, cpu).ring_base, NULL);
+	/*
+	 * Writers run with preemption disabled or in the NMI context,
+	 * so a grace period guarantees no writer still references a ring.
+	 */
+	synchronize_rcu();
+
+	for_each_possible_cpu(cpu) {
+		tracering_ring_t *ring_ptr = per_cpu_ptr(&tracering_rings, cpu);
+
+		if (ring_ptr->ring_page != NULL)
+			__free_pages(ring_ptr->ring_page, get_order(tracering_ring_size));
+		ring_ptr->ring_page = NULL;
+	}
+}
\ No newline at end of file
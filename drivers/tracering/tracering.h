@@ -0,0 +1,167 @@
+/**
+ * @file tracering.h
+ * @brief Prototypes for 'tracering subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'tracering subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_TRACERING_H
+#define _NMDBG_TRACERING_H
+
+#include <linux/types.h>
+#include <linux/dcache.h>
+#include <asm/ptrace.h>
+
+#include "define.h"
+#include "format.h"
+
+#define TRACERING_DEFAULT_SIZE (64 * 1024)
+#define TRACERING_FILE_NAME "trace"
+
+/**
+ * @brief Function to convert a TSC value read on a CPU into a common timebase.
+ */
+typedef u64 (*tracering_tsc_fn_t)(unsigned int cpu, u64 tsc);
+
+/**
+ * @brief Statistics of the trace rings.
+ */
+typedef struct {
+	/** Number of committed records */
+	u64 nr_written;
+	/** Number of records dropped because a ring was full */
+	u64 nr_dropped;
+} tracering_stat_t;
+
+/**
+ * @brief Activate the tracering subsys.
+ *
+ * This function allocates a ring for each possible CPU and creates a debugfs file to drain them.
+ * Reading the file yields an nmdbg stream (format.h) which nmdbg-decode understands.
+ *
+ * @param ring_size
+ * 	size of a per-cpu ring (bytes, power of 2)
+ * @param debugfs_dir
+ * 	debugfs directory to create the file in (NULL to skip)
+ * @return
+ * 	0 if activation success.
+ */
+int tracering_startup(size_t ring_size, struct dentry *debugfs_dir);
+
+/**
+ * @brief Deactivate the tracering subsys.
+ */
+void tracering_shutdown(void);
+
+/**
+ * @brief Reserve a record in the ring of the current CPU.
+ *
+ * This is lock-free and safe in any context including NMI, as long as the caller cannot migrate.
+ * Nested writers (e.g. an NMI interrupting a writer) get distinct records.
+ * The common header is filled here; the caller fills the payload then calls tracering_commit().
+ *
+ * @param type
+ * 	record type (nmdbg_fmt_rec_type_t)
+ * @param size
+ * 	record size including the common header
+ * @return
+ * 	the reserved record, or NULL if the ring is full or not activated.
+ */
+nmdbg_fmt_rec_t *tracering_reserve(u16 type, u32 size);
+
+/**
+ * @brief Publish a reserved record to readers.
+ *
+ * @param rec
+ * 	record returned by tracering_reserve()
+ */
+void tracering_commit(nmdbg_fmt_rec_t *rec);
+
+/**
+ * @brief Fill a register snapshot from the interrupted context.
+ *
+ * @param regs_rec
+ * 	register snapshot to be filled (including the common header)
+ * @param reason
+ * 	one of nmdbg_fmt_regs_reason_t
+ * @param regs
+ * 	interrupted registers
+ */
+void tracering_fill_regs(nmdbg_fmt_regs_rec_t *regs_rec, u32 reason, const struct pt_regs *regs);
+
+/**
+ * @brief Write a register snapshot into the ring of the current CPU.
+ *
+ * @param reason
+ * 	one of nmdbg_fmt_regs_reason_t
+ * @param regs
+ * 	interrupted registers
+ * @return
+ * 	0 if the snapshot was written.
+ */
+int tracering_write_regs(u32 reason, const struct pt_regs *regs);
+
+/**
+ * @brief Write a trace sample into the ring of the current CPU.
+ *
+ * @param id
+ * 	producer-defined identifier
+ * @param ip
+ * 	instruction pointer of the sample
+ * @param arg
+ * 	producer-defined argument
+ * @return
+ * 	0 if the sample was written.
+ */
+int tracering_write_sample(u32 id, u64 ip, u64 arg);
+
+/**
+ * @brief Write a hardware watchpoint hit into the ring of the current CPU.
+ *
+ * @param slot
+ * 	debug register slot which hit
+ * @param ip
+ * 	instruction pointer after the access
+ * @param addr
+ * 	watched address
+ * @return
+ * 	0 if the hit was written.
+ */
+int tracering_write_watch(u32 slot, u64 ip, u64 addr);
+
+/**
+ * @brief Set the function which skew-corrects record TSCs on output.
+ *
+ * Records keep the raw TSC in the ring; the correction applies when they are drained,
+ * so a newer estimate also fixes records captured before it.
+ *
+ * @param tsc_fn
+ * 	correction function (NULL to output raw TSCs)
+ */
+void tracering_set_tsc_fn(tracering_tsc_fn_t tsc_fn);
+
+/**
+ * @brief Convert a TSC value read on a CPU with the current correction function.
+ *
+ * @param cpu
+ * 	CPU which read @p tsc
+ * @param tsc
+ * 	raw TSC value
+ * @return
+ * 	the corrected TSC value, or @p tsc if no correction function is set.
+ */
+u64 tracering_correct_tsc(unsigned int cpu, u64 tsc);
+
+/**
+ * @brief Get the statistics of all rings.
+ *
+ * @param stat
+ * 	statistics to be filled
+ */
+void tracering_get_stat(tracering_stat_t *stat);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,410 @@
+/**
+ * @file tscsync.c
+ * @brief The tscsync subsystem.
+ *
+ * This is implementations of 'tscsync subsystem'
+ *
+ * Both sides of an exchange spin inside an NMI, so neither an interrupt nor preemption
+ * can stretch a round trip and bias the estimate.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "tscsync.h"
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <asm/tsc.h>
+
+#include "define.h"
+
+#define TSCSYNC_EXCHANGE_HANDLER_NAME "tscsync_exchange"
+
+/* Maximum time a CPU waits for its peer inside the NMI (millisec) */
+#define TSCSYNC_NMI_TIMEOUT_MS 100
+/* Maximum time to wait for a rendezvous (microsec) */
+#define TSCSYNC_SYNC_TIMEOUT 1000000
+
+/**
+ * @brief Internal line shared by the reference CPU and the target being served.
+ */
+typedef struct {
+	/** Odd values are written by the reference, even values by the target */
+	u64 seq;
+	/** TSC of the target at the last exchange */
+	u64 target_tsc;
+} ____cacheline_aligned tscsync_line_t;
+
+/**
+ * @brief Internal per-cpu result of the last rendezvous (written by the reference CPU).
+ */
+typedef struct {
+	s64 best_offset;
+	s64 min_offset;
+	s64 max_offset;
+	u64 min_rtt;
+	int valid;
+} tscsync_sample_t;
+
+static DEFINE_PER_CPU(tscsync_entry_t, tscsync_table);
+static DEFINE_PER_CPU(tscsync_sample_t, tscsync_samples);
+
+/* Rendezvous state, protected by 'tscsync_measure_lock' */
+static DEFINE_MUTEX(tscsync_measure_lock);
+static tscsync_line_t tscsync_line;
+static cpumask_t tscsync_target_mask;
+static cpumask_t tscsync_rendezvous_mask;
+static unsigned int tscsync_ref_cpu = 0;
+static unsigned int tscsync_turn = 0;
+static unsigned int tscsync_rounds = TSCSYNC_DEFAULT_ROUNDS;
+static u64 tscsync_timeout_cycles = 0;
+static atomic_t tscsync_nr_done = ATOMIC_INIT(0);
+
+static struct dentry *tscsync_file = NULL;
+static int tscsync_active = 0;
+
+/**
+ * @brief Internal function to spin until @p ptr holds @p val.
+ *
+ * No 'pause' in the loop; it would stretch every round trip.
+ */
+static __always_inline int tscsync_wait(const u64 *ptr, u64 val, u64 deadline)
+{
+	unsigned int spins = 0;
+
+	while (READ_ONCE(*ptr) != val) {
+		if (unlikely(!(++spins & 0xfff)) && rdtsc() > deadline)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal function to serve a single target from the reference CPU.
+ */
+static void tscsync_serve(unsigned int cpu)
+{
+	tscsync_sample_t *sample = per_cpu_ptr(&tscsync_samples, cpu);
+	u64 deadline = rdtsc() + tscsync_timeout_cycles;
+	unsigned int round;
+
+	sample->valid = 0;
+	sample->min_rtt = U64_MAX;
+	sample->min_offset = S64_MAX;
+	sample->max_offset = S64_MIN;
+
+	WRITE_ONCE(tscsync_line.seq, 0);
+	smp_wmb();
+	WRITE_ONCE(tscsync_turn, cpu);
+
+	/* The target announces itself with 1 */
+	if (!!tscsync_wait(&tscsync_line.seq, 1, deadline))
+		return;
+
+	for (round = 0; round < tscsync_rounds; round++) {
+		u64 t0, t1, t2, rtt;
+		s64 offset;
+
+		t0 = rdtsc_ordered();
+		WRITE_ONCE(tscsync_line.seq, 2 * round + 2);
+		if (!!tscsync_wait(&tscsync_line.seq, 2 * round + 3, deadline))
+			return;
+		t2 = rdtsc_ordered();
+		smp_rmb();
+		t1 = READ_ONCE(tscsync_line.target_tsc);
+
+		rtt = t2 - t0;
+		offset = (s64)(t1 - t0) - (s64)(rtt / 2);
+		if (rtt < sample->min_rtt) {
+			sample->min_rtt = rtt;
+			sample->best_offset = offset;
+		}
+		sample->min_offset = min(sample->min_offset, offset);
+		sample->max_offset = max(sample->max_offset, offset);
+	}
+	sample->valid = 1;
+}
+
+/**
+ * @brief Internal NMI function to take part in a rendezvous.
+ *
+ * The reference CPU serves every target of 'tscsync_target_mask' in turn;
+ * a target waits for its turn, then answers every exchange with its own TSC.
+ */
+static nmictrl_ret_t tscsync_exchange_nmifn(struct pt_regs *regs)
+{
+	unsigned int this_cpu = raw_smp_processor_id();
+	u64 deadline = rdtsc() + tscsync_timeout_cycles;
+	unsigned int cpu, round;
+
+	if (this_cpu == tscsync_ref_cpu) {
+		for_each_cpu(cpu, &tscsync_target_mask)
+			tscsync_serve(cpu);
+		WRITE_ONCE(tscsync_turn, nr_cpu_ids);
+		goto out;
+	}
+
+	/* Every target waiting in line shares the timeout of the whole rendezvous */
+	deadline += tscsync_timeout_cycles * cpumask_weight(&tscsync_target_mask);
+	while (READ_ONCE(tscsync_turn) != this_cpu) {
+		cpu_relax();
+		if (rdtsc() > deadline)
+			goto out;
+	}
+	smp_rmb();
+	WRITE_ONCE(tscsync_line.seq, 1);
+
+	deadline = rdtsc() + tscsync_timeout_cycles;
+	for (round = 0; round < tscsync_rounds; round++) {
+		if (!!tscsync_wait(&tscsync_line.seq, 2 * round + 2, deadline))
+			goto out;
+		WRITE_ONCE(tscsync_line.target_tsc, rdtsc_ordered());
+		smp_wmb();
+		WRITE_ONCE(tscsync_line.seq, 2 * round + 3);
+	}
+
+out:
+	smp_mb__before_atomic();
+	atomic_inc(&tscsync_nr_done);
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to run a rendezvous of the reference CPU and @p target_mask.
+ *
+ * 'tscsync_measure_lock' must be held.
+ */
+static int tscsync_rendezvous_locked(const struct cpumask *target_mask)
+{
+	unsigned long timeout = TSCSYNC_SYNC_TIMEOUT * cpumask_weight(target_mask);
+	unsigned int cpu;
+
+	if (cpumask_empty(target_mask))
+		return 0;
+
+	cpumask_copy(&tscsync_target_mask, target_mask);
+	cpumask_copy(&tscsync_rendezvous_mask, target_mask);
+	cpumask_set_cpu(tscsync_ref_cpu, &tscsync_rendezvous_mask);
+	WRITE_ONCE(tscsync_turn, nr_cpu_ids);
+	atomic_set(&tscsync_nr_done, 0);
+	smp_wmb();
+
+	for_each_cpu(cpu, &tscsync_rendezvous_mask)
+		nmictrl_prepare_handler(TSCSYNC_EXCHANGE_HANDLER_NAME, cpu);
+	nmictrl_trigger_mask(&tscsync_rendezvous_mask);
+
+	while (atomic_read(&tscsync_nr_done) != cpumask_weight(&tscsync_rendezvous_mask)) {
+		if (!timeout--)
+			return -1;
+		udelay(1);
+	}
+	smp_rmb();
+	return 0;
+}
+
+int tscsync_measure(tscsync_mode_t mode, unsigned int rounds)
+{
+	cpumask_t target_mask;
+	unsigned int cpu, nr_failed = 0;
+	int ret = -1;
+
+	if (rounds == 0 || (mode != TSCSYNC_MODE_PAIR && mode != TSCSYNC_MODE_ALL))
+		return -1;
+
+	mutex_lock(&tscsync_measure_lock);
+	if (!tscsync_active)
+		goto out_unlock;
+
+	get_online_cpus();
+
+	tscsync_rounds = rounds;
+	tscsync_timeout_cycles = (u64)tsc_khz * TSCSYNC_NMI_TIMEOUT_MS;
+	tscsync_ref_cpu = cpumask_first(cpu_online_mask);
+	cpumask_copy(&target_mask, cpu_online_mask);
+	cpumask_clear_cpu(tscsync_ref_cpu, &target_mask);
+
+	for_each_cpu(cpu, &target_mask)
+		per_cpu(tscsync_samples, cpu).valid = 0;
+
+	if (mode == TSCSYNC_MODE_ALL) {
+		if (!!tscsync_rendezvous_locked(&target_mask))
+			goto out_put;
+	} else {
+		for_each_cpu(cpu, &target_mask)
+			if (!!tscsync_rendezvous_locked(cpumask_of(cpu)))
+				goto out_put;
+	}
+
+	/* The reference CPU defines the timebase */
+	per_cpu(tscsync_table, tscsync_ref_cpu).jitter = 0;
+	per_cpu(tscsync_table, tscsync_ref_cpu).rtt = 0;
+	WRITE_ONCE(per_cpu(tscsync_table, tscsync_ref_cpu).offset, 0);
+	WRITE_ONCE(per_cpu(tscsync_table, tscsync_ref_cpu).valid, 1);
+
+	for_each_cpu(cpu, &target_mask) {
+		tscsync_sample_t *sample = per_cpu_ptr(&tscsync_samples, cpu);
+		tscsync_entry_t *entry = per_cpu_ptr(&tscsync_table, cpu);
+
+		if (!sample->valid) {
+			nr_failed++;
+			continue;
+		}
+		entry->jitter = sample->max_offset - sample->min_offset;
+		entry->rtt = sample->min_rtt;
+		WRITE_ONCE(entry->offset, sample->best_offset);
+		smp_wmb();
+		WRITE_ONCE(entry->valid, 1);
+	}
+
+	pr_info("Measured the TSC skew of %u cpus against CPU %u (%s, %u rounds, %u failed)\n",
+		cpumask_weight(&target_mask), tscsync_ref_cpu,
+		(mode == TSCSYNC_MODE_ALL) ? "all" : "pair", rounds, nr_failed);
+	ret = !!nr_failed ? -1 : 0;
+
+out_put:
+	put_online_cpus();
+out_unlock:
+	mutex_unlock(&tscsync_measure_lock);
+	return ret;
+}
+
+void tscsync_get_entry(unsigned int cpu, tscsync_entry_t *entry)
+{
+	memcpy(entry, per_cpu_ptr(&tscsync_table, cpu), sizeof(*entry));
+}
+
+u64 tscsync_correct(unsigned int cpu, u64 tsc)
+{
+	tscsync_entry_t *entry;
+
+	if (cpu >= nr_cpu_ids)
+		return tsc;
+	entry = per_cpu_ptr(&tscsync_table, cpu);
+	if (!READ_ONCE(entry->valid))
+		return tsc;
+	smp_rmb();
+	return tsc - READ_ONCE(entry->offset);
+}
+
+static ssize_t tscsync_read(struct file *filp, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	size_t size = 64 + (size_t)num_possible_cpus() * 64;
+	unsigned int cpu;
+	ssize_t ret;
+	size_t len = 0;
+	char *buf = kmalloc(size, GFP_KERNEL);
+
+	if (buf == NULL)
+		return -ENOMEM;
+
+	len += scnprintf(buf + len, size - len, "%4s %20s %12s %12s\n", "cpu", "offset", "jitter", "rtt");
+	for_each_possible_cpu(cpu) {
+		tscsync_entry_t entry;
+
+		tscsync_get_entry(cpu, &entry);
+		if (!entry.valid)
+			continue;
+		len += scnprintf(buf + len, size - len, "%4u %20lld %12llu %12llu\n",
+			cpu, entry.offset, entry.jitter, entry.rtt);
+	}
+
+	ret = simple_read_from_buffer(ubuf, count, ppos, buf, len);
+	kfree(buf);
+	return ret;
+}
+
+/**
+ * @brief Internal function to parse a control command.
+ *
+ * 'pair [rounds]' or 'all [rounds]' runs a new measurement.
+ */
+static ssize_t tscsync_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char buf[32], mode_buf[8];
+	unsigned int rounds = TSCSYNC_DEFAULT_ROUNDS;
+	tscsync_mode_t mode;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (!!copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%7s %u", mode_buf, &rounds) < 1)
+		return -EINVAL;
+	if (strcmp(mode_buf, "pair") == 0)
+		mode = TSCSYNC_MODE_PAIR;
+	else if (strcmp(mode_buf, "all") == 0)
+		mode = TSCSYNC_MODE_ALL;
+	else
+		return -EINVAL;
+
+	return !tscsync_measure(mode, rounds) ? count : -EIO;
+}
+
+static const struct file_operations tscsync_fops = {
+	.owner = THIS_MODULE,
+	.read = tscsync_read,
+	.write = tscsync_write,
+	.llseek = default_llseek,
+};
+
+int tscsync_startup(struct dentry *debugfs_dir)
+{
+	unsigned int cpu;
+
+	if (!!tscsync_active)
+		return -1;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&tscsync_table, cpu), 0, sizeof(tscsync_entry_t));
+
+	if (!!nmictrl_add_handler(TSCSYNC_EXCHANGE_HANDLER_NAME, &tscsync_exchange_nmifn))
+		return -1;
+
+	if (debugfs_dir != NULL) {
+		tscsync_file = debugfs_create_file(TSCSYNC_FILE_NAME, 0600, debugfs_dir, NULL, &tscsync_fops);
+		if (IS_ERR_OR_NULL(tscsync_file)) {
+			tscsync_file = NULL;
+			nmictrl_del_handler(TSCSYNC_EXCHANGE_HANDLER_NAME);
+			return -1;
+		}
+	}
+
+	mutex_lock(&tscsync_measure_lock);
+	tscsync_active = 1;
+	mutex_unlock(&tscsync_measure_lock);
+	return 0;
+}
+
+void tscsync_shutdown(void)
+{
+	unsigned int cpu;
+
+	mutex_lock(&tscsync_measure_lock);
+	if (!tscsync_active) {
+		mutex_unlock(&tscsync_measure_lock);
+		return;
+	}
+	tscsync_active = 0;
+	mutex_unlock(&tscsync_measure_lock);
+
+	debugfs_remove(tscsync_file);
+	tscsync_file = NULL;
+
+	for_each_possible_cpu(cpu)
+		WRITE_ONCE(per_cpu(tscsync_table, cpu).valid, 0);
+
+	nmictrl_del_handler(TSCSYNC_EXCHANGE_HANDLER_NAME);
+}
\ No newline at end of file
@@ -0,0 +1,109 @@
+/**
+ * @file tscsync.h
+ * @brief Prototypes for 'tscsync subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'tscsync subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_TSCSYNC_H
+#define _NMDBG_TSCSYNC_H
+
+#include <linux/types.h>
+#include <linux/dcache.h>
+
+#include "nmictrl.h"
+
+#define TSCSYNC_DEFAULT_ROUNDS 64
+#define TSCSYNC_FILE_NAME "tscsync"
+
+/**
+ * @brief Rendezvous modes.
+ */
+typedef enum {
+	/** One rendezvous per CPU, with the reference CPU only */
+	TSCSYNC_MODE_PAIR = 0,
+	/** A single rendezvous of all online CPUs; the reference CPU serves them in turn */
+	TSCSYNC_MODE_ALL,
+} tscsync_mode_t;
+
+/**
+ * @brief Skew estimate of a CPU against the reference CPU.
+ */
+typedef struct {
+	/** TSC of the CPU minus TSC of the reference CPU (cycles) */
+	s64 offset;
+	/** Spread of the per-round offset estimates (cycles) */
+	u64 jitter;
+	/** Shortest round trip of the exchange; bounds the error of 'offset' to a half of it (cycles) */
+	u64 rtt;
+	/** Measured or not */
+	int valid;
+} tscsync_entry_t;
+
+/**
+ * @brief Activate the tscsync subsys.
+ *
+ * This function registers the exchange handler to the nmictrl coresys.
+ * The nmictrl coresys must be started before.
+ *
+ * @param debugfs_dir
+ * 	debugfs directory to create the table file in (NULL to skip)
+ * @return
+ * 	0 if activation success.
+ */
+int tscsync_startup(struct dentry *debugfs_dir);
+
+/**
+ * @brief Deactivate the tscsync subsys.
+ *
+ * This function must be called before the nmictrl coresys shuts down.
+ */
+void tscsync_shutdown(void);
+
+/**
+ * @brief Measure the TSC offset of every online CPU against the first online CPU.
+ *
+ * Each round is an NTP-like exchange inside an NMI:
+ * the reference CPU sends its TSC, the target answers with its own, and the reference reads the TSC again.
+ * The offset of the round with the shortest round trip is kept.
+ * The table is replaced only when the whole measurement finished.
+ *
+ * @param mode
+ * 	one of tscsync_mode_t
+ * @param rounds
+ * 	number of exchanges per CPU
+ * @return
+ * 	0 if every online CPU was measured.
+ */
+int tscsync_measure(tscsync_mode_t mode, unsigned int rounds);
+
+/**
+ * @brief Get the skew estimate of a CPU.
+ *
+ * @param cpu
+ * 	CPU to look up
+ * @param entry
+ * 	estimate to be filled
+ */
+void tscsync_get_entry(unsigned int cpu, tscsync_entry_t *entry);
+
+/**
+ * @brief Convert a TSC value read on a CPU into the timebase of the reference CPU.
+ *
+ * This is lock-free and safe in any context.
+ * Values of unmeasured CPUs are returned as they are.
+ *
+ * @param cpu
+ * 	CPU which read @p tsc
+ * @param tsc
+ * 	raw TSC value
+ * @return
+ * 	the skew-corrected TSC value.
+ */
+u64 tscsync_correct(unsigned int cpu, u64 tsc);
+
+#endif
\ No newline at end of file
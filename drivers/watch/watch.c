@@ -0,0 +1,523 @@
+/**
+ * @file watch.c
+ * @brief The watch subsystem.
+ *
+ * This is implementations of 'watch subsystem'
+ *
+ * The debug registers of all CPUs are reprogrammed by a single nmictrl broadcast
+ * instead of per-CPU IPIs or stop_machine; each CPU copies the shared slot table
+ * into its own registers from the NMI context.
+ * Hits raise a debug exception (#DB) on the accessing CPU, which is recorded into
+ * the per-cpu trace ring of that CPU.
+ *
+ * All debug registers are claimed from the hw_breakpoint framework at startup with disabled placeholders,
+ * so perf, ptrace and kgdb breakpoints can neither take them nor be clobbered by them.
+ * Armed slots are mirrored into the kernel's per-cpu copies of DR0-DR3 and DR7,
+ * which hw_breakpoint_restore() reloads after a VM exit.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "watch.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/hw_breakpoint.h>
+#include <linux/kallsyms.h>
+#include <linux/kdebug.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+#include <linux/delay.h>
+#include <linux/uaccess.h>
+#include <asm/debugreg.h>
+#include <asm/processor.h>
+
+#include "define.h"
+
+#define WATCH_PROGRAM_HANDLER_NAME "watch_program"
+
+/* Maximum time to wait for all CPUs to reprogram their debug registers (microsec) */
+#define WATCH_SYNC_TIMEOUT 10000
+
+/**
+ * @brief Internal structure for a watchpoint slot.
+ */
+typedef struct {
+	/** Watched address */
+	unsigned long addr;
+	/** DR7 control bits of the slot (R/W and LEN fields, unshifted) */
+	unsigned long ctrl;
+	/** Armed or not */
+	int armed;
+} watch_slot_t;
+
+/**
+ * @brief Internal per-cpu state of the watchpoints.
+ */
+typedef struct {
+	/** Generation of the slot table applied to this CPU */
+	unsigned long gen;
+	/** Slots armed on this CPU */
+	unsigned long armed_mask;
+	/** Addresses programmed into DR0-DR3 of this CPU */
+	unsigned long addr[WATCH_NR_SLOTS];
+	/** Statistics (written by the owner only) */
+	u64 nr_hits[WATCH_NR_SLOTS];
+	u64 nr_dropped;
+	u64 nr_updates;
+} watch_cpu_t;
+
+static DEFINE_PER_CPU(watch_cpu_t, watch_cpus);
+
+/* Slot table, protected by 'watch_update_lock' and read by the programming handler */
+static DEFINE_MUTEX(watch_update_lock);
+static watch_slot_t watch_slots[WATCH_NR_SLOTS];
+static unsigned long watch_dr7 = 0;
+static unsigned long watch_gen = 0;
+
+/* Placeholders claiming the debug registers from the hw_breakpoint framework */
+static struct perf_event * __percpu *watch_placeholders[WATCH_NR_SLOTS];
+/* The kernel's per-cpu copy of DR0-DR3; DR7 is 'cpu_dr7' */
+static unsigned long __percpu *watch_cpu_debugreg = NULL;
+
+static struct dentry *watch_file = NULL;
+static int watch_hooked = 0;
+
+/**
+ * @brief Internal NMI function to load the slot table into the debug registers.
+ */
+static nmictrl_ret_t watch_program_nmifn(struct pt_regs *regs)
+{
+	watch_cpu_t *self = this_cpu_ptr(&watch_cpus);
+	unsigned long armed_mask = 0;
+	unsigned int slot;
+
+	/* Disable all slots first, so no slot ever fires with a stale address */
+	this_cpu_write(cpu_dr7, 0UL);
+	set_debugreg(0UL, 7);
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++) {
+		if (!watch_slots[slot].armed) {
+			self->addr[slot] = 0;
+			continue;
+		}
+		this_cpu_write(watch_cpu_debugreg[slot], watch_slots[slot].addr);
+		set_debugreg(watch_slots[slot].addr, slot);
+		self->addr[slot] = watch_slots[slot].addr;
+		armed_mask |= DR_TRAP0 << slot;
+	}
+	self->armed_mask = armed_mask;
+	this_cpu_write(cpu_dr7, watch_dr7);
+	set_debugreg(watch_dr7, 7);
+
+	self->nr_updates++;
+	smp_store_release(&self->gen, READ_ONCE(watch_gen));
+	return NMICTRL_HANDLED;
+}
+
+/**
+ * @brief Internal function to handle debug exceptions caused by armed slots.
+ *
+ * @param nb
+ * 	Unused
+ * @param val
+ * 	die event
+ * @param data
+ * 	struct die_args of the event; 'err' points to the DR6 value read by the kernel
+ * @return
+ * 	NOTIFY_STOP if the exception was caused only by armed slots. If not, NOTIFY_DONE.
+ */
+static int watch_die_notify(struct notifier_block *nb, unsigned long val, void *data)
+{
+	struct die_args *args = data;
+	watch_cpu_t *self = this_cpu_ptr(&watch_cpus);
+	unsigned long *dr6_ptr, hit_mask, dr7;
+	unsigned int slot;
+
+	if (val != DIE_DEBUG)
+		return NOTIFY_DONE;
+
+	dr6_ptr = (unsigned long *)ERR_PTR(args->err);
+	/* TRAP bits are undefined on a single step */
+	if (*dr6_ptr & DR_STEP)
+		return NOTIFY_DONE;
+
+	hit_mask = *dr6_ptr & self->armed_mask;
+	if (!hit_mask)
+		return NOTIFY_DONE;
+
+	/* Never recurse if a slot watches memory touched below */
+	get_debugreg(dr7, 7);
+	set_debugreg(0UL, 7);
+
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++) {
+		if (!(hit_mask & (DR_TRAP0 << slot)))
+			continue;
+		self->nr_hits[slot]++;
+		if (!!tracering_write_watch(slot, args->regs->ip, self->addr[slot]))
+			self->nr_dropped++;
+	}
+
+	*dr6_ptr &= ~hit_mask;
+	current->thread.debugreg6 &= ~hit_mask;
+
+	set_debugreg(dr7, 7);
+
+	return !!(*dr6_ptr & DR_TRAP_BITS) ? NOTIFY_DONE : NOTIFY_STOP;
+}
+
+static struct notifier_block watch_die_nb = {
+	.notifier_call = watch_die_notify,
+	.priority = INT_MAX,
+};
+
+/**
+ * @brief Internal function to install the debug exception hook ahead of the kernel's own.
+ *
+ * The kernel's hw_breakpoint handler also sits at the highest priority and consumes every TRAP bit
+ * it sees, including the ones of slots it does not own; a notifier of equal priority is appended
+ * after it and would never see a hit.
+ * So the hook is linked at the head of the die chain under the chain lock, the same way
+ * atomic_notifier_chain_register() links entries.
+ */
+static int watch_hook_die_chain(void)
+{
+	struct atomic_notifier_head *die_chain =
+		(struct atomic_notifier_head *)kallsyms_lookup_name("die_chain");
+	unsigned long flags;
+
+	if (die_chain == NULL)
+		return -1;
+
+	spin_lock_irqsave(&die_chain->lock, flags);
+	watch_die_nb.next = die_chain->head;
+	rcu_assign_pointer(die_chain->head, &watch_die_nb);
+	spin_unlock_irqrestore(&die_chain->lock, flags);
+	return 0;
+}
+
+/**
+ * @brief Internal function to claim every debug register from the hw_breakpoint framework.
+ *
+ * A disabled wide breakpoint is never installed, but it still takes a slot of every CPU,
+ * the same way kgdb reserves its slots.
+ * It fails if perf, ptrace or kgdb already own a slot.
+ */
+static int watch_reserve_slots(void)
+{
+	struct perf_event_attr attr;
+	unsigned int slot;
+
+	hw_breakpoint_init(&attr);
+	attr.bp_addr = (unsigned long)&watch_gen;
+	attr.bp_len = HW_BREAKPOINT_LEN_1;
+	attr.bp_type = HW_BREAKPOINT_W;
+	attr.disabled = 1;
+
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++) {
+		watch_placeholders[slot] = register_wide_hw_breakpoint(&attr, NULL, NULL);
+		if (IS_ERR(watch_placeholders[slot])) {
+			watch_placeholders[slot] = NULL;
+			goto err;
+		}
+	}
+	return 0;
+
+err:
+	pr_warn("Failed to claim the debug registers; hardware breakpoints are in use\n");
+	while (slot--) {
+		unregister_wide_hw_breakpoint(watch_placeholders[slot]);
+		watch_placeholders[slot] = NULL;
+	}
+	return -1;
+}
+
+/**
+ * @brief Internal function to give the debug registers back to the hw_breakpoint framework.
+ */
+static void watch_release_slots(void)
+{
+	unsigned int slot;
+
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++) {
+		if (watch_placeholders[slot] == NULL)
+			continue;
+		unregister_wide_hw_breakpoint(watch_placeholders[slot]);
+		watch_placeholders[slot] = NULL;
+	}
+}
+
+/**
+ * @brief Internal function to compute DR7 from the slot table.
+ */
+static unsigned long watch_encode_dr7(void)
+{
+	unsigned long dr7 = 0;
+	unsigned int slot;
+
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++) {
+		if (!watch_slots[slot].armed)
+			continue;
+		dr7 |= watch_slots[slot].ctrl << (DR_CONTROL_SHIFT + slot * DR_CONTROL_SIZE);
+		dr7 |= DR_GLOBAL_ENABLE << (slot * DR_ENABLE_SIZE);
+	}
+	if (!!dr7)
+		dr7 |= DR_GLOBAL_SLOWDOWN;
+	return dr7;
+}
+
+/**
+ * @brief Internal function to broadcast the slot table to all online CPUs and wait for them.
+ *
+ * 'watch_update_lock' must be held.
+ */
+static int watch_broadcast_locked(void)
+{
+	unsigned long timeout = WATCH_SYNC_TIMEOUT;
+	unsigned long gen;
+	unsigned int cpu;
+
+	watch_dr7 = watch_encode_dr7();
+	gen = watch_gen + 1;
+	smp_wmb();
+	WRITE_ONCE(watch_gen, gen);
+
+	for_each_online_cpu(cpu)
+		nmictrl_prepare_handler(WATCH_PROGRAM_HANDLER_NAME, cpu);
+	nmictrl_trigger_all();
+
+	for_each_online_cpu(cpu) {
+		while (smp_load_acquire(&per_cpu(watch_cpus, cpu).gen) != gen) {
+			if (!timeout--) {
+				pr_warn("Failed to reprogram the debug registers of CPU %u\n", cpu);
+				return -1;
+			}
+			udelay(1);
+		}
+	}
+	return 0;
+}
+
+int watch_set(unsigned int slot, unsigned long addr, unsigned int len, watch_type_t type)
+{
+	unsigned long ctrl;
+	int ret;
+
+	if (slot >= WATCH_NR_SLOTS || !IS_ALIGNED(addr, len))
+		return -1;
+
+	switch (len) {
+	case 1:
+		ctrl = DR_LEN_1;
+		break;
+	case 2:
+		ctrl = DR_LEN_2;
+		break;
+	case 4:
+		ctrl = DR_LEN_4;
+		break;
+	case 8:
+		ctrl = DR_LEN_8;
+		break;
+	default:
+		return -1;
+	}
+
+	switch (type) {
+	case WATCH_TYPE_WRITE:
+		ctrl |= DR_RW_WRITE;
+		break;
+	case WATCH_TYPE_RW:
+		ctrl |= DR_RW_READ;
+		break;
+	default:
+		return -1;
+	}
+
+	mutex_lock(&watch_update_lock);
+	if (!watch_hooked) {
+		mutex_unlock(&watch_update_lock);
+		return -1;
+	}
+	watch_slots[slot].addr = addr;
+	watch_slots[slot].ctrl = ctrl;
+	watch_slots[slot].armed = 1;
+	ret = watch_broadcast_locked();
+	mutex_unlock(&watch_update_lock);
+
+	if (!ret)
+		pr_info("Armed watchpoint %u (addr: %p, len: %u, type: %s)\n",
+			slot, (void *)addr, len, (type == WATCH_TYPE_WRITE) ? "w" : "rw");
+	return ret;
+}
+
+int watch_clear(unsigned int slot)
+{
+	int ret;
+
+	if (slot >= WATCH_NR_SLOTS)
+		return -1;
+
+	mutex_lock(&watch_update_lock);
+	if (!watch_hooked || !watch_slots[slot].armed) {
+		mutex_unlock(&watch_update_lock);
+		return 0;
+	}
+	watch_slots[slot].armed = 0;
+	ret = watch_broadcast_locked();
+	mutex_unlock(&watch_update_lock);
+	return ret;
+}
+
+void watch_get_stat(watch_stat_t *stat)
+{
+	unsigned int cpu, slot;
+
+	memset(stat, 0, sizeof(*stat));
+	for_each_possible_cpu(cpu) {
+		watch_cpu_t *peer = per_cpu_ptr(&watch_cpus, cpu);
+
+		for (slot = 0; slot < WATCH_NR_SLOTS; slot++)
+			stat->nr_hits[slot] += READ_ONCE(peer->nr_hits[slot]);
+		stat->nr_dropped += READ_ONCE(peer->nr_dropped);
+		stat->nr_updates += READ_ONCE(peer->nr_updates);
+	}
+}
+
+static ssize_t watch_read(struct file *filp, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char buf[WATCH_NR_SLOTS * 80 + 80];
+	watch_stat_t stat;
+	unsigned int slot;
+	int len = 0;
+
+	watch_get_stat(&stat);
+
+	mutex_lock(&watch_update_lock);
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++) {
+		if (!watch_slots[slot].armed) {
+			len += scnprintf(buf + len, sizeof(buf) - len, "%u: -\n", slot);
+			continue;
+		}
+		len += scnprintf(buf + len, sizeof(buf) - len, "%u: 0x%lx ctrl 0x%lx hits %llu\n",
+			slot, watch_slots[slot].addr, watch_slots[slot].ctrl, stat.nr_hits[slot]);
+	}
+	mutex_unlock(&watch_update_lock);
+	len += scnprintf(buf + len, sizeof(buf) - len, "dropped %llu updates %llu\n",
+		stat.nr_dropped, stat.nr_updates);
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+/**
+ * @brief Internal function to parse a control command.
+ *
+ * 'set <slot> <addr> <len> <w|rw>' arms a slot, 'clear <slot>' disarms it.
+ */
+static ssize_t watch_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char buf[80], type_buf[4];
+	unsigned int slot, len;
+	unsigned long addr;
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (!!copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "set %u %lx %u %3s", &slot, &addr, &len, type_buf) == 4) {
+		if (strcmp(type_buf, "w") == 0)
+			ret = watch_set(slot, addr, len, WATCH_TYPE_WRITE);
+		else if (strcmp(type_buf, "rw") == 0)
+			ret = watch_set(slot, addr, len, WATCH_TYPE_RW);
+		else
+			return -EINVAL;
+	} else if (sscanf(buf, "clear %u", &slot) == 1) {
+		ret = watch_clear(slot);
+	} else {
+		return -EINVAL;
+	}
+
+	return !ret ? count : -EIO;
+}
+
+static const struct file_operations watch_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = watch_read,
+	.write = watch_write,
+	.llseek = no_llseek,
+};
+
+int watch_startup(struct dentry *debugfs_dir)
+{
+	if (!!watch_hooked)
+		return -1;
+
+	memset(watch_slots, 0, sizeof(watch_slots));
+	watch_dr7 = 0;
+
+	watch_cpu_debugreg = (unsigned long __percpu *)kallsyms_lookup_name("cpu_debugreg");
+	if (watch_cpu_debugreg == NULL)
+		return -1;
+
+	if (!!watch_reserve_slots())
+		return -1;
+
+	if (!!nmictrl_add_handler(WATCH_PROGRAM_HANDLER_NAME, &watch_program_nmifn))
+		goto err_release_slots;
+
+	if (!!watch_hook_die_chain()) {
+		nmictrl_del_handler(WATCH_PROGRAM_HANDLER_NAME);
+		goto err_release_slots;
+	}
+	watch_hooked = 1;
+
+	if (debugfs_dir != NULL) {
+		watch_file = debugfs_create_file(WATCH_FILE_NAME, 0600, debugfs_dir, NULL, &watch_fops);
+		if (IS_ERR_OR_NULL(watch_file)) {
+			watch_file = NULL;
+			goto err;
+		}
+	}
+
+	pr_info("Attached the watch subsystem successfully (slots: %u)\n", WATCH_NR_SLOTS);
+	return 0;
+
+err:
+	watch_shutdown();
+	return -1;
+
+err_release_slots:
+	watch_release_slots();
+	return -1;
+}
+
+void watch_shutdown(void)
+{
+	unsigned int slot;
+
+	if (!watch_hooked)
+		return;
+
+	debugfs_remove(watch_file);
+	watch_file = NULL;
+
+	mutex_lock(&watch_update_lock);
+	for (slot = 0; slot < WATCH_NR_SLOTS; slot++)
+		watch_slots[slot].armed = 0;
+	(void) watch_broadcast_locked();
+	watch_hooked = 0;
+	mutex_unlock(&watch_update_lock);
+
+	/* This waits for a grace period, so no CPU is left in the hook afterwards */
+	unregister_die_notifier(&watch_die_nb);
+	nmictrl_del_handler(WATCH_PROGRAM_HANDLER_NAME);
+	watch_release_slots();
+}
\ No newline at end of file
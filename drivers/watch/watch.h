@@ -0,0 +1,107 @@
+/**
+ * @file watch.h
+ * @brief Prototypes for 'watch subsystem'.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for 'watch subsystem'
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_WATCH_H
+#define _NMDBG_WATCH_H
+
+#include <linux/dcache.h>
+
+#include "nmictrl.h"
+#include "tracering.h"
+
+/* DR0-DR3 */
+#define WATCH_NR_SLOTS 4
+#define WATCH_FILE_NAME "watch"
+
+/**
+ * @brief Access types a watchpoint triggers on.
+ */
+typedef enum {
+	/** Data writes only */
+	WATCH_TYPE_WRITE = 0,
+	/** Data reads and writes */
+	WATCH_TYPE_RW,
+} watch_type_t;
+
+/**
+ * @brief Statistics of the watchpoints (aggregated over all CPUs when read).
+ */
+typedef struct {
+	/** Number of hits per slot */
+	u64 nr_hits[WATCH_NR_SLOTS];
+	/** Number of hits which could not be written into the trace ring */
+	u64 nr_dropped;
+	/** Number of NMI broadcasts which reprogrammed the debug registers */
+	u64 nr_updates;
+} watch_stat_t;
+
+/**
+ * @brief Activate the watch subsys.
+ *
+ * This function registers the programming handler to the nmictrl coresys
+ * and installs a debug exception hook which records hits into the trace ring.
+ * The nmictrl coresys and the tracering subsys must be started before.
+ *
+ * Every debug register is claimed from the hw_breakpoint framework until shutdown;
+ * it fails if perf, ptrace or kgdb hardware breakpoints are in use, and they cannot be created meanwhile.
+ *
+ * @param debugfs_dir
+ * 	debugfs directory to create the control file in (NULL to skip)
+ * @return
+ * 	0 if activation success.
+ */
+int watch_startup(struct dentry *debugfs_dir);
+
+/**
+ * @brief Deactivate the watch subsys.
+ *
+ * All slots are disarmed on every CPU before returning.
+ * This function must be called before the nmictrl coresys shuts down.
+ */
+void watch_shutdown(void);
+
+/**
+ * @brief Arm a watchpoint on every online CPU.
+ *
+ * The debug registers of all CPUs are reprogrammed in a single nmictrl broadcast.
+ *
+ * @param slot
+ * 	debug register slot (0 to WATCH_NR_SLOTS - 1)
+ * @param addr
+ * 	address to watch (aligned to @p len)
+ * @param len
+ * 	length of the watched range (1, 2, 4 or 8 bytes)
+ * @param type
+ * 	one of watch_type_t
+ * @return
+ * 	0 if every online CPU has been reprogrammed.
+ */
+int watch_set(unsigned int slot, unsigned long addr, unsigned int len, watch_type_t type);
+
+/**
+ * @brief Disarm a watchpoint on every online CPU.
+ *
+ * @param slot
+ * 	debug register slot (0 to WATCH_NR_SLOTS - 1)
+ * @return
+ * 	0 if every online CPU has been reprogrammed.
+ */
+int watch_clear(unsigned int slot);
+
+/**
+ * @brief Get the statistics of the watchpoints.
+ *
+ * @param stat
+ * 	statistics to be filled
+ */
+void watch_get_stat(watch_stat_t *stat);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,747 @@
+/**
+ * @file decode.c
+ * @brief The offline decoder for nmdbg dump and trace streams.
+ *
+ * This is implementations of 'nmdbg-decode'.
+ *
+ * The input file is mapped, not read, so multi-GB dumps never need to fit in memory.
+ * A first pass walks only the record headers to cut the stream into chunks on record boundaries,
+ * then worker threads decode chunks in parallel into private outputs which are concatenated in order.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "format.h"
+#include "symtab.h"
+
+#define DECODE_DEFAULT_CHUNK_MB 64
+#define DECODE_MAX_THREADS 256
+#define DECODE_NR_REC_TYPES (NMDBG_FMT_REC_WATCH + 1)
+
+/**
+ * @brief Output formats.
+ */
+typedef enum {
+	DECODE_FMT_TEXT,
+	DECODE_FMT_JSON,
+} decode_fmt_t;
+
+/**
+ * @brief A range of the input stream decoded by a single worker.
+ */
+typedef struct {
+	/** First byte of the chunk (record aligned) */
+	size_t chunk_begin;
+	/** End of the chunk (record aligned) */
+	size_t chunk_end;
+	/** Private output; the first chunk writes to the final output directly */
+	FILE *chunk_out;
+	/** Per-type record counters */
+	uint64_t nr_recs[DECODE_NR_REC_TYPES];
+	/** Number of malformed or unknown records */
+	uint64_t nr_bad;
+	/** Non-zero if the chunk could not be written */
+	int failed;
+} decode_chunk_t;
+
+/**
+ * @brief Decoder context shared (read-only) by all workers.
+ */
+typedef struct {
+	/** Mapped input */
+	const uint8_t *in_base;
+	size_t in_size;
+	/** End of the last complete record */
+	size_t in_end;
+	const nmdbg_fmt_file_t *file_hdr;
+
+	decode_fmt_t fmt;
+	int verbose;
+	symtab_t symtab;
+
+	/** TSC used as the origin of timestamps */
+	uint64_t base_tsc;
+	/** Summary of the (first) memdump in the stream */
+	const nmdbg_fmt_memdump_hdr_t *memdump_hdr;
+	/** Sparse image output (-1 if disabled) */
+	int image_fd;
+
+	decode_chunk_t *chunks;
+	size_t nr_chunks;
+	/** Next chunk to be claimed by a worker */
+	size_t next_chunk;
+} decode_ctx_t;
+
+static const char * const decode_rec_names[DECODE_NR_REC_TYPES] = {
+	[NMDBG_FMT_REC_NONE] = "none",
+	[NMDBG_FMT_REC_MEMDUMP_HDR] = "memdump",
+	[NMDBG_FMT_REC_MEMDUMP_INDEX] = "memdump-index",
+	[NMDBG_FMT_REC_MEMDUMP_PAGE] = "memdump-page",
+	[NMDBG_FMT_REC_REGS] = "regs",
+	[NMDBG_FMT_REC_SAMPLE] = "sample",
+	[NMDBG_FMT_REC_CRASH] = "crash",
+	[NMDBG_FMT_REC_WATCH] = "watch",
+};
+
+/**
+ * @brief Internal function to get the name of a register snapshot reason.
+ */
+static const char *decode_regs_reason(uint32_t reason)
+{
+	switch (reason) {
+	case NMDBG_FMT_REGS_SNAPSHOT:
+		return "snapshot";
+	case NMDBG_FMT_REGS_LOCKUP:
+		return "lockup";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * @brief Internal function to get the name of a crash kind.
+ */
+static const char *decode_crash_kind(uint32_t kind)
+{
+	switch (kind) {
+	case NMDBG_FMT_CRASH_PANIC:
+		return "panic";
+	case NMDBG_FMT_CRASH_OOPS:
+		return "oops";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * @brief Internal function to convert a TSC value into microseconds from the stream origin.
+ */
+static double decode_tsc_to_us(const decode_ctx_t *ctx, uint64_t tsc)
+{
+	double delta = (double)(int64_t)(tsc - ctx->base_tsc);
+
+	if (ctx->file_hdr->tsc_khz == 0)
+		return delta;
+	return delta * 1000.0 / (double)ctx->file_hdr->tsc_khz;
+}
+
+/**
+ * @brief Internal function to write a string as a JSON string literal.
+ */
+static void decode_json_string(FILE *out, const char *str, size_t max_len)
+{
+	size_t idx;
+
+	fputc('"', out);
+	for (idx = 0; idx < max_len && str[idx] != '\0'; idx++) {
+		unsigned char ch = (unsigned char)str[idx];
+
+		if (ch == '"' || ch == '\\')
+			fprintf(out, "\\%c", ch);
+		else if (ch < 0x20 || ch >= 0x7f)
+			fprintf(out, "\\u%04x", ch);
+		else
+			fputc(ch, out);
+	}
+	fputc('"', out);
+}
+
+/**
+ * @brief Internal function to test if a record is large enough for its type.
+ */
+static int decode_rec_sane(const nmdbg_fmt_rec_t *rec)
+{
+	static const size_t min_sizes[DECODE_NR_REC_TYPES] = {
+		[NMDBG_FMT_REC_NONE] = sizeof(nmdbg_fmt_rec_t),
+		[NMDBG_FMT_REC_MEMDUMP_HDR] = sizeof(nmdbg_fmt_memdump_hdr_t),
+		[NMDBG_FMT_REC_MEMDUMP_INDEX] = sizeof(nmdbg_fmt_memdump_index_t),
+		[NMDBG_FMT_REC_MEMDUMP_PAGE] = sizeof(nmdbg_fmt_memdump_page_t),
+		[NMDBG_FMT_REC_REGS] = sizeof(nmdbg_fmt_regs_rec_t),
+		[NMDBG_FMT_REC_SAMPLE] = sizeof(nmdbg_fmt_sample_rec_t),
+		[NMDBG_FMT_REC_CRASH] = sizeof(nmdbg_fmt_crash_rec_t),
+		[NMDBG_FMT_REC_WATCH] = sizeof(nmdbg_fmt_watch_rec_t),
+	};
+
+	if (rec->type >= DECODE_NR_REC_TYPES)
+		return 0;
+	if (rec->size < min_sizes[rec->type])
+		return 0;
+	if (rec->type == NMDBG_FMT_REC_MEMDUMP_INDEX) {
+		const nmdbg_fmt_memdump_index_t *index_ptr = (const void *)rec;
+
+		return index_ptr->nr_ranges <= NMDBG_FMT_MEMDUMP_INDEX_MAX &&
+			rec->size >= sizeof(*index_ptr) + index_ptr->nr_ranges * sizeof(index_ptr->ranges[0]);
+	}
+	return 1;
+}
+
+/**
+ * @brief Internal function to decode a single record as text.
+ */
+static void decode_text_rec(decode_ctx_t *ctx, FILE *out, const nmdbg_fmt_rec_t *rec)
+{
+	char sym_buf[256];
+
+	fprintf(out, "[%16.3f] cpu%-3u %-14s ", decode_tsc_to_us(ctx, rec->tsc), rec->cpu,
+		decode_rec_names[rec->type]);
+
+	switch (rec->type) {
+	case NMDBG_FMT_REC_MEMDUMP_HDR: {
+		const nmdbg_fmt_memdump_hdr_t *hdr_ptr = (const void *)rec;
+
+		fprintf(out, "kept %" PRIu64 "/%" PRIu64 " pages (%.2f%%) in %" PRIu64 " ranges, "
+			"free %" PRIu64 ", zero %" PRIu64 ", user %" PRIu64 ", page_size %" PRIu32 "\n",
+			(uint64_t)hdr_ptr->nr_dumped, (uint64_t)hdr_ptr->nr_total,
+			!!hdr_ptr->nr_total ? 100.0 * hdr_ptr->nr_dumped / hdr_ptr->nr_total : 0.0,
+			(uint64_t)hdr_ptr->nr_ranges, (uint64_t)hdr_ptr->nr_free,
+			(uint64_t)hdr_ptr->nr_zero, (uint64_t)hdr_ptr->nr_user, hdr_ptr->page_size);
+		break;
+	}
+	case NMDBG_FMT_REC_MEMDUMP_INDEX: {
+		const nmdbg_fmt_memdump_index_t *index_ptr = (const void *)rec;
+		uint32_t idx;
+
+		fprintf(out, "%" PRIu32 " ranges\n", index_ptr->nr_ranges);
+		if (!ctx->verbose)
+			break;
+		for (idx = 0; idx < index_ptr->nr_ranges; idx++)
+			fprintf(out, "\tpfn 0x%" PRIx64 " +%" PRIu64 "\n",
+				(uint64_t)index_ptr->ranges[idx].start_pfn, (uint64_t)index_ptr->ranges[idx].nr_pages);
+		break;
+	}
+	case NMDBG_FMT_REC_MEMDUMP_PAGE: {
+		const nmdbg_fmt_memdump_page_t *page_ptr = (const void *)rec;
+
+		fprintf(out, "pfn 0x%" PRIx64 "\n", (uint64_t)page_ptr->pfn);
+		break;
+	}
+	case NMDBG_FMT_REC_REGS: {
+		const nmdbg_fmt_regs_rec_t *regs_ptr = (const void *)rec;
+		const nmdbg_fmt_regs_t *regs = &regs_ptr->regs;
+
+		fprintf(out, "%s pid %" PRIu32 " comm %.*s ip %s\n",
+			decode_regs_reason(regs_ptr->reason), regs_ptr->pid,
+			NMDBG_FMT_COMM_LEN, regs_ptr->comm,
+			symtab_resolve(&ctx->symtab, regs->ip, sym_buf, sizeof(sym_buf)));
+		if (!ctx->verbose)
+			break;
+		fprintf(out, "\tRSP: %016" PRIx64 " EFLAGS: %08" PRIx64 " CS: %04" PRIx64 " SS: %04" PRIx64 "\n",
+			(uint64_t)regs->sp, (uint64_t)regs->flags, (uint64_t)regs->cs, (uint64_t)regs->ss);
+		fprintf(out, "\tRAX: %016" PRIx64 " RBX: %016" PRIx64 " RCX: %016" PRIx64 "\n",
+			(uint64_t)regs->ax, (uint64_t)regs->bx, (uint64_t)regs->cx);
+		fprintf(out, "\tRDX: %016" PRIx64 " RSI: %016" PRIx64 " RDI: %016" PRIx64 "\n",
+			(uint64_t)regs->dx, (uint64_t)regs->si, (uint64_t)regs->di);
+		fprintf(out, "\tRBP: %016" PRIx64 " R08: %016" PRIx64 " R09: %016" PRIx64 "\n",
+			(uint64_t)regs->bp, (uint64_t)regs->r8, (uint64_t)regs->r9);
+		fprintf(out, "\tR10: %016" PRIx64 " R11: %016" PRIx64 " R12: %016" PRIx64 "\n",
+			(uint64_t)regs->r10, (uint64_t)regs->r11, (uint64_t)regs->r12);
+		fprintf(out, "\tR13: %016" PRIx64 " R14: %016" PRIx64 " R15: %016" PRIx64 "\n",
+			(uint64_t)regs->r13, (uint64_t)regs->r14, (uint64_t)regs->r15);
+		break;
+	}
+	case NMDBG_FMT_REC_SAMPLE: {
+		const nmdbg_fmt_sample_rec_t *sample_ptr = (const void *)rec;
+
+		fprintf(out, "id %" PRIu32 " ip %s arg 0x%" PRIx64 "\n", sample_ptr->id,
+			symtab_resolve(&ctx->symtab, sample_ptr->ip, sym_buf, sizeof(sym_buf)),
+			(uint64_t)sample_ptr->arg);
+		break;
+	}
+	case NMDBG_FMT_REC_CRASH: {
+		const nmdbg_fmt_crash_rec_t *crash_ptr = (const void *)rec;
+
+		fprintf(out, "%s at %s: %.*s\n", decode_crash_kind(crash_ptr->kind),
+			symtab_resolve(&ctx->symtab, crash_ptr->ip, sym_buf, sizeof(sym_buf)),
+			NMDBG_FMT_CRASH_MSG_LEN, crash_ptr->msg);
+		break;
+	}
+	case NMDBG_FMT_REC_WATCH: {
+		const nmdbg_fmt_watch_rec_t *watch_ptr = (const void *)rec;
+
+		fprintf(out, "slot %" PRIu32 " addr 0x%" PRIx64 " ip %s\n", watch_ptr->slot,
+			(uint64_t)watch_ptr->addr,
+			symtab_resolve(&ctx->symtab, watch_ptr->ip, sym_buf, sizeof(sym_buf)));
+		break;
+	}
+	default:
+		fprintf(out, "size %" PRIu32 "\n", rec->size);
+		break;
+	}
+}
+
+/**
+ * @brief Internal function to decode a single record as a Chrome trace event.
+ *
+ * Every event is followed by a comma; the trailer closes the array with metadata events.
+ */
+static void decode_json_rec(decode_ctx_t *ctx, FILE *out, const nmdbg_fmt_rec_t *rec)
+{
+	char sym_buf[256];
+	double ts = decode_tsc_to_us(ctx, rec->tsc);
+
+	switch (rec->type) {
+	case NMDBG_FMT_REC_MEMDUMP_HDR: {
+		const nmdbg_fmt_memdump_hdr_t *hdr_ptr = (const void *)rec;
+
+		fprintf(out, "{\"name\":\"memdump\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+			"\"args\":{\"nr_total\":%" PRIu64 ",\"nr_dumped\":%" PRIu64 ",\"nr_free\":%" PRIu64
+			",\"nr_zero\":%" PRIu64 ",\"nr_user\":%" PRIu64 "}},\n",
+			rec->cpu, ts, (uint64_t)hdr_ptr->nr_total, (uint64_t)hdr_ptr->nr_dumped,
+			(uint64_t)hdr_ptr->nr_free, (uint64_t)hdr_ptr->nr_zero, (uint64_t)hdr_ptr->nr_user);
+		break;
+	}
+	case NMDBG_FMT_REC_REGS: {
+		const nmdbg_fmt_regs_rec_t *regs_ptr = (const void *)rec;
+
+		fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+			"\"args\":{\"pid\":%" PRIu32 ",\"comm\":",
+			decode_regs_reason(regs_ptr->reason), rec->cpu, ts, regs_ptr->pid);
+		decode_json_string(out, regs_ptr->comm, NMDBG_FMT_COMM_LEN);
+		fputs(",\"ip\":", out);
+		decode_json_string(out, symtab_resolve(&ctx->symtab, regs_ptr->regs.ip, sym_buf, sizeof(sym_buf)),
+			sizeof(sym_buf));
+		fputs("}},\n", out);
+		break;
+	}
+	case NMDBG_FMT_REC_SAMPLE: {
+		const nmdbg_fmt_sample_rec_t *sample_ptr = (const void *)rec;
+
+		fprintf(out, "{\"name\":\"sample-%" PRIu32 "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+			"\"args\":{\"arg\":%" PRIu64 ",\"ip\":",
+			sample_ptr->id, rec->cpu, ts, (uint64_t)sample_ptr->arg);
+		decode_json_string(out, symtab_resolve(&ctx->symtab, sample_ptr->ip, sym_buf, sizeof(sym_buf)),
+			sizeof(sym_buf));
+		fputs("}},\n", out);
+		break;
+	}
+	case NMDBG_FMT_REC_CRASH: {
+		const nmdbg_fmt_crash_rec_t *crash_ptr = (const void *)rec;
+
+		fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"msg\":",
+			decode_crash_kind(crash_ptr->kind), rec->cpu, ts);
+		decode_json_string(out, crash_ptr->msg, NMDBG_FMT_CRASH_MSG_LEN);
+		fputs(",\"ip\":", out);
+		decode_json_string(out, symtab_resolve(&ctx->symtab, crash_ptr->ip, sym_buf, sizeof(sym_buf)),
+			sizeof(sym_buf));
+		fputs("}},\n", out);
+		break;
+	}
+	case NMDBG_FMT_REC_WATCH: {
+		const nmdbg_fmt_watch_rec_t *watch_ptr = (const void *)rec;
+
+		fprintf(out, "{\"name\":\"watch-%" PRIu32 "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+			"\"args\":{\"addr\":\"0x%" PRIx64 "\",\"ip\":",
+			watch_ptr->slot, rec->cpu, ts, (uint64_t)watch_ptr->addr);
+		decode_json_string(out, symtab_resolve(&ctx->symtab, watch_ptr->ip, sym_buf, sizeof(sym_buf)),
+			sizeof(sym_buf));
+		fputs("}},\n", out);
+		break;
+	}
+	default:
+		/* Index and page records have no place on a timeline */
+		break;
+	}
+}
+
+/**
+ * @brief Internal function to write a page into the sparse image.
+ */
+static int decode_image_page(decode_ctx_t *ctx, const nmdbg_fmt_rec_t *rec)
+{
+	const nmdbg_fmt_memdump_page_t *page_ptr = (const void *)rec;
+	size_t page_size;
+
+	if (ctx->image_fd < 0 || ctx->memdump_hdr == NULL)
+		return 0;
+
+	page_size = ctx->memdump_hdr->page_size;
+	if (rec->size < sizeof(*page_ptr) + page_size)
+		return -1;
+
+	if (pwrite(ctx->image_fd, page_ptr->data, page_size, (off_t)(page_ptr->pfn * page_size)) != (ssize_t)page_size)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief Internal function to decode all records of a chunk.
+ */
+static void decode_chunk(decode_ctx_t *ctx, decode_chunk_t *chunk)
+{
+	size_t offset = chunk->chunk_begin;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t drop_begin = (chunk->chunk_begin + page_size - 1) & ~(size_t)(page_size - 1);
+
+	while (offset < chunk->chunk_end) {
+		const nmdbg_fmt_rec_t *rec = (const void *)(ctx->in_base + offset);
+
+		offset += rec->size;
+
+		if (!decode_rec_sane(rec)) {
+			chunk->nr_bad++;
+			continue;
+		}
+		chunk->nr_recs[rec->type]++;
+
+		if (rec->type == NMDBG_FMT_REC_MEMDUMP_PAGE && !!decode_image_page(ctx, rec))
+			chunk->failed = 1;
+
+		if (rec->type == NMDBG_FMT_REC_MEMDUMP_PAGE && !ctx->verbose)
+			continue;
+
+		if (ctx->fmt == DECODE_FMT_JSON)
+			decode_json_rec(ctx, chunk->chunk_out, rec);
+		else
+			decode_text_rec(ctx, chunk->chunk_out, rec);
+	}
+
+	/*
+	 * Decoded pages will never be touched again; drop them from our address space
+	 * so that the resident size stays bounded by the number of workers.
+	 */
+	if (chunk->chunk_end > drop_begin)
+		madvise((void *)(ctx->in_base + drop_begin),
+			(chunk->chunk_end - drop_begin) & ~(size_t)(page_size - 1), MADV_DONTNEED);
+
+	if (ferror(chunk->chunk_out))
+		chunk->failed = 1;
+}
+
+/**
+ * @brief Internal worker thread claiming chunks until none remains.
+ */
+static void *decode_worker(void *arg)
+{
+	decode_ctx_t *ctx = arg;
+	size_t chunk_idx;
+
+	while ((chunk_idx = __atomic_fetch_add(&ctx->next_chunk, 1, __ATOMIC_RELAXED)) < ctx->nr_chunks)
+		decode_chunk(ctx, &ctx->chunks[chunk_idx]);
+	return NULL;
+}
+
+/**
+ * @brief Internal function to cut the stream into chunks on record boundaries.
+ *
+ * Only record headers are touched here.
+ *
+ * @param ctx
+ * 	decoder context
+ * @param chunk_size
+ * 	preferred size of a chunk (bytes)
+ * @return
+ * 	0 if the stream was split.
+ */
+static int decode_split(decode_ctx_t *ctx, size_t chunk_size)
+{
+	size_t offset = ctx->file_hdr->hdr_size, chunk_begin = offset, max_chunks = 0;
+	int has_tsc = 0;
+
+	while (offset + sizeof(nmdbg_fmt_rec_t) <= ctx->in_size) {
+		const nmdbg_fmt_rec_t *rec = (const void *)(ctx->in_base + offset);
+
+		if (rec->size < sizeof(*rec) || (rec->size % NMDBG_FMT_ALIGN) != 0 ||
+			rec->size > ctx->in_size - offset) {
+			if (rec->type != NMDBG_FMT_REC_NONE || rec->size != 0)
+				fprintf(stderr, "nmdbg-decode: stream is corrupted at offset %zu\n", offset);
+			break;
+		}
+
+		if (rec->tsc != 0 && (!has_tsc || rec->tsc < ctx->base_tsc)) {
+			ctx->base_tsc = rec->tsc;
+			has_tsc = 1;
+		}
+		if (rec->type == NMDBG_FMT_REC_MEMDUMP_HDR && ctx->memdump_hdr == NULL && decode_rec_sane(rec))
+			ctx->memdump_hdr = (const void *)rec;
+
+		offset += rec->size;
+
+		if (offset - chunk_begin >= chunk_size) {
+			if (ctx->nr_chunks == max_chunks) {
+				decode_chunk_t *chunks;
+
+				max_chunks = !!max_chunks ? max_chunks * 2 : 64;
+				chunks = realloc(ctx->chunks, max_chunks * sizeof(*chunks));
+				if (chunks == NULL)
+					return -1;
+				ctx->chunks = chunks;
+			}
+			memset(&ctx->chunks[ctx->nr_chunks], 0, sizeof(ctx->chunks[0]));
+			ctx->chunks[ctx->nr_chunks].chunk_begin = chunk_begin;
+			ctx->chunks[ctx->nr_chunks].chunk_end = offset;
+			ctx->nr_chunks++;
+			chunk_begin = offset;
+		}
+	}
+
+	ctx->in_end = offset;
+	if (chunk_begin < offset || ctx->nr_chunks == 0) {
+		decode_chunk_t *chunks = realloc(ctx->chunks, (ctx->nr_chunks + 1) * sizeof(*chunks));
+
+		if (chunks == NULL)
+			return -1;
+		ctx->chunks = chunks;
+		memset(&ctx->chunks[ctx->nr_chunks], 0, sizeof(ctx->chunks[0]));
+		ctx->chunks[ctx->nr_chunks].chunk_begin = chunk_begin;
+		ctx->chunks[ctx->nr_chunks].chunk_end = offset;
+		ctx->nr_chunks++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Internal function to append a finished private output to the final output.
+ */
+static int decode_concat(FILE *out, FILE *chunk_out)
+{
+	char buf[65536];
+	size_t len;
+
+	rewind(chunk_out);
+	while ((len = fread(buf, 1, sizeof(buf), chunk_out)) > 0)
+		if (fwrite(buf, 1, len, out) != len)
+			return -1;
+	return ferror(chunk_out) ? -1 : 0;
+}
+
+/**
+ * @brief Internal function to print the usage.
+ */
+static void decode_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] <dump>\n"
+		"  -f <text|json>  output format (json: Chrome trace timeline)\n"
+		"  -s <file>       System.map or kallsyms export for symbolization\n"
+		"  -o <file>       output file (default: stdout)\n"
+		"  -x <file>       reconstruct a sparse memory image from memdump pages\n"
+		"  -j <threads>    number of worker threads (default: online CPUs)\n"
+		"  -c <MiB>        chunk size per worker job (default: %d)\n"
+		"  -v              verbose (index ranges, every page, full registers)\n",
+		prog, DECODE_DEFAULT_CHUNK_MB);
+}
+
+int main(int argc, char **argv)
+{
+	decode_ctx_t ctx;
+	pthread_t threads[DECODE_MAX_THREADS];
+	uint64_t nr_recs[DECODE_NR_REC_TYPES] = {0, };
+	uint64_t nr_bad = 0;
+	const char *sym_path = NULL, *out_path = NULL, *image_path = NULL;
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t chunk_size = (size_t)DECODE_DEFAULT_CHUNK_MB << 20;
+	size_t idx;
+	struct stat in_stat;
+	FILE *out = stdout;
+	int in_fd, opt, ret = EXIT_FAILURE;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fmt = DECODE_FMT_TEXT;
+	ctx.image_fd = -1;
+
+	while ((opt = getopt(argc, argv, "f:s:o:x:j:c:vh")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				ctx.fmt = DECODE_FMT_JSON;
+			else if (strcmp(optarg, "text") == 0)
+				ctx.fmt = DECODE_FMT_TEXT;
+			else
+				goto usage;
+			break;
+		case 's':
+			sym_path = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'x':
+			image_path = optarg;
+			break;
+		case 'j':
+			nr_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			chunk_size = (size_t)strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'v':
+			ctx.verbose = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind + 1 != argc || chunk_size == 0)
+		goto usage;
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > DECODE_MAX_THREADS)
+		nr_threads = DECODE_MAX_THREADS;
+
+	if (sym_path != NULL && !!symtab_load(&ctx.symtab, sym_path)) {
+		fprintf(stderr, "nmdbg-decode: failed to load symbols from %s\n", sym_path);
+		return EXIT_FAILURE;
+	}
+
+	in_fd = open(argv[optind], O_RDONLY);
+	if (in_fd < 0) {
+		fprintf(stderr, "nmdbg-decode: %s: %s\n", argv[optind], strerror(errno));
+		goto err_symtab;
+	}
+	if (fstat(in_fd, &in_stat) < 0) {
+		fprintf(stderr, "nmdbg-decode: %s: %s\n", argv[optind], strerror(errno));
+		goto err_close;
+	}
+	ctx.in_size = (size_t)in_stat.st_size;
+	if (ctx.in_size < sizeof(nmdbg_fmt_file_t)) {
+		fprintf(stderr, "nmdbg-decode: %s: too short\n", argv[optind]);
+		goto err_close;
+	}
+
+	ctx.in_base = mmap(NULL, ctx.in_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+	if (ctx.in_base == MAP_FAILED) {
+		fprintf(stderr, "nmdbg-decode: mmap: %s\n", strerror(errno));
+		goto err_close;
+	}
+	madvise((void *)ctx.in_base, ctx.in_size, MADV_SEQUENTIAL);
+
+	ctx.file_hdr = (const void *)ctx.in_base;
+	if (ctx.file_hdr->magic != NMDBG_FMT_MAGIC ||
+		ctx.file_hdr->version != NMDBG_FMT_VERSION ||
+		ctx.file_hdr->hdr_size < sizeof(nmdbg_fmt_file_t) ||
+		ctx.file_hdr->hdr_size > ctx.in_size) {
+		fprintf(stderr, "nmdbg-decode: %s: not an nmdbg stream\n", argv[optind]);
+		goto err_unmap;
+	}
+	if (!!(ctx.file_hdr->flags & NMDBG_FMT_FILE_TRUNCATED))
+		fprintf(stderr, "nmdbg-decode: warning: the producer truncated this stream\n");
+
+	if (!!decode_split(&ctx, chunk_size)) {
+		fprintf(stderr, "nmdbg-decode: out of memory\n");
+		goto err_unmap;
+	}
+
+	if (image_path != NULL) {
+		if (ctx.memdump_hdr == NULL) {
+			fprintf(stderr, "nmdbg-decode: no memdump in the stream\n");
+			goto err_chunks;
+		}
+		ctx.image_fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (ctx.image_fd < 0 ||
+			ftruncate(ctx.image_fd, (off_t)(ctx.memdump_hdr->max_pfn * ctx.memdump_hdr->page_size)) < 0) {
+			fprintf(stderr, "nmdbg-decode: %s: %s\n", image_path, strerror(errno));
+			goto err_image;
+		}
+	}
+
+	if (out_path != NULL) {
+		out = fopen(out_path, "w");
+		if (out == NULL) {
+			fprintf(stderr, "nmdbg-decode: %s: %s\n", out_path, strerror(errno));
+			goto err_image;
+		}
+	}
+
+	if (ctx.fmt == DECODE_FMT_JSON)
+		fputs("{\"traceEvents\":[\n", out);
+
+	/*
+	 * The first chunk is written in place; the others go to temporary files.
+	 */
+	ctx.chunks[0].chunk_out = out;
+	for (idx = 1; idx < ctx.nr_chunks; idx++) {
+		ctx.chunks[idx].chunk_out = tmpfile();
+		if (ctx.chunks[idx].chunk_out == NULL) {
+			fprintf(stderr, "nmdbg-decode: tmpfile: %s\n", strerror(errno));
+			goto err_tmp;
+		}
+	}
+
+	if ((size_t)nr_threads > ctx.nr_chunks)
+		nr_threads = (long)ctx.nr_chunks;
+	for (idx = 0; idx < (size_t)nr_threads; idx++) {
+		if (pthread_create(&threads[idx], NULL, decode_worker, &ctx) != 0) {
+			nr_threads = (long)idx;
+			break;
+		}
+	}
+	/* Decode inline if no thread could be spawned */
+	if (nr_threads == 0)
+		decode_worker(&ctx);
+	for (idx = 0; idx < (size_t)nr_threads; idx++)
+		pthread_join(threads[idx], NULL);
+
+	ret = EXIT_SUCCESS;
+	for (idx = 0; idx < ctx.nr_chunks; idx++) {
+		size_t type;
+
+		if (!!ctx.chunks[idx].failed ||
+			(idx > 0 && !!decode_concat(out, ctx.chunks[idx].chunk_out)))
+			ret = EXIT_FAILURE;
+		for (type = 0; type < DECODE_NR_REC_TYPES; type++)
+			nr_recs[type] += ctx.chunks[idx].nr_recs[type];
+		nr_bad += ctx.chunks[idx].nr_bad;
+	}
+
+	if (ctx.fmt == DECODE_FMT_JSON) {
+		uint32_t cpu;
+
+		for (cpu = 0; cpu < ctx.file_hdr->nr_cpus; cpu++)
+			fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%" PRIu32
+				",\"args\":{\"name\":\"cpu%" PRIu32 "\"}},\n", cpu, cpu);
+		fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"nmdbg\"}}\n"
+			"],\"displayTimeUnit\":\"ns\",\"otherData\":{\"tsc_khz\":%" PRIu64 ",\"base_tsc\":%" PRIu64 "}}\n",
+			(uint64_t)ctx.file_hdr->tsc_khz, ctx.base_tsc);
+	}
+
+	fprintf(stderr, "nmdbg-decode: %zu bytes, %zu chunks, %ld threads\n",
+		ctx.in_end, ctx.nr_chunks, nr_threads);
+	for (idx = 1; idx < DECODE_NR_REC_TYPES; idx++)
+		if (!!nr_recs[idx])
+			fprintf(stderr, "nmdbg-decode: %-14s %" PRIu64 "\n", decode_rec_names[idx], nr_recs[idx]);
+	if (!!nr_bad)
+		fprintf(stderr, "nmdbg-decode: %-14s %" PRIu64 "\n", "malformed", nr_bad);
+	if (ctx.memdump_hdr != NULL && !!ctx.memdump_hdr->nr_total)
+		fprintf(stderr, "nmdbg-decode: memdump kept %.2f%% of a full dump (%" PRIu64 " of %" PRIu64 " pages)\n",
+			100.0 * ctx.memdump_hdr->nr_dumped / ctx.memdump_hdr->nr_total,
+			(uint64_t)ctx.memdump_hdr->nr_dumped, (uint64_t)ctx.memdump_hdr->nr_total);
+
+err_tmp:
+	for (idx = 1; idx < ctx.nr_chunks; idx++)
+		if (ctx.chunks[idx].chunk_out != NULL)
+			fclose(ctx.chunks[idx].chunk_out);
+	if (out != stdout && fclose(out) != 0)
+		ret = EXIT_FAILURE;
+	else if (out == stdout && fflush(out) != 0)
+		ret = EXIT_FAILURE;
+err_image:
+	if (ctx.image_fd >= 0 && close(ctx.image_fd) != 0)
+		ret = EXIT_FAILURE;
+err_chunks:
+	free(ctx.chunks);
+err_unmap:
+	munmap((void *)ctx.in_base, ctx.in_size);
+err_close:
+	close(in_fd);
+err_symtab:
+	symtab_free(&ctx.symtab);
+	return ret;
+
+usage:
+	decode_usage(argv[0]);
+	return EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,157 @@
+/**
+ * @file symtab.c
+ * @brief The symbol table of nmdbg-decode.
+ *
+ * This is implementations of the symbol table of nmdbg-decode
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#include "symtab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* Symbols farther than this from the nearest symbol are treated as unknown */
+#define SYMTAB_MAX_OFFSET 0x100000
+
+/**
+ * @brief Internal function to append a symbol.
+ */
+static int symtab_push(symtab_t *symtab, uint64_t addr, const char *name, size_t name_len)
+{
+	if (symtab->nr_syms == symtab->max_syms) {
+		size_t max_syms = !!symtab->max_syms ? symtab->max_syms * 2 : 4096;
+		symtab_sym_t *syms = realloc(symtab->syms, max_syms * sizeof(*syms));
+
+		if (syms == NULL)
+			return -1;
+		symtab->syms = syms;
+		symtab->max_syms = max_syms;
+	}
+
+	if (symtab->pool_len + name_len + 1 > symtab->pool_max) {
+		size_t pool_max = !!symtab->pool_max ? symtab->pool_max * 2 : 65536;
+		char *pool;
+
+		while (symtab->pool_len + name_len + 1 > pool_max)
+			pool_max *= 2;
+		pool = realloc(symtab->pool, pool_max);
+		if (pool == NULL)
+			return -1;
+		symtab->pool = pool;
+		symtab->pool_max = pool_max;
+	}
+
+	symtab->syms[symtab->nr_syms].sym_addr = addr;
+	symtab->syms[symtab->nr_syms].sym_name = symtab->pool_len;
+	symtab->nr_syms++;
+
+	memcpy(symtab->pool + symtab->pool_len, name, name_len);
+	symtab->pool[symtab->pool_len + name_len] = '\0';
+	symtab->pool_len += name_len + 1;
+	return 0;
+}
+
+/**
+ * @brief Internal function to compare symbols by address.
+ */
+static int symtab_compare(const void *lhs, const void *rhs)
+{
+	const symtab_sym_t *lsym = lhs, *rsym = rhs;
+
+	if (lsym->sym_addr < rsym->sym_addr)
+		return -1;
+	return lsym->sym_addr > rsym->sym_addr;
+}
+
+int symtab_load(symtab_t *symtab, const char *path)
+{
+	FILE *fp;
+	char line[512];
+
+	memset(symtab, 0, sizeof(*symtab));
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	/*
+	 * Both formats share 'address type name [module]' lines.
+	 */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *endp, *name, *module;
+		char full_name[sizeof(line)];
+		uint64_t addr;
+		int name_len, module_len;
+
+		addr = strtoull(line, &endp, 16);
+		if (endp == line || addr == 0)
+			continue;
+
+		/* Skip the type column */
+		name = endp + strspn(endp, " \t");
+		if (*name == '\0')
+			continue;
+		name += strcspn(name, " \t");
+		name += strspn(name, " \t");
+
+		name_len = (int)strcspn(name, " \t\r\n");
+		if (name_len == 0)
+			continue;
+
+		/* Keep the '[module]' column of kallsyms as a suffix */
+		module = name + name_len;
+		module += strspn(module, " \t");
+		module_len = (*module == '[') ? (int)strcspn(module, " \t\r\n") : 0;
+
+		name_len = snprintf(full_name, sizeof(full_name), "%.*s%.*s",
+			name_len, name, module_len, module);
+
+		if (!!symtab_push(symtab, addr, full_name, (size_t)name_len)) {
+			fclose(fp);
+			symtab_free(symtab);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	qsort(symtab->syms, symtab->nr_syms, sizeof(*symtab->syms), symtab_compare);
+	return 0;
+}
+
+void symtab_free(symtab_t *symtab)
+{
+	free(symtab->syms);
+	free(symtab->pool);
+	memset(symtab, 0, sizeof(*symtab));
+}
+
+const char *symtab_resolve(const symtab_t *symtab, uint64_t addr, char *buf, size_t len)
+{
+	size_t lo = 0, hi = symtab->nr_syms;
+
+	/*
+	 * Find the last symbol whose address is lower than or equal to 'addr'.
+	 */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (symtab->syms[mid].sym_addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0 || addr - symtab->syms[lo - 1].sym_addr > SYMTAB_MAX_OFFSET) {
+		snprintf(buf, len, "0x%016" PRIx64, addr);
+		return buf;
+	}
+
+	snprintf(buf, len, "%s+0x%" PRIx64,
+		symtab->pool + symtab->syms[lo - 1].sym_name, addr - symtab->syms[lo - 1].sym_addr);
+	return buf;
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+/**
+ * @file symtab.h
+ * @brief Prototypes for the symbol table of nmdbg-decode.
+ *
+ * This contains the function prototypes, macros,
+ * structures, enums, etc. for the symbol table of nmdbg-decode.
+ *
+ * @author Hyeonho Seo (Revimal)
+ * @bug No Known Bugs
+ */
+
+#ifndef _NMDBG_DECODE_SYMTAB_H
+#define _NMDBG_DECODE_SYMTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A single symbol.
+ */
+typedef struct {
+	/** Symbol address */
+	uint64_t sym_addr;
+	/** Offset of the NUL-terminated name in the string pool */
+	size_t sym_name;
+} symtab_sym_t;
+
+/**
+ * @brief Sorted symbol index.
+ *
+ * Once loaded, the index is read-only and can be shared between threads.
+ */
+typedef struct {
+	/** Symbols sorted by address */
+	symtab_sym_t *syms;
+	size_t nr_syms;
+	size_t max_syms;
+	/** String pool */
+	char *pool;
+	size_t pool_len;
+	size_t pool_max;
+} symtab_t;
+
+/**
+ * @brief Load a System.map or /proc/kallsyms export.
+ *
+ * @param symtab
+ * 	symbol table to be filled
+ * @param path
+ * 	path of the symbol file
+ * @return
+ * 	0 if the file was loaded.
+ */
+int symtab_load(symtab_t *symtab, const char *path);
+
+/**
+ * @brief Release a symbol table.
+ */
+void symtab_free(symtab_t *symtab);
+
+/**
+ * @brief Resolve an address into 'symbol+offset'.
+ *
+ * @param symtab
+ * 	symbol table (could be empty)
+ * @param addr
+ * 	address to resolve
+ * @param buf
+ * 	output buffer
+ * @param len
+ * 	size of @p buf
+ * @return
+ * 	@p buf (always filled; falls back to the raw address)
+ */
+const char *symtab_resolve(const symtab_t *symtab, uint64_t addr, char *buf, size_t len);
+
+#endif
\ No newline at end of file